@@ -0,0 +1,167 @@
+/*
+ * Per-call versus batched ashmem pinning
+ *
+ * Maps an ashmem region and repeatedly unpins and re-pins every other
+ * page of it, once with one ASHMEM_UNPIN/ASHMEM_PIN per page and once
+ * with ASHMEM_UNPIN_BATCH/ASHMEM_PIN_BATCH, and prints the throughput of
+ * each in ranges per second.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * Cross-compile with cross-gcc -I/path/to/kernel/usr/include
+ * (add -lrt for clock_gettime() on older C libraries)
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/ashmem.h>
+
+static const char *device = "/dev/ashmem";
+static int pages = 256;
+static int rounds = 1000;
+static int batch;
+
+static void fail(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-p pages] [-r rounds] [-b batch] [device]\n", prog);
+	puts("  -p --pages   size of the region (default 256)\n"
+	     "  -r --rounds  unpin/pin rounds per method (default 1000)\n"
+	     "  -b --batch   ranges per batch ioctl (default all of them)");
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void per_call(int fd, struct ashmem_pin *pins, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (ioctl(fd, ASHMEM_UNPIN, &pins[i]) < 0)
+			fail("ASHMEM_UNPIN");
+	for (i = 0; i < n; i++)
+		if (ioctl(fd, ASHMEM_PIN, &pins[i]) < 0)
+			fail("ASHMEM_PIN");
+}
+
+static void batched(int fd, struct ashmem_pin *pins, int n)
+{
+	struct ashmem_pin_batch b = { 0 };
+	int i;
+
+	for (i = 0; i < n; i += b.count) {
+		b.pins = (uintptr_t)(pins + i);
+		b.count = n - i < batch ? n - i : batch;
+		if (ioctl(fd, ASHMEM_UNPIN_BATCH, &b) < 0)
+			fail("ASHMEM_UNPIN_BATCH");
+	}
+	for (i = 0; i < n; i += b.count) {
+		b.pins = (uintptr_t)(pins + i);
+		b.count = n - i < batch ? n - i : batch;
+		if (ioctl(fd, ASHMEM_PIN_BATCH, &b) < 0)
+			fail("ASHMEM_PIN_BATCH");
+	}
+}
+
+static double run(const char *name, int fd, struct ashmem_pin *pins, int n,
+		  void (*fn)(int, struct ashmem_pin *, int))
+{
+	double t = now(), rate;
+	int i;
+
+	for (i = 0; i < rounds; i++)
+		fn(fd, pins, n);
+	t = now() - t;
+	rate = 2.0 * n * rounds / t;
+	printf("%-9s %d x %d ranges in %.3f s: %.0f ranges/s\n", name,
+	       rounds, 2 * n, t, rate);
+	return rate;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "pages",  1, 0, 'p' },
+		{ "rounds", 1, 0, 'r' },
+		{ "batch",  1, 0, 'b' },
+		{ NULL, 0, 0, 0 },
+	};
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct ashmem_pin *pins;
+	double single, vec;
+	int fd, n, i, c;
+	void *map;
+
+	while ((c = getopt_long(argc, argv, "p:r:b:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			pages = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (pages < 2 || rounds < 1)
+		print_usage(argv[0]);
+
+	fd = open(device, O_RDWR);
+	if (fd < 0)
+		fail("open");
+	if (ioctl(fd, ASHMEM_SET_SIZE, (size_t)pages * page_size) < 0)
+		fail("ASHMEM_SET_SIZE");
+	/* pinning only works on a mapped region */
+	map = mmap(NULL, pages * page_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		fail("mmap");
+
+	/* every other page, so that no two ranges can be coalesced */
+	n = pages / 2;
+	if (batch <= 0)
+		batch = n;
+	pins = calloc(n, sizeof(*pins));
+	if (!pins)
+		fail("calloc");
+	for (i = 0; i < n; i++) {
+		pins[i].offset = 2 * i * page_size;
+		pins[i].len = page_size;
+	}
+
+	single = run("per-call", fd, pins, n, per_call);
+	vec = run("batched", fd, pins, n, batched);
+	printf("batched/per-call: %.2fx\n", vec / single);
+
+	munmap(map, pages * page_size);
+	close(fd);
+	return 0;
+}
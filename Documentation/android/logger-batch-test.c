@@ -0,0 +1,138 @@
+/*
+ * Batched read test for the Android logger (LOGGER_SET_BATCH_READ)
+ *
+ * Writes entries of different sizes to a log, reads them back in one
+ * batch and checks that the batch consists of whole, correctly framed
+ * entries and that the next read starts on an entry boundary again.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * Cross-compile with cross-gcc -I/path/to/kernel/drivers/staging/android
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+
+#define TAG		"logger-batch-test"
+
+static const char *device = "/dev/log/main";
+static const int sizes[] = { 1, 300, 17, 1000, 64 };
+#define NR_ENTRIES	((int)(sizeof(sizes) / sizeof(sizes[0])))
+
+static unsigned char buf[64 * 1024];
+
+static void fail(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+/* payload: priority, tag, message of 'size' bytes of 'c' */
+static void write_entry(int fd, int size, char c)
+{
+	unsigned char prio = 4;
+	char msg[LOGGER_ENTRY_MAX_PAYLOAD];
+	struct iovec vec[3];
+
+	memset(msg, c, size);
+	msg[size] = '\0';
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = TAG;
+	vec[1].iov_len = sizeof(TAG);
+	vec[2].iov_base = msg;
+	vec[2].iov_len = size + 1;
+	if (writev(fd, vec, 3) < 0)
+		fail("writev");
+}
+
+/* Checks one entry of ours; returns its total length */
+static size_t check_entry(unsigned char *p, size_t room, int size, char c)
+{
+	struct logger_entry *e = (struct logger_entry *)p;
+	size_t len = sizeof(*e) + e->len;
+	char *msg = e->msg + 1 + sizeof(TAG);
+	int i;
+
+	if (room < sizeof(*e) || room < len) {
+		fprintf(stderr, "entry of %zu bytes overruns batch (%zu left)\n",
+			len, room);
+		exit(1);
+	}
+	if (e->len != 1 + sizeof(TAG) + size + 1 ||
+	    strcmp(e->msg + 1, TAG)) {
+		fprintf(stderr, "bad entry: len %u, expected %zu\n",
+			e->len, 1 + sizeof(TAG) + size + 1);
+		exit(1);
+	}
+	for (i = 0; i < size; i++)
+		if (msg[i] != c) {
+			fprintf(stderr, "bad payload in entry '%c'\n", c);
+			exit(1);
+		}
+	return len;
+}
+
+int main(int argc, char *argv[])
+{
+	int rfd, wfd, i;
+	ssize_t n;
+	size_t off;
+
+	if (argc > 1)
+		device = argv[1];
+
+	rfd = open(device, O_RDONLY | O_NONBLOCK);
+	if (rfd < 0)
+		fail("open reader");
+	wfd = open(device, O_WRONLY);
+	if (wfd < 0)
+		fail("open writer");
+
+	/* skip whatever is in the log already */
+	while ((n = read(rfd, buf, sizeof(buf))) > 0)
+		;
+	if (n < 0 && errno != EAGAIN)
+		fail("read");
+
+	if (ioctl(rfd, LOGGER_SET_BATCH_READ, 1))
+		fail("LOGGER_SET_BATCH_READ");
+
+	for (i = 0; i < NR_ENTRIES; i++)
+		write_entry(wfd, sizes[i], 'a' + i);
+
+	n = read(rfd, buf, sizeof(buf));
+	if (n < 0)
+		fail("batch read");
+	for (off = 0, i = 0; i < NR_ENTRIES && off < (size_t)n; i++)
+		off += check_entry(buf + off, n - off, sizes[i], 'a' + i);
+	if (i != NR_ENTRIES || off != (size_t)n) {
+		fprintf(stderr, "batch of %zd bytes held %d of %d entries, "
+			"%zu bytes parsed\n", n, i, NR_ENTRIES, off);
+		return 1;
+	}
+
+	/* the reader must still sit on an entry boundary */
+	write_entry(wfd, 42, 'z');
+	n = read(rfd, buf, sizeof(buf));
+	if (n < 0)
+		fail("read after batch");
+	if (check_entry(buf, n, 42, 'z') != (size_t)n) {
+		fprintf(stderr, "read after batch returned %zd bytes\n", n);
+		return 1;
+	}
+
+	printf("ok: %d entries in one %zd byte batch\n", NR_ENTRIES,
+	       (ssize_t)off);
+	return 0;
+}
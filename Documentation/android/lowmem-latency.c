@@ -0,0 +1,164 @@
+/*
+ * Notification latency of the Android low memory killer
+ *
+ * Waits for new events on /dev/lowmemorykiller and prints, for each one,
+ * how long after its time stamp it was read, plus min/avg/max at the end.
+ * With -p it first forks a child that sets its oom_adj to 15 and keeps
+ * allocating and touching memory, so the events come from our own
+ * pressure and the child is the first victim.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * Cross-compile with cross-gcc -I/path/to/kernel/drivers/staging/android
+ * (add -lrt for clock_gettime() on older C libraries)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "lowmemorykiller.h"
+
+#define CHUNK		(1024 * 1024)
+
+static const char *device = "/dev/" LOWMEM_DEVICE_NAME;
+
+static void fail(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-n events] [-p megabytes] [device]\n", prog);
+	puts("  -n --count     stop after this many events (default 10)\n"
+	     "  -p --pressure  fork a child allocating up to this much memory");
+	exit(1);
+}
+
+/* allocate and dirty memory until 'mb' megabytes or until we are killed */
+static void make_pressure(int mb)
+{
+	FILE *f = fopen("/proc/self/oom_adj", "w");
+	char *p;
+	int i;
+
+	if (f) {
+		fputs("15\n", f);
+		fclose(f);
+	}
+	for (i = 0; i < mb; i++) {
+		p = malloc(CHUNK);
+		if (!p)
+			break;
+		memset(p, i, CHUNK);
+		usleep(10000);
+	}
+	/* stay around so the memory stays in use */
+	pause();
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "count",    1, 0, 'n' },
+		{ "pressure", 1, 0, 'p' },
+		{ NULL, 0, 0, 0 },
+	};
+	struct lowmem_event ev;
+	struct pollfd pfd;
+	struct timespec now;
+	long long us, min_us = -1, max_us = 0, sum_us = 0;
+	unsigned int last_seq = 0, missed = 0;
+	int count = 10, pressure = 0, n = 0, c;
+	pid_t child = 0;
+	ssize_t ret;
+
+	while ((c = getopt_long(argc, argv, "n:p:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'p':
+			pressure = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+
+	pfd.fd = open(device, O_RDONLY);
+	if (pfd.fd < 0)
+		fail("open");
+	pfd.events = POLLIN;
+
+	if (pressure) {
+		child = fork();
+		if (child < 0)
+			fail("fork");
+		if (!child)
+			make_pressure(pressure);
+	}
+
+	while (n < count) {
+		ret = poll(&pfd, 1, child ? 1000 : -1);
+		if (ret < 0 && errno != EINTR)
+			fail("poll");
+		if (ret <= 0) {
+			/* the child is done: killed, or out of work */
+			if (child && waitpid(child, NULL, WNOHANG) == child)
+				break;
+			continue;
+		}
+		ret = read(pfd.fd, &ev, sizeof(ev));
+		if (clock_gettime(CLOCK_MONOTONIC, &now))
+			fail("clock_gettime");
+		if (ret != sizeof(ev))
+			fail("read");
+
+		us = (now.tv_sec - (long long)ev.sec) * 1000000 +
+		     (now.tv_nsec - (long long)ev.nsec) / 1000;
+		if (n && ev.seq - last_seq > 1)
+			missed += ev.seq - last_seq - 1;
+		last_seq = ev.seq;
+
+		printf("seq %u %s level %u min_adj %d victim %d (adj %d, "
+		       "%u pages) free %u file %u: %lld us\n", ev.seq,
+		       ev.flags & LOWMEM_EVENT_KILL ? "kill" :
+		       ev.flags & LOWMEM_EVENT_WARN ? "warn" : "none",
+		       ev.level, ev.min_adj, ev.victim_pid, ev.victim_adj,
+		       ev.victim_size, ev.free, ev.file, us);
+
+		if (min_us < 0 || us < min_us)
+			min_us = us;
+		if (us > max_us)
+			max_us = us;
+		sum_us += us;
+		n++;
+	}
+
+	if (child) {
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+	}
+	if (n)
+		printf("%d events, %u missed, latency min/avg/max "
+		       "%lld/%lld/%lld us\n", n, missed, min_us, sum_us / n,
+		       max_us);
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * zram deduplication benchmark
+ *
+ * Writes pages of which a given share are copies of a few popular pages,
+ * the way swapped out heaps of forked processes often are, and prints
+ * the write throughput, orig_data_size, mem_used_total and the device's
+ * dedup_stats (lookups, hits, hit rate and bytes saved).
+ *
+ * With -c it sets the device up itself, twice: it resets it, sets
+ * use_dedup to 0 and then to 1, sets the disksize, and runs the same
+ * writes each time, so the two runs can be compared directly. Without
+ * -c the device must already be initialised and not in use.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * (add -lrt for clock_gettime() on older C libraries)
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE		4096
+#define BUF_PAGES	64
+
+static const char *device = "/dev/zram0";
+static long long nr_pages = 64LL * 1024 * 1024 / PAGE;
+static int dup_percent = 50;
+static int nr_popular = 16;
+static long long disksize_mb;
+
+static void fail(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-m megabytes] [-d percent] [-p pages] "
+	       "[-c disksize] [device]\n", prog);
+	puts("  -m --size      data written (default 64)\n"
+	     "  -d --dups      share of pages that are duplicates (default 50)\n"
+	     "  -p --popular   distinct pages the duplicates copy (default 16)\n"
+	     "  -c --compare   set the device up with this many megabytes,\n"
+	     "                 run without and then with use_dedup");
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static FILE *open_attr(const char *name, const char *mode)
+{
+	char path[256], *dev = strdup(device);
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", basename(dev), name);
+	free(dev);
+	f = fopen(path, mode);
+	if (!f)
+		fail(path);
+	return f;
+}
+
+static void write_attr(const char *name, long long val)
+{
+	FILE *f = open_attr(name, "w");
+
+	if (fprintf(f, "%lld\n", val) < 0 || fclose(f))
+		fail(name);
+}
+
+static unsigned long long read_attr(const char *name)
+{
+	FILE *f = open_attr(name, "r");
+	unsigned long long val;
+
+	if (fscanf(f, "%llu", &val) != 1)
+		fail(name);
+	fclose(f);
+	return val;
+}
+
+/* half random, half text, and tagged with 'tag' so every tag differs */
+static void fill(unsigned char *p, unsigned int *seed, long long tag)
+{
+	static const char text[] = "zram dedup benchmark ";
+	int i;
+
+	for (i = 0; i < PAGE / 2; i++)
+		p[i] = rand_r(seed);
+	for (; i < PAGE; i++)
+		p[i] = text[i % (sizeof(text) - 1)];
+	memcpy(p, &tag, sizeof(tag));
+}
+
+static void run(void)
+{
+	unsigned char *popular, *buf;
+	unsigned int seed = 1;
+	long long i, done, n, dups = 0;
+	char stats[256];
+	double t;
+	FILE *f;
+	int fd;
+
+	if (posix_memalign((void **)&popular, PAGE, nr_popular * PAGE) ||
+	    posix_memalign((void **)&buf, PAGE, BUF_PAGES * PAGE))
+		fail("posix_memalign");
+	for (i = 0; i < nr_popular; i++)
+		fill(popular + i * PAGE, &seed, -1 - i);
+
+	fd = open(device, O_WRONLY | O_DIRECT);
+	if (fd < 0)
+		fail("open");
+	t = now();
+	for (done = 0; done < nr_pages; done += n) {
+		n = nr_pages - done < BUF_PAGES ? nr_pages - done : BUF_PAGES;
+		for (i = 0; i < n; i++) {
+			if ((int)(rand_r(&seed) % 100) < dup_percent) {
+				memcpy(buf + i * PAGE, popular +
+				       rand_r(&seed) % nr_popular * PAGE, PAGE);
+				dups++;
+			} else
+				fill(buf + i * PAGE, &seed, done + i);
+		}
+		if (pwrite(fd, buf, n * PAGE, done * PAGE) != n * PAGE)
+			fail("pwrite");
+	}
+	t = now() - t;
+	close(fd);
+
+	printf("%lld pages, %lld duplicates: %.1f MB/s\n", nr_pages, dups,
+	       nr_pages * (double)PAGE / (1024 * 1024) / t);
+	printf("orig_data_size %llu mem_used_total %llu\n",
+	       read_attr("orig_data_size"), read_attr("mem_used_total"));
+	f = open_attr("dedup_stats", "r");
+	if (fgets(stats, sizeof(stats), f))
+		printf("dedup_stats: %s", stats);
+	fclose(f);
+
+	free(buf);
+	free(popular);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "size",    1, 0, 'm' },
+		{ "dups",    1, 0, 'd' },
+		{ "popular", 1, 0, 'p' },
+		{ "compare", 1, 0, 'c' },
+		{ NULL, 0, 0, 0 },
+	};
+	int dedup, c;
+
+	while ((c = getopt_long(argc, argv, "m:d:p:c:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			nr_pages = atoll(optarg) * 1024 * 1024 / PAGE;
+			break;
+		case 'd':
+			dup_percent = atoi(optarg);
+			break;
+		case 'p':
+			nr_popular = atoi(optarg);
+			break;
+		case 'c':
+			disksize_mb = atoll(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (nr_pages < 1 || nr_popular < 1 || dup_percent < 0 ||
+	    dup_percent > 100)
+		print_usage(argv[0]);
+
+	if (!disksize_mb) {
+		printf("%s: use_dedup %llu\n", device, read_attr("use_dedup"));
+		run();
+		return 0;
+	}
+
+	for (dedup = 0; dedup <= 1; dedup++) {
+		write_attr("reset", 1);
+		write_attr("use_dedup", dedup);
+		write_attr("disksize", disksize_mb * 1024 * 1024);
+		printf("%s: use_dedup %d\n", device, dedup);
+		run();
+	}
+	write_attr("reset", 1);
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * zram allocator overhead under churn
+ *
+ * Fills a zram device with pages of random compressibility, then
+ * overwrites random pages with new ones for a number of rounds. After
+ * the fill and after every round it prints orig_data_size,
+ * compr_data_size and mem_used_total from sysfs, and how much memory the
+ * allocator uses on top of the compressed data. Only those three
+ * attributes are used, so the same run can be repeated on kernels with
+ * xvmalloc and with zsmalloc and the overhead compared. With zsmalloc,
+ * mem_used_total includes the memory of the object handles.
+ *
+ * The device must be initialised (disksize set) and not in use.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAGE		4096
+
+static const char *device = "/dev/zram0";
+static long long nr_pages = 64LL * 1024 * 1024 / PAGE;
+static int rounds = 10;
+static unsigned int seed = 1;
+
+static void fail(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-m megabytes] [-r rounds] [-s seed] [device]\n",
+	       prog);
+	puts("  -m --size    data written by the fill (default 64)\n"
+	     "  -r --rounds  rounds overwriting half as many pages (default 10)\n"
+	     "  -s --seed    random seed (default 1)");
+	exit(1);
+}
+
+static unsigned long long read_stat(const char *name)
+{
+	char path[256], *dev = strdup(device);
+	unsigned long long val;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s", basename(dev), name);
+	free(dev);
+	f = fopen(path, "r");
+	if (!f || fscanf(f, "%llu", &val) != 1)
+		fail(path);
+	fclose(f);
+	return val;
+}
+
+static void report(const char *what)
+{
+	unsigned long long orig = read_stat("orig_data_size");
+	unsigned long long compr = read_stat("compr_data_size");
+	unsigned long long used = read_stat("mem_used_total");
+
+	printf("%-9s orig %10llu compr %10llu used %10llu  "
+	       "overhead %10lld (%5.1f%%)  ratio %.2f\n", what, orig, compr,
+	       used, (long long)(used - compr),
+	       compr ? 100.0 * ((long long)(used - compr)) / compr : 0.0,
+	       used ? (double)orig / used : 0.0);
+}
+
+/*
+ * A random share of the page is random bytes and the rest a repeated
+ * pattern, so compressed sizes spread over all size classes.
+ */
+static void fill(unsigned char *p, long long nr)
+{
+	int random_bytes = rand_r(&seed) % PAGE;
+	int i;
+
+	for (i = 0; i < random_bytes; i++)
+		p[i] = rand_r(&seed);
+	for (; i < PAGE; i++)
+		p[i] = i & 0x3f;
+	/* never a zero page, never the same page twice */
+	memcpy(p + PAGE - sizeof(nr), &nr, sizeof(nr));
+	p[0] |= 1;
+}
+
+static void write_page(int fd, unsigned char *buf, long long index,
+		       long long nr)
+{
+	fill(buf, nr);
+	if (pwrite(fd, buf, PAGE, index * PAGE) != PAGE)
+		fail("pwrite");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "size",   1, 0, 'm' },
+		{ "rounds", 1, 0, 'r' },
+		{ "seed",   1, 0, 's' },
+		{ NULL, 0, 0, 0 },
+	};
+	unsigned char *buf;
+	long long i, nr = 0;
+	char what[32];
+	int fd, r, c;
+
+	while ((c = getopt_long(argc, argv, "m:r:s:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			nr_pages = atoll(optarg) * 1024 * 1024 / PAGE;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (nr_pages < 1 || rounds < 0)
+		print_usage(argv[0]);
+
+	if (posix_memalign((void **)&buf, PAGE, PAGE))
+		fail("posix_memalign");
+	fd = open(device, O_WRONLY | O_DIRECT);
+	if (fd < 0)
+		fail("open");
+
+	for (i = 0; i < nr_pages; i++)
+		write_page(fd, buf, i, nr++);
+	report("fill");
+
+	/* churn: replace objects with ones of other sizes */
+	for (r = 1; r <= rounds; r++) {
+		for (i = 0; i < nr_pages / 2; i++)
+			write_page(fd, buf, rand_r(&seed) % nr_pages, nr++);
+		snprintf(what, sizeof(what), "round %d", r);
+		report(what);
+	}
+
+	close(fd);
+	free(buf);
+	return 0;
+}
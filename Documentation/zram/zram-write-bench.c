@@ -0,0 +1,170 @@
+/*
+ * zram write scaling benchmark
+ *
+ * Writes the same amount of data to a zram device with 1, 2, 4, ... up to
+ * the number of online CPUs writer threads, each thread on its own part
+ * of the device with O_DIRECT, and prints the throughput of each run and
+ * its speedup over a single writer. The pages are half random bytes and
+ * half text, so that they compress to roughly half a page.
+ *
+ * The device must be initialised (disksize set) and not in use.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * Cross-compile with cross-gcc -lpthread
+ * (add -lrt for clock_gettime() on older C libraries)
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE		4096
+#define BUF_PAGES	64
+
+static const char *device = "/dev/zram0";
+static long long total_pages = 64LL * 1024 * 1024 / PAGE;
+static int nr_threads;
+
+struct writer {
+	pthread_t thread;
+	long long first, nr;	/* in pages */
+};
+
+static void fail(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-m megabytes] [-t threads] [device]\n", prog);
+	puts("  -m --size     data written per run (default 64)\n"
+	     "  -t --threads  most writers to try (default online CPUs)");
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* half random, half text: compresses to about half a page */
+static void fill(unsigned char *p, unsigned int *seed)
+{
+	static const char text[] = "zram write scaling benchmark ";
+	int i;
+
+	for (i = 0; i < PAGE / 2; i++)
+		p[i] = rand_r(seed);
+	for (; i < PAGE; i++)
+		p[i] = text[i % (sizeof(text) - 1)];
+}
+
+static void *writer_fn(void *arg)
+{
+	struct writer *w = arg;
+	unsigned int seed = w->first;
+	unsigned char *buf;
+	long long done, n;
+	int fd, i;
+
+	if (posix_memalign((void **)&buf, PAGE, BUF_PAGES * PAGE))
+		fail("posix_memalign");
+	for (i = 0; i < BUF_PAGES; i++)
+		fill(buf + i * PAGE, &seed);
+
+	fd = open(device, O_WRONLY | O_DIRECT);
+	if (fd < 0)
+		fail("open");
+	for (done = 0; done < w->nr; done += n) {
+		n = w->nr - done < BUF_PAGES ? w->nr - done : BUF_PAGES;
+		/* change every page a little so no two writes are the same */
+		for (i = 0; i < n; i++)
+			memcpy(buf + i * PAGE, &done, sizeof(done));
+		if (pwrite(fd, buf, n * PAGE, (w->first + done) * PAGE) !=
+		    n * PAGE)
+			fail("pwrite");
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static double run(int threads)
+{
+	struct writer *w = calloc(threads, sizeof(*w));
+	long long per = total_pages / threads;
+	double t;
+	int i;
+
+	if (!w)
+		fail("calloc");
+	t = now();
+	for (i = 0; i < threads; i++) {
+		w[i].first = i * per;
+		w[i].nr = per;
+		if (pthread_create(&w[i].thread, NULL, writer_fn, &w[i]))
+			fail("pthread_create");
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(w[i].thread, NULL);
+	t = now() - t;
+	free(w);
+	return per * threads * (double)PAGE / (1024 * 1024) / t;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option lopts[] = {
+		{ "size",    1, 0, 'm' },
+		{ "threads", 1, 0, 't' },
+		{ NULL, 0, 0, 0 },
+	};
+	double base = 0, mbs;
+	int threads, c;
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((c = getopt_long(argc, argv, "m:t:", lopts, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			total_pages = atoll(optarg) * 1024 * 1024 / PAGE;
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		device = argv[optind];
+	if (total_pages < 1 || nr_threads < 1)
+		print_usage(argv[0]);
+
+	printf("%s: %lld MB per run\n", device, total_pages * PAGE >> 20);
+	for (threads = 1; ; threads *= 2) {
+		if (threads > nr_threads)
+			threads = nr_threads;
+		mbs = run(threads);
+		if (!base)
+			base = mbs;
+		printf("%3d writers: %8.1f MB/s  %.2fx\n", threads, mbs,
+		       mbs / base);
+		if (threads == nr_threads)
+			break;
+	}
+	return 0;
+}
@@ -23,13 +23,27 @@
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
 #include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/page-isolation.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/pmem.h>
+
 #define PMEM_MAX_DEVICES 10
-#define PMEM_MAX_ORDER 128
+/* one free list per order; a region never exceeds BITS_PER_LONG orders */
+#define PMEM_MAX_ORDER BITS_PER_LONG
 #define PMEM_MIN_ALLOC PAGE_SIZE
+/* how long pmem_allocate() may spend migrating pages out of lent memory */
+#define PMEM_RECLAIM_TIMEOUT_MS 500
+/* how long a region must go without frees before its free memory is lent
+ * again, so that buffers reallocated every frame are not migrated each time */
+#define PMEM_LEND_DELAY_MS 2000
 
 #define PMEM_DEBUG 1
 
@@ -82,6 +96,8 @@ struct pmem_data {
 struct pmem_bits {
 	unsigned allocated:1;		/* 1 if allocated, 0 if free */
 	unsigned order:7;		/* size of the region in pmem space */
+	/* link in free_list[order] while this entry heads a free region */
+	struct list_head free;
 };
 
 struct pmem_region_node {
@@ -116,6 +132,24 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* free regions of each order, linked through their first bitmap
+	 * entry, and how many there are */
+	struct list_head free_list[PMEM_MAX_ORDER];
+	unsigned long nr_free[PMEM_MAX_ORDER];
+#ifdef CONFIG_ANDROID_PMEM_LEND
+	/* one bit per pageblock of the region, set while it is lent to the
+	 * page allocator; only pageblocks entirely free here are lent */
+	unsigned long *lent;
+	unsigned long nr_lent;
+	/* pageblocks taken back, failures to, and the time it took */
+	unsigned long nr_reclaims;
+	unsigned long nr_reclaim_failed;
+	unsigned long reclaim_us;
+	unsigned long reclaim_max_us;
+	/* lends what pmem_free() released, once the region is quiet */
+	struct delayed_work lend_work;
+	unsigned long last_free;
+#endif
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -149,7 +183,13 @@ struct pmem_info {
 	int (*release)(struct inode *, struct file *);
 };
 
+#ifdef CONFIG_PMEM_SELFTEST
+/* one more slot, never registered, for the allocator self-test */
+#define PMEM_SELFTEST_ID PMEM_MAX_DEVICES
+static struct pmem_info pmem[PMEM_MAX_DEVICES + 1];
+#else
 static struct pmem_info pmem[PMEM_MAX_DEVICES];
+#endif
 static int id_count;
 
 #define PMEM_IS_FREE(id, index) !(pmem[id].bitmap[index].allocated)
@@ -232,34 +272,219 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+static void pmem_add_free(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int order = PMEM_ORDER(id, index);
+
+	list_add(&pmem[id].bitmap[index].free, &pmem[id].free_list[order]);
+	pmem[id].nr_free[order]++;
+}
+
+static void pmem_del_free(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	list_del(&pmem[id].bitmap[index].free);
+	pmem[id].nr_free[PMEM_ORDER(id, index)]--;
+}
+
+#ifdef CONFIG_ANDROID_PMEM_LEND
+static unsigned long pmem_block_pfn(int id, unsigned long block)
+{
+	return (pmem[id].base >> PAGE_SHIFT) + (block << pageblock_order);
+}
+
+/* lend the pageblocks of a free region of the given order */
+static void pmem_lend_range(int id, int index, int order)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	unsigned long block, end;
+
+	if (!pmem[id].lent || order < pageblock_order)
+		return;
+
+	end = (index + (1UL << order)) >> pageblock_order;
+	for (block = index >> pageblock_order; block < end; block++) {
+		if (test_bit(block, pmem[id].lent))
+			continue;
+		if (lend_pageblock(pfn_to_page(pmem_block_pfn(id, block))))
+			return;
+		set_bit(block, pmem[id].lent);
+		pmem[id].nr_lent++;
+	}
+}
+
+/* take back any lent pageblock under an allocation of the given order */
+static int pmem_reclaim_range(int id, int index, int order)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	unsigned long deadline = jiffies +
+				 msecs_to_jiffies(PMEM_RECLAIM_TIMEOUT_MS);
+	unsigned long block, end, pfn, us;
+	ktime_t start;
+	int ret;
+
+	if (!pmem[id].lent)
+		return 0;
+
+	end = (index + (1UL << order) - 1) >> pageblock_order;
+	for (block = index >> pageblock_order; block <= end; block++) {
+		if (!test_bit(block, pmem[id].lent))
+			continue;
+
+		/* one deadline for the whole allocation, not per pageblock;
+		 * past it each pageblock still gets one try */
+		pfn = pmem_block_pfn(id, block);
+		start = ktime_get();
+		ret = reclaim_lent_range(pfn, pfn + pageblock_nr_pages,
+				time_after(jiffies, deadline) ? 0 :
+				deadline - jiffies);
+		us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+		pmem[id].reclaim_us += us;
+		pmem[id].reclaim_max_us = max(pmem[id].reclaim_max_us, us);
+		if (ret) {
+			pmem[id].nr_reclaim_failed++;
+			return ret;
+		}
+		pmem[id].nr_reclaims++;
+		clear_bit(block, pmem[id].lent);
+		pmem[id].nr_lent--;
+
+		/* dirty lines left by the page allocator's users must not be
+		 * written back over device data later */
+		if (!PageHighMem(pfn_to_page(pfn))) {
+			void *vaddr = page_address(pfn_to_page(pfn));
+			dmac_flush_range(vaddr, vaddr +
+					 (pageblock_nr_pages << PAGE_SHIFT));
+		}
+	}
+
+	return 0;
+}
+
+/* lend the free regions big enough, unless something was freed lately */
+static void pmem_lend_work(struct work_struct *work)
+{
+	struct pmem_info *info = container_of(work, struct pmem_info,
+					      lend_work.work);
+	int id = info - pmem;
+	struct pmem_bits *bits;
+	unsigned long due;
+	int order;
+
+	down_write(&info->bitmap_sem);
+	due = info->last_free + msecs_to_jiffies(PMEM_LEND_DELAY_MS);
+	if (time_before(jiffies, due)) {
+		schedule_delayed_work(&info->lend_work, due - jiffies);
+	} else {
+		for (order = pageblock_order; order < PMEM_MAX_ORDER; order++)
+			list_for_each_entry(bits, &info->free_list[order], free)
+				pmem_lend_range(id, bits - info->bitmap, order);
+	}
+	up_write(&info->bitmap_sem);
+}
+
+/* lend what was freed once the region has gone PMEM_LEND_DELAY_MS without
+ * another free */
+static void pmem_lend_later(int id)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	if (!pmem[id].lent)
+		return;
+	pmem[id].last_free = jiffies;
+	schedule_delayed_work(&pmem[id].lend_work,
+			      msecs_to_jiffies(PMEM_LEND_DELAY_MS));
+}
+
+static void pmem_lend_setup(int id, struct android_pmem_platform_data *pdata)
+{
+	unsigned long pfn = pmem[id].base >> PAGE_SHIFT;
+	unsigned long nr_blocks = pmem[id].num_entries >> pageblock_order;
+	unsigned long i;
+	int index;
+
+	if (!pdata->lend || pmem[id].no_allocator || !nr_blocks)
+		return;
+
+	/* the region has to be RAM reserved at boot, in whole pageblocks of
+	 * a single zone */
+	if (pfn & (pageblock_nr_pages - 1))
+		goto cant_lend;
+	for (i = 0; i < pmem[id].num_entries; i++)
+		if (!pfn_valid(pfn + i) || !PageReserved(pfn_to_page(pfn + i)))
+			goto cant_lend;
+	if (page_zone(pfn_to_page(pfn)) !=
+	    page_zone(pfn_to_page(pfn + pmem[id].num_entries - 1)))
+		goto cant_lend;
+
+	pmem[id].lent = kzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long),
+				GFP_KERNEL);
+	if (!pmem[id].lent)
+		goto cant_lend;
+	INIT_DELAYED_WORK(&pmem[id].lend_work, pmem_lend_work);
+
+	for (index = 0; index < pmem[id].num_entries;
+	     index = PMEM_NEXT_INDEX(id, index))
+		pmem_lend_range(id, index, PMEM_ORDER(id, index));
+	printk(KERN_INFO "pmem: %s: lent %lu of %lu pageblocks\n",
+	       pdata->name, pmem[id].nr_lent, nr_blocks);
+	return;
+
+cant_lend:
+	printk(KERN_INFO "pmem: %s: region cannot be lent\n", pdata->name);
+}
+#else
+static inline void pmem_lend_later(int id)
+{
+}
+
+static inline int pmem_reclaim_range(int id, int index, int order)
+{
+	return 0;
+}
+
+static inline void pmem_lend_setup(int id,
+				   struct android_pmem_platform_data *pdata)
+{
+}
+#endif
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	int buddy, curr = index;
+	unsigned int order;
 	DLOG("index %d\n", index);
 
 	if (pmem[id].no_allocator) {
 		pmem[id].allocated = 0;
 		return 0;
 	}
+	order = PMEM_ORDER(id, curr);
 	/* clean up the bitmap, merging any buddies */
 	pmem[id].bitmap[curr].allocated = 0;
 	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
-	 * if the buddy is also free merge them
-	 * repeat until the buddy is not free or end of the bitmap is reached
+	 * if the buddy is also free and of the same order, take it off its
+	 * free list and merge them
+	 * repeat until the buddy is not free or lies past the end of the
+	 * bitmap (the tail of a region that is not a power of two in size)
 	 */
-	do {
+	for (;;) {
 		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
+		if (buddy >= pmem[id].num_entries ||
+		    !PMEM_IS_FREE(id, buddy) ||
+		    PMEM_ORDER(id, buddy) != PMEM_ORDER(id, curr))
 			break;
-		}
-	} while (curr < pmem[id].num_entries);
+		pmem_del_free(id, buddy);
+		PMEM_ORDER(id, buddy)++;
+		PMEM_ORDER(id, curr)++;
+		curr = min(buddy, curr);
+	}
+	pmem_add_free(id, curr);
+	pmem_lend_later(id);
 
+	trace_pmem_free(id, index, order, PMEM_ORDER(id, curr));
 	return 0;
 }
 
@@ -380,10 +605,10 @@ static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
-	int best_fit = -1;
+	struct pmem_bits *bits;
+	int best_fit;
 	unsigned long order = pmem_order(len);
+	unsigned long curr;
 
 	if (pmem[id].no_allocator) {
 		DLOG("no allocator");
@@ -393,39 +618,33 @@ static int pmem_allocate(int id, unsigned long len)
 		return len;
 	}
 
-	if (order > PMEM_MAX_ORDER)
+	if (order >= PMEM_MAX_ORDER)
 		return -1;
 	DLOG("order %lx\n", order);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
-	 * 	otherwise, use the best fit (smallest with size > order) slot
+	/* use the best fit: the first free slot of the smallest order that
+	 * is >= the one requested
 	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
-		}
-		curr = PMEM_NEXT_INDEX(id, curr);
-	}
+	for (curr = order; curr < PMEM_MAX_ORDER; curr++)
+		if (!list_empty(&pmem[id].free_list[curr]))
+			break;
 
-	/* if best_fit < 0, there are no suitable slots,
+	/* if there is no such order, there are no suitable slots,
 	 * return an error
 	 */
-	if (best_fit < 0) {
+	if (curr == PMEM_MAX_ORDER) {
 		printk("pmem: no space left to allocate!\n");
+		trace_pmem_alloc_fail(id, len, order);
 		return -1;
 	}
 
+	bits = list_first_entry(&pmem[id].free_list[curr], struct pmem_bits,
+				free);
+	best_fit = bits - pmem[id].bitmap;
+	pmem_del_free(id, best_fit);
+
 	/* now partition the best fit:
-	 * 	split the slot into 2 buddies of order - 1
+	 * 	split the slot into 2 buddies of order - 1, freeing the upper one
 	 * 	repeat until the slot is of the correct order
 	 */
 	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
@@ -433,8 +652,19 @@ static int pmem_allocate(int id, unsigned long len)
 		PMEM_ORDER(id, best_fit) -= 1;
 		buddy = PMEM_BUDDY_INDEX(id, best_fit);
 		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+		pmem_add_free(id, buddy);
 	}
 	pmem[id].bitmap[best_fit].allocated = 1;
+
+	/* migrate the page allocator's users out of any lent memory */
+	if (pmem_reclaim_range(id, best_fit, order)) {
+		printk("pmem: could not reclaim lent memory!\n");
+		pmem_free(id, best_fit);
+		trace_pmem_alloc_fail(id, len, order);
+		return -1;
+	}
+
+	trace_pmem_alloc(id, len, best_fit, order, curr);
 	return best_fit;
 }
 
@@ -1182,7 +1412,7 @@ static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 	int id = (int)file->private_data;
 	const int debug_bufmax = 4096;
 	static char buffer[4096];
-	int n = 0;
+	int i, n = 0;
 
 	DLOG("debug open\n");
 	n = scnprintf(buffer, debug_bufmax,
@@ -1207,6 +1437,27 @@ static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 	}
 	up(&pmem[id].data_list_sem);
 
+	if (!pmem[id].no_allocator) {
+		n += scnprintf(buffer + n, debug_bufmax - n,
+			       "free regions (order:count):");
+		down_read(&pmem[id].bitmap_sem);
+		for (i = 0; i < PMEM_MAX_ORDER; i++)
+			if (pmem[id].nr_free[i])
+				n += scnprintf(buffer + n, debug_bufmax - n,
+					       " %d:%lu", i, pmem[id].nr_free[i]);
+		n += scnprintf(buffer + n, debug_bufmax - n, "\n");
+#ifdef CONFIG_ANDROID_PMEM_LEND
+		if (pmem[id].lent)
+			n += scnprintf(buffer + n, debug_bufmax - n,
+				"lent pageblocks: %lu reclaimed: %lu "
+				"failed: %lu reclaim us (total/max): %lu/%lu\n",
+				pmem[id].nr_lent, pmem[id].nr_reclaims,
+				pmem[id].nr_reclaim_failed,
+				pmem[id].reclaim_us, pmem[id].reclaim_max_us);
+#endif
+		up_read(&pmem[id].bitmap_sem);
+	}
+
 	n++;
 	buffer[n] = 0;
 	return simple_read_from_buffer(buf, count, ppos, buffer, n);
@@ -1256,17 +1507,23 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	}
 	pmem[id].num_entries = pmem[id].size / PMEM_MIN_ALLOC;
 
-	pmem[id].bitmap = kmalloc(pmem[id].num_entries *
-				  sizeof(struct pmem_bits), GFP_KERNEL);
+	/* with the free list links this is too big for kmalloc on large
+	 * carveouts */
+	pmem[id].bitmap = vmalloc(pmem[id].num_entries *
+				  sizeof(struct pmem_bits));
 	if (!pmem[id].bitmap)
 		goto err_no_mem_for_metadata;
 
 	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
 					  pmem[id].num_entries);
 
+	for (i = 0; i < PMEM_MAX_ORDER; i++)
+		INIT_LIST_HEAD(&pmem[id].free_list[i]);
+
 	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
-		if ((pmem[id].num_entries) &  1<<i) {
+		if ((pmem[id].num_entries) & 1UL << i) {
 			PMEM_ORDER(id, index) = i;
+			pmem_add_free(id, index);
 			index = PMEM_NEXT_INDEX(id, index);
 		}
 	}
@@ -1289,19 +1546,191 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	if (pmem[id].no_allocator)
 		pmem[id].allocated = 0;
 
+	pmem_lend_setup(id, pdata);
+
 #if PMEM_DEBUG
 	debugfs_create_file(pdata->name, S_IFREG | S_IRUGO, NULL, (void *)id,
 			    &debug_fops);
 #endif
 	return 0;
 error_cant_remap:
-	kfree(pmem[id].bitmap);
+	vfree(pmem[id].bitmap);
 err_no_mem_for_metadata:
 	misc_deregister(&pmem[id].dev);
 err_cant_register_device:
 	return -1;
 }
 
+#ifdef CONFIG_PMEM_SELFTEST
+/* not a power of two, so the region starts out as several free blocks */
+#define PMEM_SELFTEST_ENTRIES 1000
+#define PMEM_SELFTEST_SLOTS 64
+#define PMEM_SELFTEST_ROUNDS 10000
+
+/*
+ * Checks that the free lists and the bitmap agree: every free list entry
+ * heads a free, aligned block of its list's order, the counts match, the
+ * blocks tile the region, and 'nr_free_entries' entries are free in all.
+ */
+static int pmem_selftest_check(int id, unsigned long nr_free_entries)
+{
+	struct pmem_bits *bits;
+	unsigned long total = 0, nr;
+	int order, index;
+
+	for (order = 0; order < PMEM_MAX_ORDER; order++) {
+		nr = 0;
+		list_for_each_entry(bits, &pmem[id].free_list[order], free) {
+			index = bits - pmem[id].bitmap;
+			if (!PMEM_IS_FREE(id, index) ||
+			    PMEM_ORDER(id, index) != order ||
+			    index & ((1 << order) - 1) ||
+			    PMEM_NEXT_INDEX(id, index) > pmem[id].num_entries) {
+				printk(KERN_ERR "pmem: self-test: bad free "
+				       "block %d of order %d\n", index, order);
+				return -1;
+			}
+			total += 1 << order;
+			nr++;
+		}
+		if (nr != pmem[id].nr_free[order]) {
+			printk(KERN_ERR "pmem: self-test: %lu blocks of order "
+			       "%d listed, %lu counted\n", nr, order,
+			       pmem[id].nr_free[order]);
+			return -1;
+		}
+	}
+	for (index = 0; index < pmem[id].num_entries;
+	     index = PMEM_NEXT_INDEX(id, index))
+		;
+	if (index != pmem[id].num_entries || total != nr_free_entries) {
+		printk(KERN_ERR "pmem: self-test: blocks end at %d of %lu, "
+		       "%lu entries free, expected %lu\n", index,
+		       pmem[id].num_entries, total, nr_free_entries);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Runs the buddy allocator on a region that only exists in its bitmap:
+ * one allocation that has to split a block, then random allocations and
+ * frees of mixed orders, checking the free lists after every step, and
+ * finally that freeing everything merges the region back to how it began.
+ */
+static int __init pmem_selftest(void)
+{
+	int id = PMEM_SELFTEST_ID;
+	int slot[PMEM_SELFTEST_SLOTS];
+	unsigned long nr_free[PMEM_MAX_ORDER];
+	unsigned long nr_free_entries, nr_allocs = 0;
+	int i, index = 0, order, curr, ret = -1;
+
+	pmem[id].num_entries = PMEM_SELFTEST_ENTRIES;
+	init_rwsem(&pmem[id].bitmap_sem);
+	pmem[id].bitmap = vmalloc(pmem[id].num_entries *
+				  sizeof(struct pmem_bits));
+	if (!pmem[id].bitmap)
+		return -ENOMEM;
+	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
+					  pmem[id].num_entries);
+	for (i = 0; i < PMEM_MAX_ORDER; i++)
+		INIT_LIST_HEAD(&pmem[id].free_list[i]);
+	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
+		if ((pmem[id].num_entries) & 1UL << i) {
+			PMEM_ORDER(id, index) = i;
+			pmem_add_free(id, index);
+			index = PMEM_NEXT_INDEX(id, index);
+		}
+	}
+	memcpy(nr_free, pmem[id].nr_free, sizeof(nr_free));
+	nr_free_entries = pmem[id].num_entries;
+
+	down_write(&pmem[id].bitmap_sem);
+	if (pmem_selftest_check(id, nr_free_entries))
+		goto out;
+
+	/* the smallest block is the 8 at the end; one page splits it into
+	 * free blocks of orders 2, 1 and 0 */
+	index = pmem_allocate(id, PMEM_MIN_ALLOC);
+	if (index != PMEM_SELFTEST_ENTRIES - 8 || pmem[id].nr_free[0] != 1 ||
+	    pmem[id].nr_free[1] != 1 || pmem[id].nr_free[2] != 1 ||
+	    pmem[id].nr_free[3] != 0) {
+		printk(KERN_ERR "pmem: self-test: split of order 3 for one "
+		       "page gave index %d\n", index);
+		goto out;
+	}
+	if (pmem_selftest_check(id, nr_free_entries - 1))
+		goto out;
+	pmem_free(id, index);
+	if (memcmp(nr_free, pmem[id].nr_free, sizeof(nr_free)) ||
+	    pmem_selftest_check(id, nr_free_entries)) {
+		printk(KERN_ERR "pmem: self-test: split block did not merge "
+		       "back\n");
+		goto out;
+	}
+
+	/* fragment the region with random sizes and lifetimes */
+	for (i = 0; i < PMEM_SELFTEST_SLOTS; i++)
+		slot[i] = -1;
+	for (i = 0; i < PMEM_SELFTEST_ROUNDS; i++) {
+		int *s = &slot[random32() % PMEM_SELFTEST_SLOTS];
+
+		if (*s >= 0) {
+			nr_free_entries += 1 << PMEM_ORDER(id, *s);
+			pmem_free(id, *s);
+			*s = -1;
+		} else {
+			order = random32() % 6;
+			for (curr = order; curr < PMEM_MAX_ORDER; curr++)
+				if (pmem[id].nr_free[curr])
+					break;
+			if (curr == PMEM_MAX_ORDER)
+				continue; /* too fragmented */
+			index = pmem_allocate(id, PMEM_MIN_ALLOC << order);
+			if (index < 0) {
+				printk(KERN_ERR "pmem: self-test: order %d "
+				       "failed with a block of order %d free\n",
+				       order, curr);
+				goto out;
+			}
+			if (PMEM_IS_FREE(id, index) ||
+			    PMEM_ORDER(id, index) != order) {
+				printk(KERN_ERR "pmem: self-test: got block "
+				       "%d of order %d for order %d\n", index,
+				       PMEM_ORDER(id, index), order);
+				goto out;
+			}
+			nr_free_entries -= 1 << order;
+			*s = index;
+			nr_allocs++;
+		}
+		if (pmem_selftest_check(id, nr_free_entries))
+			goto out;
+	}
+
+	for (i = 0; i < PMEM_SELFTEST_SLOTS; i++)
+		if (slot[i] >= 0) {
+			nr_free_entries += 1 << PMEM_ORDER(id, slot[i]);
+			pmem_free(id, slot[i]);
+		}
+	if (memcmp(nr_free, pmem[id].nr_free, sizeof(nr_free)) ||
+	    pmem_selftest_check(id, nr_free_entries)) {
+		printk(KERN_ERR "pmem: self-test: region did not merge back "
+		       "after freeing everything\n");
+		goto out;
+	}
+	ret = 0;
+	printk(KERN_INFO "pmem: self-test passed, %lu allocations\n",
+	       nr_allocs);
+out:
+	up_write(&pmem[id].bitmap_sem);
+	vfree(pmem[id].bitmap);
+	return ret;
+}
+late_initcall(pmem_selftest);
+#endif
+
 static int pmem_probe(struct platform_device *pdev)
 {
 	struct android_pmem_platform_data *pdata;
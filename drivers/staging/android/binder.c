@@ -16,9 +16,11 @@
  */
 
 #include <asm/cacheflush.h>
+#include <linux/debugfs.h>
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -26,31 +28,81 @@
 #include <linux/mutex.h>
 #include <linux/nsproxy.h>
 #include <linux/poll.h>
-#include <linux/proc_fs.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/binder.h>
+
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking overview. There is no single lock serializing all binder
+ * operations; each lock protects a well defined set of state and they
+ * must always be taken in the following order:
+ *
+ * binder_procs_lock (mutex)
+ *	binder_procs list.
+ * binder_tree_lock (mutex)
+ *	The node and ref trees of every proc (proc->nodes,
+ *	proc->refs_by_desc, proc->refs_by_node), all node and ref
+ *	reference counts, node->refs, ref->death, binder_dead_nodes and
+ *	the context manager node.
+ * proc->lock (mutex)
+ *	The threads tree and the buffer allocator of a proc (buffers,
+ *	free_buffers, allocated_buffers, pages, free_async_space).
+ * proc->files_lock (mutex)
+ *	proc->files. Only taken by the fd helpers and deferred work.
+ * binder_stack_lock (spinlock)
+ *	Transaction stacks (thread->transaction_stack, t->from,
+ *	t->to_thread, t->to_proc and the parent links) and the
+ *	buffer <-> transaction back pointers.
+ * proc->inner_lock (spinlock)
+ *	The todo lists of a proc and its threads, node->async_todo,
+ *	node->has_async_transaction, proc->delivered_death, looper state,
+ *	thread return errors, the thread accounting fields and the
+ *	tmp_ref/is_dead lifetime fields of procs and threads.
+ *	Never hold the inner locks of two procs at the same time.
+ *
+ * Procs and threads are reference counted through tmp_ref so that a
+ * transaction can keep its target alive after dropping the locks that
+ * were used to look it up. They are freed once they are dead and the
+ * last temporary reference is dropped.
+ */
+static DEFINE_MUTEX(binder_procs_lock);
+static DEFINE_MUTEX(binder_tree_lock);
+static DEFINE_SPINLOCK(binder_stack_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 static DEFINE_MUTEX(binder_mmap_lock);
 
+/*
+ * Take binder_tree_lock or a proc->lock, reporting any wait to the
+ * binder_lock_contended and binder_lock_acquired tracepoints.
+ */
+static void binder_mutex_lock(struct mutex *lock, const char *tag)
+{
+	if (mutex_trylock(lock))
+		return;
+	trace_binder_lock_contended(tag);
+	mutex_lock(lock);
+	trace_binder_lock_acquired(tag);
+}
+
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
 
-static struct proc_dir_entry *binder_proc_dir_entry_root;
-static struct proc_dir_entry *binder_proc_dir_entry_proc;
+static struct dentry *binder_debugfs_dir_entry_root;
+static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
-static int binder_read_proc_proc(char *page, char **start, off_t off,
-				 int count, int *eof, void *data);
+static const struct file_operations binder_proc_fops;
 
 /* This is only defined in include/asm-arm/sizes.h */
 #ifndef SZ_1K
@@ -90,6 +142,18 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+/*
+ * Number of freed buffer pages each proc keeps mapped, in the kernel and
+ * in userspace, for reuse by the next small transactions.
+ */
+static int binder_page_cache_max = 4;
+module_param_named(page_cache_max, binder_page_cache_max, int,
+		   S_IWUSR | S_IRUGO);
+
+static int binder_async_batch_max = 16;
+module_param_named(async_batch_max, binder_async_batch_max, int,
+		   S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -131,22 +195,22 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -162,24 +226,27 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
-	int next;
+	atomic_t cur;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-static struct binder_transaction_log binder_transaction_log;
-static struct binder_transaction_log binder_transaction_log_failed;
+static struct binder_transaction_log binder_transaction_log = {
+	.cur = ATOMIC_INIT(-1),
+};
+static struct binder_transaction_log binder_transaction_log_failed = {
+	.cur = ATOMIC_INIT(-1),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
-	log->next++;
-	if (log->next == ARRAY_SIZE(log->entry)) {
-		log->next = 0;
+	unsigned int cur = atomic_inc_return(&log->cur);
+
+	if (cur >= ARRAY_SIZE(log->entry))
 		log->full = 1;
-	}
+	e = &log->entry[cur % ARRAY_SIZE(log->entry)];
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
@@ -216,6 +283,7 @@ struct binder_node {
 	unsigned has_async_transaction:1;
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
+	int async_batch; /* batched async transactions in flight after the first */
 	struct list_head async_todo;
 };
 
@@ -255,6 +323,7 @@ struct binder_buffer {
 	struct binder_node *target_node;
 	size_t data_size;
 	size_t offsets_size;
+	size_t extra_buffers_size;
 	uint8_t data[0];
 };
 
@@ -274,8 +343,14 @@ struct binder_proc {
 	struct vm_area_struct *vma;
 	struct task_struct *tsk;
 	struct files_struct *files;
+	struct mutex files_lock;
+	struct mutex lock;
+	spinlock_t inner_lock;
+	int tmp_ref;
+	bool is_dead;
 	struct hlist_node deferred_work_node;
 	int deferred_work;
+	struct dentry *debugfs_entry;
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
@@ -287,7 +362,12 @@ struct binder_proc {
 	struct page **pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
+	struct list_head page_cache;
+	int page_cache_count;
+	unsigned long page_cache_hits;
+	unsigned long page_cache_misses;
 	struct list_head todo;
+	struct list_head waiting_threads;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
 	struct list_head delivered_death;
@@ -310,6 +390,8 @@ enum {
 struct binder_thread {
 	struct binder_proc *proc;
 	struct rb_node rb_node;
+	struct list_head waiting_thread_node;
+	struct task_struct *task;
 	int pid;
 	int looper;
 	struct binder_transaction *transaction_stack;
@@ -320,6 +402,12 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	unsigned long handoffs; /* proc work handed to this thread */
+	unsigned long local_handoffs; /* ... from a sender on the same cpu */
+	unsigned long spurious_wakeups;
+	struct binder_work *batch_complete;
+	int tmp_ref;
+	bool is_dead;
 };
 
 struct binder_transaction {
@@ -338,25 +426,101 @@ struct binder_transaction {
 	unsigned int	flags;
 	long	priority;
 	long	saved_priority;
+	unsigned int	sched_policy;
+	int	rt_priority;
+	unsigned int	saved_sched_policy;
+	int	saved_rt_priority;
 	uid_t	sender_euid;
 };
 
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
+static void binder_free_proc(struct binder_proc *proc);
+
+static void binder_proc_inc_tmpref(struct binder_proc *proc)
+{
+	spin_lock(&proc->inner_lock);
+	proc->tmp_ref++;
+	spin_unlock(&proc->inner_lock);
+}
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	spin_lock(&proc->inner_lock);
+	proc->tmp_ref--;
+	if (proc->is_dead && !proc->tmp_ref) {
+		spin_unlock(&proc->inner_lock);
+		binder_free_proc(proc);
+		return;
+	}
+	spin_unlock(&proc->inner_lock);
+}
+
+/*
+ * Hand newly queued process work to one idle looper instead of waking
+ * every thread blocked on the process. A looper that last ran on the
+ * current cpu is preferred since it is likely cache hot and the sender
+ * is about to block. Pollers are only woken when no looper is idle.
+ * Called with proc->inner_lock held.
+ */
+static void binder_wakeup_proc_ilocked(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *target = NULL;
+	int cpu = smp_processor_id();
+
+	list_for_each_entry(thread, &proc->waiting_threads,
+			    waiting_thread_node) {
+		if (task_cpu(thread->task) == cpu) {
+			target = thread;
+			thread->local_handoffs++;
+			break;
+		}
+		if (target == NULL)
+			target = thread;
+	}
+	if (target == NULL) {
+		wake_up_interruptible(&proc->wait);
+		return;
+	}
+	list_del_init(&target->waiting_thread_node);
+	target->handoffs++;
+	wake_up_interruptible(&target->wait);
+}
+
+static void binder_thread_dec_tmpref(struct binder_thread *thread)
+{
+	struct binder_proc *proc = thread->proc;
+
+	spin_lock(&proc->inner_lock);
+	thread->tmp_ref--;
+	if (thread->is_dead && !thread->tmp_ref) {
+		spin_unlock(&proc->inner_lock);
+		put_task_struct(thread->task);
+		kfree(thread);
+		binder_stats_deleted(BINDER_STAT_THREAD);
+		return;
+	}
+	spin_unlock(&proc->inner_lock);
+}
 
 /*
  * copied from get_unused_fd_flags
  */
 int task_get_unused_fd_flags(struct binder_proc *proc, int flags)
 {
-	struct files_struct *files = proc->files;
+	struct files_struct *files;
 	int fd, error;
 	struct fdtable *fdt;
 	unsigned long rlim_cur;
 	unsigned long irqs;
 
-	if (files == NULL)
+	mutex_lock(&proc->files_lock);
+	files = proc->files;
+	if (files == NULL) {
+		mutex_unlock(&proc->files_lock);
 		return -ESRCH;
+	}
 
 	error = -EMFILE;
 	spin_lock(&files->file_lock);
@@ -409,6 +573,7 @@ repeat:
 
 out:
 	spin_unlock(&files->file_lock);
+	mutex_unlock(&proc->files_lock);
 	return error;
 }
 
@@ -418,17 +583,21 @@ out:
 static void task_fd_install(
 	struct binder_proc *proc, unsigned int fd, struct file *file)
 {
-	struct files_struct *files = proc->files;
+	struct files_struct *files;
 	struct fdtable *fdt;
 
+	mutex_lock(&proc->files_lock);
+	files = proc->files;
 	if (files == NULL)
-		return;
+		goto out;
 
 	spin_lock(&files->file_lock);
 	fdt = files_fdtable(files);
 	BUG_ON(fdt->fd[fd] != NULL);
 	rcu_assign_pointer(fdt->fd[fd], file);
 	spin_unlock(&files->file_lock);
+out:
+	mutex_unlock(&proc->files_lock);
 }
 
 /*
@@ -448,12 +617,16 @@ static void __put_unused_fd(struct files_struct *files, unsigned int fd)
 static long task_close_fd(struct binder_proc *proc, unsigned int fd)
 {
 	struct file *filp;
-	struct files_struct *files = proc->files;
+	struct files_struct *files;
 	struct fdtable *fdt;
 	int retval;
 
-	if (files == NULL)
+	mutex_lock(&proc->files_lock);
+	files = proc->files;
+	if (files == NULL) {
+		mutex_unlock(&proc->files_lock);
 		return -ESRCH;
+	}
 
 	spin_lock(&files->file_lock);
 	fdt = files_fdtable(files);
@@ -467,6 +640,7 @@ static long task_close_fd(struct binder_proc *proc, unsigned int fd)
 	__put_unused_fd(files, fd);
 	spin_unlock(&files->file_lock);
 	retval = filp_close(filp, files);
+	mutex_unlock(&proc->files_lock);
 
 	/* can't restart close syscall because file table entry was cleared */
 	if (unlikely(retval == -ERESTARTSYS ||
@@ -479,6 +653,7 @@ static long task_close_fd(struct binder_proc *proc, unsigned int fd)
 
 out_unlock:
 	spin_unlock(&files->file_lock);
+	mutex_unlock(&proc->files_lock);
 	return -EBADF;
 }
 
@@ -499,6 +674,60 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static int binder_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static void binder_set_policy(unsigned int policy, int rt_priority)
+{
+	struct sched_param param = { .sched_priority = rt_priority };
+	int ret;
+
+	ret = sched_setscheduler_nocheck(current, policy, &param);
+	if (ret)
+		binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+			     "binder: %d: failed to set policy %u prio %d, "
+			     "%d\n", current->pid, policy, rt_priority, ret);
+}
+
+/*
+ * Run a synchronous transaction with the caller's real-time policy if
+ * that is higher than ours. Since the caller's policy is sampled when
+ * the transaction is sent, this also passes along nested calls.
+ */
+static int binder_inherit_priority(struct binder_transaction *t)
+{
+	unsigned int old_policy = current->policy;
+	int old_prio = current->prio;
+
+	if (!binder_rt_policy(t->sched_policy))
+		return 0;
+	if (binder_rt_policy(current->policy) &&
+	    current->rt_priority >= t->rt_priority)
+		return 0;
+	binder_set_policy(t->sched_policy, t->rt_priority);
+	trace_binder_priority_inherit(t->debug_id, current, old_policy,
+				      old_prio);
+	return 1;
+}
+
+/* Undo binder_inherit_priority() and the nice changes when replying. */
+static void binder_restore_priority(struct binder_transaction *t)
+{
+	unsigned int old_policy = current->policy;
+	int old_prio = current->prio;
+
+	if (current->policy != t->saved_sched_policy ||
+	    current->rt_priority != t->saved_rt_priority) {
+		binder_set_policy(t->saved_sched_policy,
+				  t->saved_rt_priority);
+		trace_binder_priority_restore(t->debug_id, current,
+					      old_policy, old_prio);
+	}
+	binder_set_nice(t->saved_priority);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -591,6 +820,56 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+/*
+ * Take the pages of start-end out of the page cache if all of them are
+ * still mapped, so the allocation needs neither mmap_sem nor page table
+ * updates. Returns 0 if any page has to be mapped.
+ */
+static int binder_page_cache_claim(struct binder_proc *proc,
+				   void *start, void *end)
+{
+	void *page_addr;
+	struct page *page;
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE)
+		if (!proc->pages[(page_addr - proc->buffer) / PAGE_SIZE])
+			return 0;
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		BUG_ON(list_empty(&page->lru));
+		list_del_init(&page->lru);
+		proc->page_cache_count--;
+		proc->page_cache_hits++;
+	}
+	return 1;
+}
+
+/*
+ * Park the first pages of start-end in the page cache instead of
+ * unmapping them. Returns the start of the range that still has to be
+ * unmapped.
+ */
+static void *binder_page_cache_put(struct binder_proc *proc,
+				   void *start, void *end)
+{
+	struct page *page;
+
+	if (proc->vma == NULL)
+		return start;
+
+	while (start < end && proc->page_cache_count < binder_page_cache_max) {
+		page = proc->pages[(start - proc->buffer) / PAGE_SIZE];
+		if (page) {
+			BUG_ON(!list_empty(&page->lru));
+			list_add(&page->lru, &proc->page_cache);
+			proc->page_cache_count++;
+		}
+		start += PAGE_SIZE;
+	}
+	return start;
+}
+
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -608,6 +887,15 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	if (allocate) {
+		if (binder_page_cache_claim(proc, start, end))
+			return 0;
+	} else {
+		start = binder_page_cache_put(proc, start, end);
+		if (end <= start)
+			return 0;
+	}
+
 	if (vma)
 		mm = NULL;
 	else
@@ -637,13 +925,22 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
+		if (*page) {
+			/* still mapped from the page cache */
+			BUG_ON(list_empty(&(*page)->lru));
+			list_del_init(&(*page)->lru);
+			proc->page_cache_count--;
+			proc->page_cache_hits++;
+			continue;
+		}
 		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
 		if (*page == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
+		INIT_LIST_HEAD(&(*page)->lru);
+		proc->page_cache_misses++;
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
 		page_array_ptr = page;
@@ -675,6 +972,8 @@ free_range:
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (*page == NULL)
+			continue; /* page object slot that was never filled */
 		if (vma)
 			zap_page_range(vma, (uintptr_t)page_addr +
 				proc->user_buffer_offset, PAGE_SIZE, NULL);
@@ -694,9 +993,219 @@ err_no_vma:
 	return -ENOMEM;
 }
 
+/*
+ * Start of the page aligned area that holds the BINDER_TYPE_PAGES
+ * objects of a buffer, right after the data and offsets.
+ */
+static void *binder_buffer_sg_start(struct binder_buffer *buffer)
+{
+	return (void *)PAGE_ALIGN((uintptr_t)buffer->data +
+				  ALIGN(buffer->data_size, sizeof(void *)) +
+				  ALIGN(buffer->offsets_size, sizeof(void *)));
+}
+
+/*
+ * Pages of a page object area that are still in the page cache are
+ * owned by the buffer from now on and get filled by copying.
+ */
+static void binder_page_cache_take(struct binder_proc *proc,
+				   void *start, void *end)
+{
+	void *page_addr;
+	struct page *page;
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page == NULL)
+			continue;
+		BUG_ON(list_empty(&page->lru));
+		list_del_init(&page->lru);
+		proc->page_cache_count--;
+	}
+}
+
+/*
+ * A BINDER_TYPE_PAGES object must describe whole pages and fit into the
+ * 'room' left of the buffer's page object area.
+ */
+static int binder_pages_object_ok(struct binder_pages_object *po, size_t room)
+{
+	return !po->flags && po->length &&
+		IS_ALIGNED((uintptr_t)po->buffer, PAGE_SIZE) &&
+		IS_ALIGNED(po->length, PAGE_SIZE) && po->length <= room;
+}
+
+static void binder_put_pages(struct page **pages, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (pages[i])
+			put_page(pages[i]);
+		pages[i] = NULL;
+	}
+}
+
+/*
+ * Pin nr pages of the current task at ubuf. Pages from files and shared
+ * memory can be mapped into the target as they are. Anonymous pages cannot
+ * be inserted into the binder vma, and neither can the zero page that
+ * backs untouched anonymous memory, so those are replaced by copies.
+ * This faults and allocates, so no binder lock may be held. On failure
+ * nothing is left pinned.
+ */
+static int binder_pin_pages(void __user *ubuf, int nr, struct page **pages)
+{
+	struct page *page;
+	int i;
+
+	down_read(&current->mm->mmap_sem);
+	i = get_user_pages(current, current->mm, (unsigned long)ubuf,
+			   nr, 0, 0, pages, NULL);
+	up_read(&current->mm->mmap_sem);
+	if (i < nr) {
+		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+			     "binder: %d: failed to pin pages at %p, "
+			     "got %d of %d\n", current->pid, ubuf, i, nr);
+		binder_put_pages(pages, max(i, 0));
+		return -EFAULT;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (pages[i]->mapping && !PageAnon(pages[i]))
+			continue;
+		page = alloc_page(GFP_HIGHUSER);
+		if (page == NULL) {
+			binder_put_pages(pages, nr);
+			return -ENOMEM;
+		}
+		copy_highpage(page, pages[i]);
+		put_page(pages[i]);
+		pages[i] = page;
+	}
+	return 0;
+}
+
+/*
+ * Pin the pages of every BINDER_TYPE_PAGES object of a transaction into
+ * sg_pages, laid out like the buffer's page object area, before
+ * binder_transaction() takes any lock. The objects are checked again when
+ * they are translated, so this just stops at the first bad one.
+ */
+static int binder_pin_sg_pages(struct binder_buffer *buffer, size_t *offp,
+			       size_t *off_end, struct page **sg_pages,
+			       size_t sg_size)
+{
+	struct binder_pages_object *po;
+	size_t done = 0;
+	int ret;
+
+	for (; offp < off_end; offp++) {
+		if (*offp > buffer->data_size - sizeof(*po) ||
+		    buffer->data_size < sizeof(*po) ||
+		    !IS_ALIGNED(*offp, sizeof(void *)))
+			break;
+		po = (struct binder_pages_object *)(buffer->data + *offp);
+		if (po->type != BINDER_TYPE_PAGES)
+			continue;
+		if (!binder_pages_object_ok(po, sg_size - done))
+			break;
+		ret = binder_pin_pages(po->buffer, po->length / PAGE_SIZE,
+				       sg_pages + done / PAGE_SIZE);
+		if (ret)
+			return ret;
+		done += po->length;
+	}
+	return 0;
+}
+
+/*
+ * Fill start-end of the binder mapping of proc with pages pinned by
+ * binder_pin_pages(). A slot that is already backed by a page gets a copy
+ * instead. The pages are owned by the buffer or released from here on, and
+ * their entries cleared. Called with proc->lock held. On failure the slots
+ * filled so far are released with the buffer.
+ */
+static int binder_share_pages(struct binder_proc *proc, void *start,
+			      size_t length, struct page **pages)
+{
+	void *end = start + length;
+	void *page_addr;
+	struct page **slot;
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	int i, ret = 0;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm == NULL)
+		return -ESRCH;
+
+	down_write(&mm->mmap_sem);
+	vma = proc->vma;
+	if (vma == NULL || vma->vm_mm != mm)
+		ret = -ESRCH;
+	for (page_addr = start, i = 0; page_addr < end && !ret;
+	     page_addr += PAGE_SIZE, i++) {
+		slot = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (*slot) {
+			copy_highpage(*slot, pages[i]);
+			put_page(pages[i]);
+		} else {
+			ret = vm_insert_page(vma, (uintptr_t)page_addr +
+					     proc->user_buffer_offset,
+					     pages[i]);
+			if (ret)
+				break;
+			*slot = pages[i];
+		}
+		pages[i] = NULL;
+	}
+	up_write(&mm->mmap_sem);
+	mmput(mm);
+	return ret;
+}
+
+/*
+ * Release the pages of a page object area. They may belong to the
+ * sender, so they never go back to the page cache.
+ */
+static void binder_free_sg_pages(struct binder_proc *proc,
+				 void *start, void *end)
+{
+	void *page_addr;
+	struct page **page;
+	struct mm_struct *mm;
+	struct vm_area_struct *vma = NULL;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		down_write(&mm->mmap_sem);
+		vma = proc->vma;
+		if (vma && mm != vma->vm_mm)
+			vma = NULL;
+	}
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (*page == NULL)
+			continue;
+		if (vma)
+			zap_page_range(vma, (uintptr_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		put_page(*page);
+		*page = NULL;
+	}
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+}
+
 static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 					      size_t data_size,
-					      size_t offsets_size, int is_async)
+					      size_t offsets_size,
+					      size_t extra_buffers_size,
+					      int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -720,6 +1229,18 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
 		return NULL;
 	}
+	if (extra_buffers_size) {
+		/* one extra page to align the page objects */
+		size_t sg_size = extra_buffers_size + PAGE_SIZE;
+
+		if (sg_size < extra_buffers_size || size + sg_size < size) {
+			binder_user_error("binder: %d: got transaction with "
+				"invalid extra size %zd\n", proc->pid,
+				extra_buffers_size);
+			return NULL;
+		}
+		size += sg_size;
+	}
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -770,8 +1291,28 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
 	if (end_page_addr > has_page_addr)
 		end_page_addr = has_page_addr;
-	if (binder_update_page_range(proc, 1,
-	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
+	if (extra_buffers_size) {
+		/* the page object area is filled by binder_share_pages() */
+		void *sg_start = (void *)PAGE_ALIGN((uintptr_t)buffer->data +
+				ALIGN(data_size, sizeof(void *)) +
+				ALIGN(offsets_size, sizeof(void *)));
+		void *sg_end = sg_start + extra_buffers_size;
+
+		if (binder_update_page_range(proc, 1,
+		    (void *)PAGE_ALIGN((uintptr_t)buffer->data), sg_start,
+		    NULL))
+			return NULL;
+		if (binder_update_page_range(proc, 1, sg_end, end_page_addr,
+					     NULL)) {
+			binder_update_page_range(proc, 0,
+				(void *)PAGE_ALIGN((uintptr_t)buffer->data),
+				sg_start, NULL);
+			return NULL;
+		}
+		binder_page_cache_take(proc, sg_start, sg_end);
+	} else if (binder_update_page_range(proc, 1,
+		   (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr,
+		   NULL))
 		return NULL;
 
 	rb_erase(best_fit, &proc->free_buffers);
@@ -788,6 +1329,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		     "%p\n", proc->pid, size, buffer);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
 	buffer->async_transaction = is_async;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
@@ -866,6 +1408,8 @@ static void binder_free_buf(struct binder_proc *proc,
 
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
 		ALIGN(buffer->offsets_size, sizeof(void *));
+	if (buffer->extra_buffers_size)
+		size += buffer->extra_buffers_size + PAGE_SIZE;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
@@ -886,6 +1430,12 @@ static void binder_free_buf(struct binder_proc *proc,
 			     proc->free_async_space);
 	}
 
+	if (buffer->extra_buffers_size) {
+		void *sg_start = binder_buffer_sg_start(buffer);
+
+		binder_free_sg_pages(proc, sg_start,
+				     sg_start + buffer->extra_buffers_size);
+	}
 	binder_update_page_range(proc, 0,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
@@ -957,7 +1507,7 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -988,8 +1538,10 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 		} else
 			node->local_strong_refs++;
 		if (!node->has_strong_ref && target_list) {
+			spin_lock(&node->proc->inner_lock);
 			list_del_init(&node->work.entry);
 			list_add_tail(&node->work.entry, target_list);
+			spin_unlock(&node->proc->inner_lock);
 		}
 	} else {
 		if (!internal)
@@ -1000,7 +1552,9 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 					"for %d\n", node->debug_id);
 				return -EINVAL;
 			}
+			spin_lock(&node->proc->inner_lock);
 			list_add_tail(&node->work.entry, target_list);
+			spin_unlock(&node->proc->inner_lock);
 		}
 	}
 	return 0;
@@ -1022,20 +1576,25 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 			return 0;
 	}
 	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+		spin_lock(&node->proc->inner_lock);
 		if (list_empty(&node->work.entry)) {
 			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			binder_wakeup_proc_ilocked(node->proc);
 		}
+		spin_unlock(&node->proc->inner_lock);
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
 		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
 			if (node->proc) {
+				spin_lock(&node->proc->inner_lock);
+				list_del_init(&node->work.entry);
+				spin_unlock(&node->proc->inner_lock);
 				rb_erase(&node->rb_node, &node->proc->nodes);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: refless node %d deleted\n",
 					     node->debug_id);
 			} else {
+				list_del_init(&node->work.entry);
 				hlist_del(&node->dead_node);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: dead node %d deleted\n",
@@ -1092,7 +1651,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1154,7 +1713,9 @@ static void binder_delete_ref(struct binder_ref *ref)
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		spin_lock(&ref->proc->inner_lock);
 		list_del(&ref->death->work.entry);
+		spin_unlock(&ref->proc->inner_lock);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1217,6 +1778,39 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
+static inline int binder_is_batched(uint32_t flags)
+{
+	return (flags & (TF_ONE_WAY | TF_BATCH)) == (TF_ONE_WAY | TF_BATCH);
+}
+
+/*
+ * Move the batched async transactions waiting behind the one being
+ * delivered onto this thread, so they go out in the same read instead
+ * of one per BC_FREE_BUFFER round trip. They stay accounted to the node
+ * in async_batch until their buffers are freed, which keeps later
+ * async work for the node ordered behind them. At most max are moved;
+ * returns how many were.
+ * Called with proc->inner_lock held.
+ */
+static int binder_pull_async_batch_ilocked(struct binder_thread *thread,
+					   struct binder_node *node, int max)
+{
+	struct binder_transaction *t, *tmp;
+	LIST_HEAD(batch);
+	int count = 0;
+
+	list_for_each_entry_safe(t, tmp, &node->async_todo, work.entry) {
+		if (count >= max || !binder_is_batched(t->flags))
+			break;
+		list_move_tail(&t->work.entry, &batch);
+		node->async_batch++;
+		count++;
+	}
+	list_splice(&batch, &thread->todo);
+	return count;
+}
+
+/* Called with binder_stack_lock held */
 static void binder_pop_transaction(struct binder_thread *target_thread,
 				   struct binder_transaction *t)
 {
@@ -1239,9 +1833,13 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 {
 	struct binder_thread *target_thread;
 	BUG_ON(t->flags & TF_ONE_WAY);
+	spin_lock(&binder_stack_lock);
 	while (1) {
 		target_thread = t->from;
 		if (target_thread) {
+			struct binder_proc *target_proc = target_thread->proc;
+
+			spin_lock(&target_proc->inner_lock);
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
 				target_thread->return_error2 =
@@ -1252,7 +1850,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 					     "binder: send failed reply for "
 					     "transaction %d to %d:%d\n",
-					      t->debug_id, target_thread->proc->pid,
+					      t->debug_id, target_proc->pid,
 					      target_thread->pid);
 
 				binder_pop_transaction(target_thread, t);
@@ -1261,10 +1859,12 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
-					"already\n", target_thread->proc->pid,
+					"already\n", target_proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
 			}
+			spin_unlock(&target_proc->inner_lock);
+			spin_unlock(&binder_stack_lock);
 			return;
 		} else {
 			struct binder_transaction *next = t->from_parent;
@@ -1279,6 +1879,7 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				binder_debug(BINDER_DEBUG_DEAD_BINDER,
 					     "binder: reply failed,"
 					     " no target thread at root\n");
+				spin_unlock(&binder_stack_lock);
 				return;
 			}
 			t = next;
@@ -1301,6 +1902,7 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 		     proc->pid, buffer->debug_id,
 		     buffer->data_size, buffer->offsets_size, failed_at);
 
+	binder_mutex_lock(&binder_tree_lock, __func__);
 	if (buffer->target_node)
 		binder_dec_node(buffer->target_node, 1, 0);
 
@@ -1356,22 +1958,34 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				task_close_fd(proc, fp->handle);
 			break;
 
+		case BINDER_TYPE_PAGES:
+			/* the pages are released with the buffer */
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        pages %p size %zd\n",
+				     ((struct binder_pages_object *)fp)->buffer,
+				     ((struct binder_pages_object *)fp)->length);
+			break;
+
 		default:
 			printk(KERN_ERR "binder: transaction release %d bad "
 			       "object type %lx\n", debug_id, fp->type);
 			break;
 		}
 	}
+	mutex_unlock(&binder_tree_lock);
 }
 
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       size_t extra_buffers_size)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	size_t *offp, *off_end;
-	struct binder_proc *target_proc;
+	void *sg_ptr, *sg_end;
+	struct page **sg_pages = NULL;
+	struct binder_proc *target_proc = NULL;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
 	struct list_head *target_list;
@@ -1389,15 +2003,16 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		spin_lock(&binder_stack_lock);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			spin_unlock(&binder_stack_lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1407,17 +2022,15 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			spin_unlock(&binder_stack_lock);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
 		target_thread = in_reply_to->from;
-		if (target_thread == NULL) {
-			return_error = BR_DEAD_REPLY;
-			goto err_dead_binder;
-		}
-		if (target_thread->transaction_stack != in_reply_to) {
+		if (target_thread &&
+		    target_thread->transaction_stack != in_reply_to) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad target transaction stack %d, "
 				"expected %d\n",
@@ -1425,17 +2038,33 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			spin_unlock(&binder_stack_lock);
+			binder_restore_priority(in_reply_to);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
-		target_proc = target_thread->proc;
+		if (target_thread) {
+			target_proc = target_thread->proc;
+			spin_lock(&target_proc->inner_lock);
+			target_proc->tmp_ref++;
+			target_thread->tmp_ref++;
+			spin_unlock(&target_proc->inner_lock);
+		}
+		spin_unlock(&binder_stack_lock);
+		binder_restore_priority(in_reply_to);
+		if (target_thread == NULL) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_binder;
+		}
 	} else {
+		binder_mutex_lock(&binder_tree_lock, __func__);
 		if (tr->target.handle) {
 			struct binder_ref *ref;
 			ref = binder_get_ref(proc, tr->target.handle);
 			if (ref == NULL) {
+				mutex_unlock(&binder_tree_lock);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
@@ -1446,6 +2075,7 @@ static void binder_transaction(struct binder_proc *proc,
 		} else {
 			target_node = binder_context_mgr_node;
 			if (target_node == NULL) {
+				mutex_unlock(&binder_tree_lock);
 				return_error = BR_DEAD_REPLY;
 				goto err_no_context_mgr_node;
 			}
@@ -1453,13 +2083,25 @@ static void binder_transaction(struct binder_proc *proc,
 		e->to_node = target_node->debug_id;
 		target_proc = target_node->proc;
 		if (target_proc == NULL) {
+			mutex_unlock(&binder_tree_lock);
+			target_node = NULL;
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
-		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
+		/*
+		 * Pin the target proc and node before dropping the tree
+		 * lock; the node reference is handed over to the buffer.
+		 */
+		binder_proc_inc_tmpref(target_proc);
+		binder_inc_node(target_node, 1, 0, NULL);
+		mutex_unlock(&binder_tree_lock);
+
+		if (!(tr->flags & TF_ONE_WAY)) {
 			struct binder_transaction *tmp;
+
+			spin_lock(&binder_stack_lock);
 			tmp = thread->transaction_stack;
-			if (tmp->to_thread != thread) {
+			if (tmp && tmp->to_thread != thread) {
 				binder_user_error("binder: %d:%d got new "
 					"transaction with bad transaction stack"
 					", transaction %d has target %d:%d\n",
@@ -1467,6 +2109,7 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				spin_unlock(&binder_stack_lock);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
@@ -1475,6 +2118,12 @@ static void binder_transaction(struct binder_proc *proc,
 					target_thread = tmp->from;
 				tmp = tmp->from_parent;
 			}
+			if (target_thread) {
+				spin_lock(&target_proc->inner_lock);
+				target_thread->tmp_ref++;
+				spin_unlock(&target_proc->inner_lock);
+			}
+			spin_unlock(&binder_stack_lock);
 		}
 	}
 	if (target_thread) {
@@ -1483,7 +2132,7 @@ static void binder_transaction(struct binder_proc *proc,
 		target_wait = &target_thread->wait;
 	} else {
 		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
+		target_wait = NULL;
 	}
 	e->to_proc = target_proc->pid;
 
@@ -1500,9 +2149,10 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_alloc_tcomplete_failed;
 	}
+	INIT_LIST_HEAD(&tcomplete->entry);
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1522,6 +2172,12 @@ static void binder_transaction(struct binder_proc *proc,
 			     tr->data.ptr.buffer, tr->data.ptr.offsets,
 			     tr->data_size, tr->offsets_size);
 
+	trace_binder_transaction(t->debug_id, reply,
+				 target_node ? target_node->debug_id : 0,
+				 target_proc->pid,
+				 target_thread ? target_thread->pid : 0,
+				 tr->code, tr->flags);
+
 	if (!reply && !(tr->flags & TF_ONE_WAY))
 		t->from = thread;
 	else
@@ -1532,18 +2188,34 @@ static void binder_transaction(struct binder_proc *proc,
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
+	t->sched_policy = current->policy;
+	t->rt_priority = current->rt_priority;
+
+	if (!IS_ALIGNED(extra_buffers_size, PAGE_SIZE)) {
+		binder_user_error("binder: %d:%d got transaction with "
+			"unaligned buffers size, %zd\n",
+			proc->pid, thread->pid, extra_buffers_size);
+		return_error = BR_FAILED_REPLY;
+		goto err_binder_alloc_buf_failed;
+	}
+
+	binder_mutex_lock(&target_proc->lock, __func__);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		tr->offsets_size, extra_buffers_size,
+		!reply && (t->flags & TF_ONE_WAY));
+	if (t->buffer) {
+		t->buffer->allow_user_free = 0;
+		t->buffer->debug_id = t->debug_id;
+		t->buffer->transaction = t;
+		t->buffer->target_node = target_node;
+	}
+	mutex_unlock(&target_proc->lock);
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
-	t->buffer->debug_id = t->debug_id;
-	t->buffer->transaction = t;
-	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
+	trace_binder_transaction_alloc_buf(t->debug_id, tr->data_size,
+					   tr->offsets_size);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
@@ -1567,6 +2239,21 @@ static void binder_transaction(struct binder_proc *proc,
 		goto err_bad_offset;
 	}
 	off_end = (void *)offp + tr->offsets_size;
+	sg_ptr = binder_buffer_sg_start(t->buffer);
+	sg_end = sg_ptr + extra_buffers_size;
+	if (extra_buffers_size) {
+		sg_pages = kcalloc(extra_buffers_size / PAGE_SIZE,
+				   sizeof(*sg_pages), GFP_KERNEL);
+		if (sg_pages == NULL ||
+		    binder_pin_sg_pages(t->buffer, offp, off_end, sg_pages,
+					extra_buffers_size)) {
+			binder_user_error("binder: %d:%d failed to pin pages "
+				"for transaction\n", proc->pid, thread->pid);
+			return_error = BR_FAILED_REPLY;
+			goto err_pin_pages_failed;
+		}
+	}
+	binder_mutex_lock(&binder_tree_lock, __func__);
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
 		if (*offp > t->buffer->data_size - sizeof(*fp) ||
@@ -1576,7 +2263,7 @@ static void binder_transaction(struct binder_proc *proc,
 				"invalid offset, %zd\n",
 				proc->pid, thread->pid, *offp);
 			return_error = BR_FAILED_REPLY;
-			goto err_bad_offset;
+			goto err_bad_object_offset;
 		}
 		fp = (struct flat_binder_object *)(t->buffer->data + *offp);
 		switch (fp->type) {
@@ -1696,39 +2383,130 @@ static void binder_transaction(struct binder_proc *proc,
 			fp->handle = target_fd;
 		} break;
 
-		default:
-			binder_user_error("binder: %d:%d got transactio"
-				"n with invalid object type, %lx\n",
+		case BINDER_TYPE_PAGES: {
+			struct binder_pages_object *po = (void *)fp;
+			int ret;
+
+			if (!binder_pages_object_ok(po, sg_end - sg_ptr)) {
+				binder_user_error("binder: %d:%d got transaction with invalid pages object, %p size %zd\n",
+					proc->pid, thread->pid, po->buffer,
+					po->length);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_pages_object;
+			}
+			binder_mutex_lock(&target_proc->lock, __func__);
+			ret = binder_share_pages(target_proc, sg_ptr,
+				po->length, sg_pages + (extra_buffers_size -
+					(sg_end - sg_ptr)) / PAGE_SIZE);
+			mutex_unlock(&target_proc->lock);
+			if (ret) {
+				binder_user_error("binder: %d:%d failed to share pages %p size %zd, %d\n",
+					proc->pid, thread->pid, po->buffer,
+					po->length, ret);
+				return_error = BR_FAILED_REPLY;
+				goto err_share_pages_failed;
+			}
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        pages %p size %zd -> %p\n",
+				     po->buffer, po->length,
+				     sg_ptr + target_proc->user_buffer_offset);
+			po->buffer = sg_ptr + target_proc->user_buffer_offset;
+			sg_ptr += po->length;
+		} break;
+
+		default:
+			binder_user_error("binder: %d:%d got transactio"
+				"n with invalid object type, %lx\n",
 				proc->pid, thread->pid, fp->type);
 			return_error = BR_FAILED_REPLY;
 			goto err_bad_object_type;
 		}
 	}
+	mutex_unlock(&binder_tree_lock);
+	kfree(sg_pages);
+	sg_pages = NULL;
+
+	/*
+	 * Queue the completion first so that it is always seen before a
+	 * reply that the target may send as soon as t is queued.
+	 */
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	spin_lock(&proc->inner_lock);
+	if (!binder_is_batched(t->flags)) {
+		list_add_tail(&tcomplete->entry, &thread->todo);
+		thread->batch_complete = NULL;
+	} else if (thread->batch_complete == NULL ||
+		   thread->todo.prev != &thread->batch_complete->entry) {
+		list_add_tail(&tcomplete->entry, &thread->todo);
+		thread->batch_complete = tcomplete;
+	} /* else the pending batch completion covers this one too */
+	spin_unlock(&proc->inner_lock);
+
+	t->work.type = BINDER_WORK_TRANSACTION;
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		spin_lock(&binder_stack_lock);
+		if (in_reply_to->from != target_thread) {
+			spin_unlock(&binder_stack_lock);
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_proc_or_thread;
+		}
+		spin_lock(&target_proc->inner_lock);
 		binder_pop_transaction(target_thread, in_reply_to);
+		list_add_tail(&t->work.entry, target_list);
+		spin_unlock(&target_proc->inner_lock);
+		spin_unlock(&binder_stack_lock);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		spin_lock(&binder_stack_lock);
+		spin_lock(&target_proc->inner_lock);
+		if (target_proc->is_dead ||
+		    (target_thread && target_thread->is_dead)) {
+			spin_unlock(&target_proc->inner_lock);
+			spin_unlock(&binder_stack_lock);
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_proc_or_thread;
+		}
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
+		list_add_tail(&t->work.entry, target_list);
+		if (!target_thread)
+			binder_wakeup_proc_ilocked(target_proc);
+		spin_unlock(&target_proc->inner_lock);
+		spin_unlock(&binder_stack_lock);
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
+		spin_lock(&target_proc->inner_lock);
+		if (target_proc->is_dead) {
+			spin_unlock(&target_proc->inner_lock);
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_proc_or_thread;
+		}
 		if (target_node->has_async_transaction) {
 			target_list = &target_node->async_todo;
 			target_wait = NULL;
 		} else
 			target_node->has_async_transaction = 1;
+		list_add_tail(&t->work.entry, target_list);
+		if (target_list == &target_proc->todo)
+			binder_wakeup_proc_ilocked(target_proc);
+		spin_unlock(&target_proc->inner_lock);
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	if (list_empty(&tcomplete->entry)) {
+		kfree(tcomplete);
+		binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
+	}
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	binder_proc_dec_tmpref(target_proc);
 	return;
 
+err_share_pages_failed:
+err_bad_pages_object:
 err_get_unused_fd_failed:
 err_fget_failed:
 err_fd_not_allowed:
@@ -1736,11 +2514,27 @@ err_binder_get_ref_for_node_failed:
 err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
+err_bad_object_offset:
+	mutex_unlock(&binder_tree_lock);
+err_dead_proc_or_thread:
+	spin_lock(&proc->inner_lock);
+	list_del_init(&tcomplete->entry);
+	if (thread->batch_complete == tcomplete)
+		thread->batch_complete = NULL;
+	spin_unlock(&proc->inner_lock);
+err_pin_pages_failed:
 err_bad_offset:
 err_copy_data_failed:
+	if (sg_pages) {
+		binder_put_pages(sg_pages, extra_buffers_size / PAGE_SIZE);
+		kfree(sg_pages);
+	}
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	target_node = NULL; /* reference dropped with the buffer */
+	binder_mutex_lock(&target_proc->lock, __func__);
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
+	mutex_unlock(&target_proc->lock);
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
@@ -1749,6 +2543,15 @@ err_alloc_tcomplete_failed:
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
 err_bad_call_stack:
+	if (target_node) {
+		binder_mutex_lock(&binder_tree_lock, __func__);
+		binder_dec_node(target_node, 1, 0);
+		mutex_unlock(&binder_tree_lock);
+	}
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	if (target_proc)
+		binder_proc_dec_tmpref(target_proc);
 err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
@@ -1764,12 +2567,17 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
-	BUG_ON(thread->return_error != BR_OK);
-	if (in_reply_to) {
-		thread->return_error = BR_TRANSACTION_COMPLETE;
+	spin_lock(&proc->inner_lock);
+	if (thread->return_error != BR_OK &&
+	    thread->return_error2 == BR_OK) {
+		/* a failed reply to an outer transaction got here first */
+		thread->return_error2 = thread->return_error;
+	}
+	thread->return_error = in_reply_to ? BR_TRANSACTION_COMPLETE :
+					     return_error;
+	spin_unlock(&proc->inner_lock);
+	if (in_reply_to)
 		binder_send_failed_reply(in_reply_to, return_error);
-	} else
-		thread->return_error = return_error;
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1784,9 +2592,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1800,6 +2608,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			binder_mutex_lock(&binder_tree_lock, __func__);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
@@ -1815,6 +2624,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			} else
 				ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&binder_tree_lock);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1843,6 +2653,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				     proc->pid, thread->pid, debug_string, ref->debug_id,
 				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			mutex_unlock(&binder_tree_lock);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1857,8 +2668,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_mutex_lock(&binder_tree_lock, __func__);
 			node = binder_get_node(proc, node_ptr);
 			if (node == NULL) {
+				mutex_unlock(&binder_tree_lock);
 				binder_user_error("binder: %d:%d "
 					"%s u%p no match\n",
 					proc->pid, thread->pid,
@@ -1869,6 +2682,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				break;
 			}
 			if (cookie != node->cookie) {
+				mutex_unlock(&binder_tree_lock);
 				binder_user_error("binder: %d:%d %s u%p node %d"
 					" cookie mismatch %p != %p\n",
 					proc->pid, thread->pid,
@@ -1880,6 +2694,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			}
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
+					mutex_unlock(&binder_tree_lock);
 					binder_user_error("binder: %d:%d "
 						"BC_ACQUIRE_DONE node %d has "
 						"no pending acquire request\n",
@@ -1890,6 +2705,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				node->pending_strong_ref = 0;
 			} else {
 				if (node->pending_weak_ref == 0) {
+					mutex_unlock(&binder_tree_lock);
 					binder_user_error("binder: %d:%d "
 						"BC_INCREFS_DONE node %d has "
 						"no pending increfs request\n",
@@ -1905,6 +2721,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			mutex_unlock(&binder_tree_lock);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1922,20 +2739,26 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			binder_mutex_lock(&proc->lock, __func__);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* claim the buffer so a racing free cannot find it */
+			buffer->allow_user_free = 0;
+			spin_lock(&binder_stack_lock);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1945,15 +2768,26 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				buffer->transaction->buffer = NULL;
 				buffer->transaction = NULL;
 			}
+			spin_unlock(&binder_stack_lock);
+			mutex_unlock(&proc->lock);
+			trace_binder_transaction_free_buf(buffer->debug_id,
+							  buffer->data_size,
+							  buffer->offsets_size);
 			if (buffer->async_transaction && buffer->target_node) {
+				spin_lock(&proc->inner_lock);
 				BUG_ON(!buffer->target_node->has_async_transaction);
-				if (list_empty(&buffer->target_node->async_todo))
+				if (buffer->target_node->async_batch)
+					buffer->target_node->async_batch--;
+				else if (list_empty(&buffer->target_node->async_todo))
 					buffer->target_node->has_async_transaction = 0;
 				else
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+				spin_unlock(&proc->inner_lock);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
+			binder_mutex_lock(&proc->lock, __func__);
 			binder_free_buf(proc, buffer);
+			mutex_unlock(&proc->lock);
 			break;
 		}
 
@@ -1964,7 +2798,19 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, tr.buffers_size);
 			break;
 		}
 
@@ -1972,6 +2818,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -1989,11 +2836,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2002,12 +2851,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			spin_unlock(&proc->inner_lock);
 			break;
 		case BC_EXIT_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			spin_lock(&proc->inner_lock);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			spin_unlock(&proc->inner_lock);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -2023,8 +2875,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_mutex_lock(&binder_tree_lock, __func__);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
+				mutex_unlock(&binder_tree_lock);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2051,11 +2905,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
+					mutex_unlock(&binder_tree_lock);
 					break;
 				}
 				death = kzalloc(sizeof(*death), GFP_KERNEL);
 				if (death == NULL) {
+					mutex_unlock(&binder_tree_lock);
+					spin_lock(&proc->inner_lock);
 					thread->return_error = BR_ERROR;
+					spin_unlock(&proc->inner_lock);
 					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 						     "binder: %d:%d "
 						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
@@ -2068,12 +2926,14 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					spin_lock(&proc->inner_lock);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_wakeup_proc_ilocked(proc);
 					}
+					spin_unlock(&proc->inner_lock);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2082,6 +2942,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					mutex_unlock(&binder_tree_lock);
 					break;
 				}
 				death = ref->death;
@@ -2093,22 +2954,26 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					mutex_unlock(&binder_tree_lock);
 					break;
 				}
 				ref->death = NULL;
+				spin_lock(&proc->inner_lock);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_wakeup_proc_ilocked(proc);
 					}
 				} else {
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				spin_unlock(&proc->inner_lock);
 			}
+			mutex_unlock(&binder_tree_lock);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2118,6 +2983,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			binder_mutex_lock(&binder_tree_lock, __func__);
+			spin_lock(&proc->inner_lock);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2129,6 +2996,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				spin_unlock(&proc->inner_lock);
+				mutex_unlock(&binder_tree_lock);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2142,9 +3011,11 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_add_tail(&death->work.entry, &thread->todo);
 				} else {
 					list_add_tail(&death->work.entry, &proc->todo);
-					wake_up_interruptible(&proc->wait);
+					binder_wakeup_proc_ilocked(proc);
 				}
 			}
+			spin_unlock(&proc->inner_lock);
+			mutex_unlock(&binder_tree_lock);
 		} break;
 
 		default:
@@ -2161,9 +3032,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2187,6 +3058,10 @@ static int binder_thread_read(struct binder_proc *proc,
 {
 	void __user *ptr = buffer + *consumed;
 	void __user *end = buffer + size;
+	struct binder_work *w;
+	struct list_head *list;
+	int tree_locked = 0;
+	int batch_pulled = 0; /* async_batch_max covers the whole read */
 
 	int ret = 0;
 	int wait_for_proc_work;
@@ -2198,30 +3073,47 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	spin_lock(&binder_stack_lock);
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
+	spin_unlock(&proc->inner_lock);
+	spin_unlock(&binder_stack_lock);
 
 	if (thread->return_error != BR_OK && ptr < end) {
-		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+		uint32_t return_error, return_error2;
+
+		spin_lock(&proc->inner_lock);
+		return_error = thread->return_error;
+		return_error2 = thread->return_error2;
+		thread->return_error = BR_OK;
+		thread->return_error2 = BR_OK;
+		spin_unlock(&proc->inner_lock);
+		if (return_error2 != BR_OK) {
+			if (put_user(return_error2, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (ptr == end)
+			if (ptr == end) {
+				spin_lock(&proc->inner_lock);
+				thread->return_error = return_error;
+				spin_unlock(&proc->inner_lock);
 				goto done;
-			thread->return_error2 = BR_OK;
+			}
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
+		if (put_user(return_error, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
 		goto done;
 	}
 
 
+	spin_lock(&proc->inner_lock);
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
-	if (wait_for_proc_work)
+	if (wait_for_proc_work) {
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+		list_add(&thread->waiting_thread_node, &proc->waiting_threads);
+	}
+	spin_unlock(&proc->inner_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2237,7 +3129,7 @@ retry:
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
 		} else
-			ret = wait_event_interruptible_exclusive(proc->wait, binder_has_proc_work(proc, thread));
+			ret = wait_event_interruptible(thread->wait, binder_has_proc_work(proc, thread));
 	} else {
 		if (non_block) {
 			if (!binder_has_thread_work(thread))
@@ -2245,10 +3137,17 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
-	if (wait_for_proc_work)
+	spin_lock(&proc->inner_lock);
+	if (wait_for_proc_work) {
 		proc->ready_threads--;
+		if (!list_empty(&thread->waiting_thread_node))
+			list_del_init(&thread->waiting_thread_node);
+		else if (ret && !list_empty(&proc->todo))
+			/* we were picked but got a signal, pass the work on */
+			binder_wakeup_proc_ilocked(proc);
+	}
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	spin_unlock(&proc->inner_lock);
 
 	if (ret)
 		return ret;
@@ -2256,21 +3155,50 @@ retry:
 	while (1) {
 		uint32_t cmd;
 		struct binder_transaction_data tr;
-		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		int from_pid, from_tid;
+		int batched = 0;
 
+		spin_lock(&proc->inner_lock);
 		if (!list_empty(&thread->todo))
-			w = list_first_entry(&thread->todo, struct binder_work, entry);
+			list = &thread->todo;
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
-			w = list_first_entry(&proc->todo, struct binder_work, entry);
+			list = &proc->todo;
 		else {
-			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
+			spin_unlock(&proc->inner_lock);
+			if (tree_locked) {
+				mutex_unlock(&binder_tree_lock);
+				tree_locked = 0;
+			}
+			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) { /* no data added */
+				thread->spurious_wakeups++;
 				goto retry;
+			}
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			spin_unlock(&proc->inner_lock);
 			break;
+		}
+
+		w = list_first_entry(list, struct binder_work, entry);
+		if (w->type != BINDER_WORK_TRANSACTION &&
+		    w->type != BINDER_WORK_TRANSACTION_COMPLETE &&
+		    !tree_locked) {
+			/*
+			 * Node and death work look at reference counts,
+			 * refetch it with the tree lock held.
+			 */
+			spin_unlock(&proc->inner_lock);
+			binder_mutex_lock(&binder_tree_lock, __func__);
+			tree_locked = 1;
+			continue;
+		}
+		list_del_init(&w->entry);
+		if (w == thread->batch_complete)
+			thread->batch_complete = NULL;
+		spin_unlock(&proc->inner_lock);
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
@@ -2279,7 +3207,7 @@ retry:
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
 			cmd = BR_TRANSACTION_COMPLETE;
 			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
+				goto err_requeue;
 			ptr += sizeof(uint32_t);
 
 			binder_stat_br(proc, thread, cmd);
@@ -2287,7 +3215,6 @@ retry:
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
 
-			list_del(&w->entry);
 			kfree(w);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
@@ -2320,21 +3247,24 @@ retry:
 			}
 			if (cmd != BR_NOOP) {
 				if (put_user(cmd, (uint32_t __user *)ptr))
-					return -EFAULT;
+					goto err_requeue;
 				ptr += sizeof(uint32_t);
 				if (put_user(node->ptr, (void * __user *)ptr))
-					return -EFAULT;
+					goto err_requeue;
 				ptr += sizeof(void *);
 				if (put_user(node->cookie, (void * __user *)ptr))
-					return -EFAULT;
+					goto err_requeue;
 				ptr += sizeof(void *);
 
 				binder_stat_br(proc, thread, cmd);
 				binder_debug(BINDER_DEBUG_USER_REFS,
 					     "binder: %d:%d %s %d u%p c%p\n",
 					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
+				/* keep the work queued until the node state settles */
+				spin_lock(&proc->inner_lock);
+				list_add(&w->entry, list);
+				spin_unlock(&proc->inner_lock);
 			} else {
-				list_del_init(&w->entry);
 				if (!weak && !strong) {
 					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 						     "binder: %d:%d node %d u%p c%p deleted\n",
@@ -2363,10 +3293,10 @@ retry:
 			else
 				cmd = BR_DEAD_BINDER;
 			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
+				goto err_requeue;
 			ptr += sizeof(uint32_t);
 			if (put_user(death->cookie, (void * __user *)ptr))
-				return -EFAULT;
+				goto err_requeue;
 			ptr += sizeof(void *);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
 				     "binder: %d:%d %s %p\n",
@@ -2377,31 +3307,50 @@ retry:
 				      death->cookie);
 
 			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
 				kfree(death);
 				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
+			} else {
+				spin_lock(&proc->inner_lock);
+				list_add(&w->entry, &proc->delivered_death);
+				spin_unlock(&proc->inner_lock);
+			}
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
 		}
 
+		if (tree_locked) {
+			mutex_unlock(&binder_tree_lock);
+			tree_locked = 0;
+		}
 		if (!t)
 			continue;
 
 		BUG_ON(t->buffer == NULL);
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
+			if (binder_is_batched(t->flags)) {
+				spin_lock(&proc->inner_lock);
+				batch_pulled += binder_pull_async_batch_ilocked(
+					thread, target_node,
+					binder_async_batch_max - batch_pulled);
+				spin_unlock(&proc->inner_lock);
+				batched = 1;
+			}
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
 			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			t->saved_sched_policy = current->policy;
+			t->saved_rt_priority = current->rt_priority;
+			if ((t->flags & TF_ONE_WAY) ||
+			    !binder_inherit_priority(t)) {
+				if (t->priority < target_node->min_priority &&
+				    !(t->flags & TF_ONE_WAY))
+					binder_set_nice(t->priority);
+				else if (!(t->flags & TF_ONE_WAY) ||
+					 t->saved_priority > target_node->min_priority)
+					binder_set_nice(target_node->min_priority);
+			}
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2412,13 +3361,19 @@ retry:
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
 
+		spin_lock(&binder_stack_lock);
 		if (t->from) {
 			struct task_struct *sender = t->from->proc->tsk;
 			tr.sender_pid = task_tgid_nr_ns(sender,
 							current->nsproxy->pid_ns);
+			from_pid = t->from->proc->pid;
+			from_tid = t->from->pid;
 		} else {
 			tr.sender_pid = 0;
+			from_pid = 0;
+			from_tid = 0;
 		}
+		spin_unlock(&binder_stack_lock);
 
 		tr.data_size = t->buffer->data_size;
 		tr.offsets_size = t->buffer->offsets_size;
@@ -2429,12 +3384,13 @@ retry:
 					    sizeof(void *));
 
 		if (put_user(cmd, (uint32_t __user *)ptr))
-			return -EFAULT;
+			goto err_requeue;
 		ptr += sizeof(uint32_t);
 		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
+			goto err_requeue;
 		ptr += sizeof(tr);
 
+		trace_binder_transaction_received(t->debug_id);
 		binder_stat_br(proc, thread, cmd);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
@@ -2442,49 +3398,72 @@ retry:
 			     proc->pid, thread->pid,
 			     (cmd == BR_TRANSACTION) ? "BR_TRANSACTION" :
 			     "BR_REPLY",
-			     t->debug_id, t->from ? t->from->proc->pid : 0,
-			     t->from ? t->from->pid : 0, cmd,
+			     t->debug_id, from_pid, from_tid, cmd,
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
 		t->buffer->allow_user_free = 1;
+		spin_lock(&binder_stack_lock);
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
+			spin_unlock(&binder_stack_lock);
 		} else {
 			t->buffer->transaction = NULL;
+			spin_unlock(&binder_stack_lock);
 			kfree(t);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION);
 		}
-		break;
+		if (!batched)
+			break;
 	}
 
 done:
+	if (tree_locked)
+		mutex_unlock(&binder_tree_lock);
 
 	*consumed = ptr - buffer;
+	spin_lock(&proc->inner_lock);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		spin_unlock(&proc->inner_lock);
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
-	}
+	} else
+		spin_unlock(&proc->inner_lock);
 	return 0;
+
+err_requeue:
+	/* leave the work for the next read, as if it was never dequeued */
+	spin_lock(&proc->inner_lock);
+	list_add(&w->entry, list);
+	spin_unlock(&proc->inner_lock);
+	if (tree_locked)
+		mutex_unlock(&binder_tree_lock);
+	return -EFAULT;
 }
 
-static void binder_release_work(struct list_head *list)
+static void binder_release_work(struct binder_proc *proc,
+				struct list_head *list)
 {
 	struct binder_work *w;
-	while (!list_empty(list)) {
+	while (1) {
+		spin_lock(&proc->inner_lock);
+		if (list_empty(list)) {
+			spin_unlock(&proc->inner_lock);
+			break;
+		}
 		w = list_first_entry(list, struct binder_work, entry);
 		list_del_init(&w->entry);
+		spin_unlock(&proc->inner_lock);
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			struct binder_transaction *t;
@@ -2528,8 +3507,11 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
 		thread->pid = current->pid;
+		get_task_struct(current);
+		thread->task = current;
 		init_waitqueue_head(&thread->wait);
 		INIT_LIST_HEAD(&thread->todo);
+		INIT_LIST_HEAD(&thread->waiting_thread_node);
 		rb_link_node(&thread->rb_node, parent, p);
 		rb_insert_color(&thread->rb_node, &proc->threads);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2539,6 +3521,41 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 	return thread;
 }
 
+/*
+ * An exiting thread may still have async transactions queued that it
+ * never read: the one BC_FREE_BUFFER handed it, and any batch pulled in
+ * behind a delivered transaction. Their node keeps has_async_transaction
+ * and async_batch set until their buffers are freed, so dropping them
+ * would hold back every later async transaction for the node. Give them
+ * to another looper instead; the accounting stays as it is.
+ * Called with proc->lock held, for a proc that is not dead.
+ */
+static void binder_requeue_async_work(struct binder_proc *proc,
+				      struct binder_thread *thread)
+{
+	struct binder_work *w, *tmp;
+	struct binder_transaction *t;
+	int requeued = 0;
+
+	spin_lock(&proc->inner_lock);
+	list_for_each_entry_safe(w, tmp, &thread->todo, entry) {
+		if (w->type != BINDER_WORK_TRANSACTION)
+			continue;
+		t = container_of(w, struct binder_transaction, work);
+		if (!(t->flags & TF_ONE_WAY) || !t->buffer->target_node)
+			continue;
+		list_move_tail(&w->entry, &proc->todo);
+		requeued++;
+	}
+	if (requeued)
+		binder_wakeup_proc_ilocked(proc);
+	spin_unlock(&proc->inner_lock);
+}
+
+/*
+ * Called with binder_tree_lock and proc->lock held. The thread memory
+ * stays around until the last temporary reference is dropped.
+ */
 static int binder_free_thread(struct binder_proc *proc,
 			      struct binder_thread *thread)
 {
@@ -2547,6 +3564,12 @@ static int binder_free_thread(struct binder_proc *proc,
 	int active_transactions = 0;
 
 	rb_erase(&thread->rb_node, &proc->threads);
+	spin_lock(&proc->inner_lock);
+	thread->tmp_ref++;
+	thread->is_dead = true;
+	spin_unlock(&proc->inner_lock);
+
+	spin_lock(&binder_stack_lock);
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
 		send_reply = t;
@@ -2572,11 +3595,13 @@ static int binder_free_thread(struct binder_proc *proc,
 		} else
 			BUG();
 	}
+	spin_unlock(&binder_stack_lock);
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
-	binder_release_work(&thread->todo);
-	kfree(thread);
-	binder_stats_deleted(BINDER_STAT_THREAD);
+	if (!proc->is_dead)
+		binder_requeue_async_work(proc, thread);
+	binder_release_work(proc, &thread->todo);
+	binder_thread_dec_tmpref(thread);
 	return active_transactions;
 }
 
@@ -2587,12 +3612,18 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	binder_mutex_lock(&proc->lock, __func__);
 	thread = binder_get_thread(proc);
+	mutex_unlock(&proc->lock);
+	if (thread == NULL)
+		return POLLERR;
 
+	spin_lock(&binder_stack_lock);
+	spin_lock(&proc->inner_lock);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	spin_unlock(&proc->inner_lock);
+	spin_unlock(&binder_stack_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2624,8 +3655,9 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	binder_mutex_lock(&proc->lock, __func__);
 	thread = binder_get_thread(proc);
+	mutex_unlock(&proc->lock);
 	if (thread == NULL) {
 		ret = -ENOMEM;
 		goto err;
@@ -2658,8 +3690,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		if (bwr.read_size > 0) {
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
+			spin_lock(&proc->inner_lock);
 			if (!list_empty(&proc->todo))
-				wake_up_interruptible(&proc->wait);
+				binder_wakeup_proc_ilocked(proc);
+			spin_unlock(&proc->inner_lock);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2676,14 +3710,22 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		spin_lock(&proc->inner_lock);
+		proc->max_threads = max_threads;
+		spin_unlock(&proc->inner_lock);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
+		binder_mutex_lock(&binder_tree_lock, __func__);
 		if (binder_context_mgr_node != NULL) {
+			mutex_unlock(&binder_tree_lock);
 			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
 			ret = -EBUSY;
 			goto err;
@@ -2694,6 +3736,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 				       "CONTEXT_MGR bad uid %d != %d\n",
 				       current->cred->euid,
 				       binder_context_mgr_uid);
+				mutex_unlock(&binder_tree_lock);
 				ret = -EPERM;
 				goto err;
 			}
@@ -2701,6 +3744,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			binder_context_mgr_uid = current->cred->euid;
 		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
 		if (binder_context_mgr_node == NULL) {
+			mutex_unlock(&binder_tree_lock);
 			ret = -ENOMEM;
 			goto err;
 		}
@@ -2708,11 +3752,16 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		binder_context_mgr_node->local_strong_refs++;
 		binder_context_mgr_node->has_strong_ref = 1;
 		binder_context_mgr_node->has_weak_ref = 1;
+		mutex_unlock(&binder_tree_lock);
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
 			     proc->pid, thread->pid);
+		binder_mutex_lock(&binder_tree_lock, __func__);
+		binder_mutex_lock(&proc->lock, __func__);
 		binder_free_thread(proc, thread);
+		mutex_unlock(&proc->lock);
+		mutex_unlock(&binder_tree_lock);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2731,9 +3780,11 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		spin_lock(&proc->inner_lock);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		spin_unlock(&proc->inner_lock);
+	}
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2839,7 +3890,9 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	binder_insert_free_buffer(proc, buffer);
 	proc->free_async_space = proc->buffer_size / 2;
 	barrier();
+	mutex_lock(&proc->files_lock);
 	proc->files = get_files_struct(proc->tsk);
+	mutex_unlock(&proc->files_lock);
 	proc->vma = vma;
 
 	/*printk(KERN_INFO "binder_mmap: %d %lx-%lx maps %p\n",
@@ -2875,23 +3928,27 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	get_task_struct(current);
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
+	INIT_LIST_HEAD(&proc->waiting_threads);
 	init_waitqueue_head(&proc->wait);
+	INIT_LIST_HEAD(&proc->page_cache);
+	mutex_init(&proc->lock);
+	mutex_init(&proc->files_lock);
+	spin_lock_init(&proc->inner_lock);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
-	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	binder_stats_created(BINDER_STAT_PROC);
+	mutex_lock(&binder_procs_lock);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_procs_lock);
 
-	if (binder_proc_dir_entry_proc) {
+	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
 		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
-		remove_proc_entry(strbuf, binder_proc_dir_entry_proc);
-		create_proc_read_entry(strbuf, S_IRUGO,
-				       binder_proc_dir_entry_proc,
-				       binder_read_proc_proc, proc);
+		proc->debugfs_entry = debugfs_create_file(strbuf, S_IRUGO,
+			binder_debugfs_dir_entry_proc,
+			(void *)(unsigned long)proc->pid, &binder_proc_fops);
 	}
 
 	return 0;
@@ -2910,6 +3967,9 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	binder_mutex_lock(&proc->lock, __func__);
+	spin_lock(&proc->inner_lock);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2918,6 +3978,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	spin_unlock(&proc->inner_lock);
+	mutex_unlock(&proc->lock);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -2928,11 +3990,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 static int binder_release(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc = filp->private_data;
-	if (binder_proc_dir_entry_proc) {
-		char strbuf[11];
-		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
-		remove_proc_entry(strbuf, binder_proc_dir_entry_proc);
-	}
+	debugfs_remove(proc->debugfs_entry);
 
 	binder_defer_work(proc, BINDER_DEFERRED_RELEASE);
 
@@ -2942,14 +4000,24 @@ static int binder_release(struct inode *nodp, struct file *filp)
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_del(&proc->proc_node);
+	mutex_unlock(&binder_procs_lock);
+
+	binder_mutex_lock(&binder_tree_lock, __func__);
+	binder_mutex_lock(&proc->lock, __func__);
+	spin_lock(&proc->inner_lock);
+	/* keep proc alive until the release below is complete */
+	proc->tmp_ref++;
+	proc->is_dead = true;
+	spin_unlock(&proc->inner_lock);
+
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder_release: %d context_mgr_node gone\n",
@@ -2971,7 +4039,9 @@ static void binder_deferred_release(struct binder_proc *proc)
 
 		nodes++;
 		rb_erase(&node->rb_node, &proc->nodes);
+		spin_lock(&proc->inner_lock);
 		list_del_init(&node->work.entry);
+		spin_unlock(&proc->inner_lock);
 		if (hlist_empty(&node->refs)) {
 			kfree(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
@@ -2988,12 +4058,14 @@ static void binder_deferred_release(struct binder_proc *proc)
 				incoming_refs++;
 				if (ref->death) {
 					death++;
+					spin_lock(&ref->proc->inner_lock);
 					if (list_empty(&ref->death->work.entry)) {
 						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
 						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
-						wake_up_interruptible(&ref->proc->wait);
+						binder_wakeup_proc_ilocked(ref->proc);
 					} else
 						BUG();
+					spin_unlock(&ref->proc->inner_lock);
 				}
 			}
 			binder_debug(BINDER_DEBUG_DEAD_BINDER,
@@ -3009,12 +4081,34 @@ static void binder_deferred_release(struct binder_proc *proc)
 		outgoing_refs++;
 		binder_delete_ref(ref);
 	}
-	binder_release_work(&proc->todo);
-	buffers = 0;
+	binder_release_work(proc, &proc->todo);
+	mutex_unlock(&proc->lock);
+	mutex_unlock(&binder_tree_lock);
 
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d threads %d, nodes %d (ref %d), "
+		     "refs %d, active transactions %d\n",
+		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
+		     active_transactions);
+
+	binder_proc_dec_tmpref(proc);
+}
+
+/*
+ * Called once the proc is dead and no transaction holds a temporary
+ * reference to it any more, so the buffers can no longer change.
+ */
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	buffers = 0;
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
+		spin_lock(&binder_stack_lock);
 		t = buffer->transaction;
 		if (t) {
 			t->buffer = NULL;
@@ -3024,6 +4118,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 			       proc->pid, t->debug_id);
 			/*BUG();*/
 		}
+		spin_unlock(&binder_stack_lock);
 		binder_free_buf(proc, buffer);
 		buffers++;
 	}
@@ -3051,11 +4146,8 @@ static void binder_deferred_release(struct binder_proc *proc)
 	put_task_struct(proc->tsk);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
-		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
-		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     "binder_release: %d buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
 
 	kfree(proc);
 }
@@ -3067,7 +4159,6 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3083,9 +4174,11 @@ static void binder_deferred_func(struct work_struct *work)
 
 		files = NULL;
 		if (defer & BINDER_DEFERRED_PUT_FILES) {
+			mutex_lock(&proc->files_lock);
 			files = proc->files;
 			if (files)
 				proc->files = NULL;
+			mutex_unlock(&proc->files_lock);
 		}
 
 		if (defer & BINDER_DEFERRED_FLUSH)
@@ -3094,7 +4187,6 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3114,11 +4206,10 @@ binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer)
 	mutex_unlock(&binder_deferred_lock);
 }
 
-static char *print_binder_transaction(char *buf, char *end, const char *prefix,
+static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				      struct binder_transaction *t)
 {
-	buf += snprintf(buf, end - buf,
-			"%s %d: %p from %d:%d to %d:%d code %x "
+	seq_printf(m, "%s %d: %p from %d:%d to %d:%d code %x "
 			"flags %x pri %ld r%d",
 			prefix, t->debug_id, t,
 			t->from ? t->from->proc->pid : 0,
@@ -3126,35 +4217,27 @@ static char *print_binder_transaction(char *buf, char *end, const char *prefix,
 			t->to_proc ? t->to_proc->pid : 0,
 			t->to_thread ? t->to_thread->pid : 0,
 			t->code, t->flags, t->priority, t->need_reply);
-	if (buf >= end)
-		return buf;
 	if (t->buffer == NULL) {
-		buf += snprintf(buf, end - buf, " buffer free\n");
-		return buf;
-	}
-	if (t->buffer->target_node) {
-		buf += snprintf(buf, end - buf, " node %d",
-				t->buffer->target_node->debug_id);
-		if (buf >= end)
-			return buf;
+		seq_printf(m, " buffer free\n");
+		return;
 	}
-	buf += snprintf(buf, end - buf, " size %zd:%zd data %p\n",
+	if (t->buffer->target_node)
+		seq_printf(m, " node %d", t->buffer->target_node->debug_id);
+	seq_printf(m, " size %zd:%zd data %p\n",
 			t->buffer->data_size, t->buffer->offsets_size,
 			t->buffer->data);
-	return buf;
 }
 
-static char *print_binder_buffer(char *buf, char *end, const char *prefix,
+static void print_binder_buffer(struct seq_file *m, const char *prefix,
 				 struct binder_buffer *buffer)
 {
-	buf += snprintf(buf, end - buf, "%s %d: %p size %zd:%zd %s\n",
+	seq_printf(m, "%s %d: %p size %zd:%zd %s\n",
 			prefix, buffer->debug_id, buffer->data,
 			buffer->data_size, buffer->offsets_size,
 			buffer->transaction ? "active" : "delivered");
-	return buf;
 }
 
-static char *print_binder_work(char *buf, char *end, const char *prefix,
+static void print_binder_work(struct seq_file *m, const char *prefix,
 			       const char *transaction_prefix,
 			       struct binder_work *w)
 {
@@ -3164,79 +4247,67 @@ static char *print_binder_work(char *buf, char *end, const char *prefix,
 	switch (w->type) {
 	case BINDER_WORK_TRANSACTION:
 		t = container_of(w, struct binder_transaction, work);
-		buf = print_binder_transaction(buf, end, transaction_prefix, t);
+		print_binder_transaction(m, transaction_prefix, t);
 		break;
 	case BINDER_WORK_TRANSACTION_COMPLETE:
-		buf += snprintf(buf, end - buf,
-				"%stransaction complete\n", prefix);
+		seq_printf(m, "%stransaction complete\n", prefix);
 		break;
 	case BINDER_WORK_NODE:
 		node = container_of(w, struct binder_node, work);
-		buf += snprintf(buf, end - buf, "%snode work %d: u%p c%p\n",
+		seq_printf(m, "%snode work %d: u%p c%p\n",
 				prefix, node->debug_id, node->ptr,
 				node->cookie);
 		break;
 	case BINDER_WORK_DEAD_BINDER:
-		buf += snprintf(buf, end - buf, "%shas dead binder\n", prefix);
+		seq_printf(m, "%shas dead binder\n", prefix);
 		break;
 	case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
-		buf += snprintf(buf, end - buf,
-				"%shas cleared dead binder\n", prefix);
+		seq_printf(m, "%shas cleared dead binder\n", prefix);
 		break;
 	case BINDER_WORK_CLEAR_DEATH_NOTIFICATION:
-		buf += snprintf(buf, end - buf,
-				"%shas cleared death notification\n", prefix);
+		seq_printf(m, "%shas cleared death notification\n", prefix);
 		break;
 	default:
-		buf += snprintf(buf, end - buf, "%sunknown work: type %d\n",
+		seq_printf(m, "%sunknown work: type %d\n",
 				prefix, w->type);
 		break;
 	}
-	return buf;
 }
 
-static char *print_binder_thread(char *buf, char *end,
-				 struct binder_thread *thread,
-				 int print_always)
+static void print_binder_thread(struct seq_file *m,
+				struct binder_thread *thread,
+				int print_always)
 {
 	struct binder_transaction *t;
 	struct binder_work *w;
-	char *start_buf = buf;
-	char *header_buf;
-
-	buf += snprintf(buf, end - buf, "  thread %d: l %02x\n",
-			thread->pid, thread->looper);
-	header_buf = buf;
+	size_t start_pos = m->count;
+	size_t header_pos;
+
+	seq_printf(m, "  thread %d: l %02x h %lu lh %lu sw %lu cs %lu\n",
+		   thread->pid, thread->looper, thread->handoffs,
+		   thread->local_handoffs, thread->spurious_wakeups,
+		   thread->task->nvcsw + thread->task->nivcsw);
+	header_pos = m->count;
 	t = thread->transaction_stack;
 	while (t) {
-		if (buf >= end)
-			break;
 		if (t->from == thread) {
-			buf = print_binder_transaction(buf, end,
-						"    outgoing transaction", t);
+			print_binder_transaction(m, "    outgoing transaction", t);
 			t = t->from_parent;
 		} else if (t->to_thread == thread) {
-			buf = print_binder_transaction(buf, end,
-						"    incoming transaction", t);
+			print_binder_transaction(m, "    incoming transaction", t);
 			t = t->to_parent;
 		} else {
-			buf = print_binder_transaction(buf, end,
-						"    bad transaction", t);
+			print_binder_transaction(m, "    bad transaction", t);
 			t = NULL;
 		}
 	}
-	list_for_each_entry(w, &thread->todo, entry) {
-		if (buf >= end)
-			break;
-		buf = print_binder_work(buf, end, "    ",
-					"    pending transaction", w);
-	}
-	if (!print_always && buf == header_buf)
-		buf = start_buf;
-	return buf;
+	list_for_each_entry(w, &thread->todo, entry)
+		print_binder_work(m, "    ", "    pending transaction", w);
+	if (!print_always && m->count == header_pos)
+		m->count = start_pos;
 }
 
-static char *print_binder_node(char *buf, char *end, struct binder_node *node)
+static void print_binder_node(struct seq_file *m, struct binder_node *node)
 {
 	struct binder_ref *ref;
 	struct hlist_node *pos;
@@ -3247,100 +4318,171 @@ static char *print_binder_node(char *buf, char *end, struct binder_node *node)
 	hlist_for_each_entry(ref, pos, &node->refs, node_entry)
 		count++;
 
-	buf += snprintf(buf, end - buf,
-			"  node %d: u%p c%p hs %d hw %d ls %d lw %d "
+	seq_printf(m, "  node %d: u%p c%p hs %d hw %d ls %d lw %d "
 			"is %d iw %d",
 			node->debug_id, node->ptr, node->cookie,
 			node->has_strong_ref, node->has_weak_ref,
 			node->local_strong_refs, node->local_weak_refs,
 			node->internal_strong_refs, count);
-	if (buf >= end)
-		return buf;
 	if (count) {
-		buf += snprintf(buf, end - buf, " proc");
-		if (buf >= end)
-			return buf;
-		hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
-			buf += snprintf(buf, end - buf, " %d", ref->proc->pid);
-			if (buf >= end)
-				return buf;
-		}
-	}
-	buf += snprintf(buf, end - buf, "\n");
-	list_for_each_entry(w, &node->async_todo, entry) {
-		if (buf >= end)
-			break;
-		buf = print_binder_work(buf, end, "    ",
-					"    pending async transaction", w);
+		seq_printf(m, " proc");
+		hlist_for_each_entry(ref, pos, &node->refs, node_entry)
+			seq_printf(m, " %d", ref->proc->pid);
 	}
-	return buf;
+	seq_printf(m, "\n");
+	list_for_each_entry(w, &node->async_todo, entry)
+		print_binder_work(m, "    ",
+				  "    pending async transaction", w);
 }
 
-static char *print_binder_ref(char *buf, char *end, struct binder_ref *ref)
+static void print_binder_ref(struct seq_file *m, struct binder_ref *ref)
 {
-	buf += snprintf(buf, end - buf,
-			"  ref %d: desc %d %snode %d s %d w %d d %p\n",
+	seq_printf(m, "  ref %d: desc %d %snode %d s %d w %d d %p\n",
 			ref->debug_id, ref->desc,
 			ref->node->proc ? "" : "dead ", ref->node->debug_id,
 			ref->strong, ref->weak, ref->death);
-	return buf;
 }
 
-static char *print_binder_proc(char *buf, char *end,
-			       struct binder_proc *proc, int print_all)
+/*
+ * Successors by key, for the dumps: they drop binder_tree_lock between
+ * two nodes or refs and look up where they left off when retaking it.
+ */
+static struct binder_node *binder_dump_next_node(struct binder_proc *proc,
+						 void __user *ptr, int first)
+{
+	struct rb_node *n = proc->nodes.rb_node;
+	struct binder_node *node, *next = NULL;
+
+	if (first) {
+		n = rb_first(&proc->nodes);
+		return n ? rb_entry(n, struct binder_node, rb_node) : NULL;
+	}
+	while (n) {
+		node = rb_entry(n, struct binder_node, rb_node);
+		if (ptr < node->ptr) {
+			next = node;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	return next;
+}
+
+static struct binder_ref *binder_dump_next_ref(struct binder_proc *proc,
+					       uint32_t desc, int first)
+{
+	struct rb_node *n = proc->refs_by_desc.rb_node;
+	struct binder_ref *ref, *next = NULL;
+
+	if (first) {
+		n = rb_first(&proc->refs_by_desc);
+		return n ? rb_entry(n, struct binder_ref, rb_node_desc) : NULL;
+	}
+	while (n) {
+		ref = rb_entry(n, struct binder_ref, rb_node_desc);
+		if (desc < ref->desc) {
+			next = ref;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	return next;
+}
+
+/*
+ * Each part of a proc is printed under the locks that protect it and
+ * nothing more. The global binder_tree_lock and binder_stack_lock are
+ * only held for one thread, node or ref, or for the proc's todo list, at a
+ * time, so a dump never holds up the IPC of the whole system for longer
+ * than that.
+ */
+static void print_binder_proc(struct seq_file *m, struct binder_proc *proc,
+			      int print_all, int do_lock)
 {
+	struct binder_node *node;
+	struct binder_ref *ref;
 	struct binder_work *w;
 	struct rb_node *n;
-	char *start_buf = buf;
-	char *header_buf;
-
-	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
-	header_buf = buf;
-
-	for (n = rb_first(&proc->threads);
-	     n != NULL && buf < end;
-	     n = rb_next(n))
-		buf = print_binder_thread(buf, end,
-					  rb_entry(n, struct binder_thread,
-						   rb_node), print_all);
-	for (n = rb_first(&proc->nodes);
-	     n != NULL && buf < end;
-	     n = rb_next(n)) {
-		struct binder_node *node = rb_entry(n, struct binder_node,
-						    rb_node);
-		if (print_all || node->has_async_transaction)
-			buf = print_binder_node(buf, end, node);
-	}
-	if (print_all) {
-		for (n = rb_first(&proc->refs_by_desc);
-		     n != NULL && buf < end;
-		     n = rb_next(n))
-			buf = print_binder_ref(buf, end,
-					       rb_entry(n, struct binder_ref,
-							rb_node_desc));
-	}
-	for (n = rb_first(&proc->allocated_buffers);
-	     n != NULL && buf < end;
-	     n = rb_next(n))
-		buf = print_binder_buffer(buf, end, "  buffer",
-					  rb_entry(n, struct binder_buffer,
-						   rb_node));
-	list_for_each_entry(w, &proc->todo, entry) {
-		if (buf >= end)
+	void __user *ptr = NULL;
+	uint32_t desc = 0;
+	int first;
+	size_t start_pos = m->count;
+	size_t header_pos;
+
+	seq_printf(m, "proc %d\n", proc->pid);
+	header_pos = m->count;
+
+	if (do_lock)
+		binder_mutex_lock(&proc->lock, __func__);
+	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
+		if (do_lock) {
+			spin_lock(&binder_stack_lock);
+			spin_lock(&proc->inner_lock);
+		}
+		print_binder_thread(m, rb_entry(n, struct binder_thread,
+						rb_node), print_all);
+		if (do_lock) {
+			spin_unlock(&proc->inner_lock);
+			spin_unlock(&binder_stack_lock);
+		}
+	}
+	if (do_lock)
+		mutex_unlock(&proc->lock);
+
+	for (first = 1; ; first = 0) {
+		if (do_lock) {
+			binder_mutex_lock(&binder_tree_lock, __func__);
+			spin_lock(&proc->inner_lock);
+		}
+		node = binder_dump_next_node(proc, ptr, first);
+		if (node) {
+			ptr = node->ptr;
+			if (print_all || node->has_async_transaction)
+				print_binder_node(m, node);
+		}
+		if (do_lock) {
+			spin_unlock(&proc->inner_lock);
+			mutex_unlock(&binder_tree_lock);
+		}
+		if (node == NULL)
 			break;
-		buf = print_binder_work(buf, end, "  ",
-					"  pending transaction", w);
 	}
-	list_for_each_entry(w, &proc->delivered_death, entry) {
-		if (buf >= end)
+	for (first = 1; print_all; first = 0) {
+		if (do_lock)
+			binder_mutex_lock(&binder_tree_lock, __func__);
+		ref = binder_dump_next_ref(proc, desc, first);
+		if (ref) {
+			desc = ref->desc;
+			print_binder_ref(m, ref);
+		}
+		if (do_lock)
+			mutex_unlock(&binder_tree_lock);
+		if (ref == NULL)
 			break;
-		buf += snprintf(buf, end - buf,
-				"  has delivered dead binder\n");
-		break;
 	}
-	if (!print_all && buf == header_buf)
-		buf = start_buf;
-	return buf;
+
+	if (do_lock)
+		binder_mutex_lock(&proc->lock, __func__);
+	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
+		print_binder_buffer(m, "  buffer",
+				    rb_entry(n, struct binder_buffer, rb_node));
+	if (do_lock)
+		mutex_unlock(&proc->lock);
+
+	if (do_lock) {
+		spin_lock(&binder_stack_lock);
+		spin_lock(&proc->inner_lock);
+	}
+	list_for_each_entry(w, &proc->todo, entry)
+		print_binder_work(m, "  ", "  pending transaction", w);
+	if (!list_empty(&proc->delivered_death))
+		seq_printf(m, "  has delivered dead binder\n");
+	if (do_lock) {
+		spin_unlock(&proc->inner_lock);
+		spin_unlock(&binder_stack_lock);
+	}
+	if (!print_all && m->count == header_pos)
+		m->count = start_pos;
 }
 
 static const char *binder_return_strings[] = {
@@ -3381,7 +4523,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3394,7 +4538,7 @@ static const char *binder_objstat_strings[] = {
 	"transaction_complete"
 };
 
-static char *print_binder_stats(char *buf, char *end, const char *prefix,
+static void print_binder_stats(struct seq_file *m, const char *prefix,
 				struct binder_stats *stats)
 {
 	int i;
@@ -3402,22 +4546,19 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 			ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
-			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
+		if (atomic_read(&stats->bc[i]))
+			seq_printf(m, "%s%s: %d\n", prefix,
 					binder_command_strings[i],
-					stats->bc[i]);
-		if (buf >= end)
-			return buf;
+					atomic_read(&stats->bc[i]));
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 			ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
-			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_return_strings[i], stats->br[i]);
-		if (buf >= end)
-			return buf;
+		if (atomic_read(&stats->br[i]))
+			seq_printf(m, "%s%s: %d\n", prefix,
+					binder_return_strings[i],
+					atomic_read(&stats->br[i]));
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3425,298 +4566,262 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 			ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
-			buf += snprintf(buf, end - buf,
-					"%s%s: active %d total %d\n", prefix,
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
+			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 					binder_objstat_strings[i],
-					stats->obj_created[i] -
-						stats->obj_deleted[i],
-					stats->obj_created[i]);
-		if (buf >= end)
-			return buf;
+					created - deleted, created);
 	}
-	return buf;
 }
 
-static char *print_binder_proc_stats(char *buf, char *end,
-				     struct binder_proc *proc)
+/*
+ * Counts for binder_stats_show(), gathered under the locks that protect
+ * them and printed once all of them are dropped again.
+ */
+struct binder_proc_counts {
+	int threads;
+	int requested_threads;
+	int requested_threads_started;
+	int max_threads;
+	int ready_threads;
+	size_t free_async_space;
+	int nodes;
+	int refs, strong, weak;
+	int buffers;
+	int free_buffers;
+	size_t free_space, largest_free;
+	int page_cache_count;
+	unsigned long page_cache_hits, page_cache_misses;
+	int pending;
+};
+
+static void binder_count_proc(struct binder_proc *proc,
+			      struct binder_proc_counts *c, int do_lock)
 {
 	struct binder_work *w;
 	struct rb_node *n;
-	int count, strong, weak;
 
-	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
-	if (buf >= end)
-		return buf;
-	count = 0;
-	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
-		count++;
-	buf += snprintf(buf, end - buf, "  threads: %d\n", count);
-	if (buf >= end)
-		return buf;
-	buf += snprintf(buf, end - buf, "  requested threads: %d+%d/%d\n"
-			"  ready threads %d\n"
-			"  free async space %zd\n", proc->requested_threads,
-			proc->requested_threads_started, proc->max_threads,
-			proc->ready_threads, proc->free_async_space);
-	if (buf >= end)
-		return buf;
-	count = 0;
+	memset(c, 0, sizeof(*c));
+
+	if (do_lock)
+		binder_mutex_lock(&binder_tree_lock, __func__);
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
-		count++;
-	buf += snprintf(buf, end - buf, "  nodes: %d\n", count);
-	if (buf >= end)
-		return buf;
-	count = 0;
-	strong = 0;
-	weak = 0;
+		c->nodes++;
 	for (n = rb_first(&proc->refs_by_desc); n != NULL; n = rb_next(n)) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
-		count++;
-		strong += ref->strong;
-		weak += ref->weak;
+		c->refs++;
+		c->strong += ref->strong;
+		c->weak += ref->weak;
 	}
-	buf += snprintf(buf, end - buf, "  refs: %d s %d w %d\n",
-			count, strong, weak);
-	if (buf >= end)
-		return buf;
+	if (do_lock)
+		mutex_unlock(&binder_tree_lock);
 
-	count = 0;
+	if (do_lock)
+		binder_mutex_lock(&proc->lock, __func__);
+	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
+		c->threads++;
+	c->free_async_space = proc->free_async_space;
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
-		count++;
-	buf += snprintf(buf, end - buf, "  buffers: %d\n", count);
-	if (buf >= end)
-		return buf;
+		c->buffers++;
+	for (n = rb_first(&proc->free_buffers); n != NULL; n = rb_next(n)) {
+		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
+							rb_node);
+		size_t size = binder_buffer_size(proc, buffer);
 
-	count = 0;
-	list_for_each_entry(w, &proc->todo, entry) {
-		switch (w->type) {
-		case BINDER_WORK_TRANSACTION:
-			count++;
-			break;
-		default:
-			break;
-		}
+		c->free_buffers++;
+		c->free_space += size;
+		if (size > c->largest_free)
+			c->largest_free = size;
 	}
-	buf += snprintf(buf, end - buf, "  pending transactions: %d\n", count);
-	if (buf >= end)
-		return buf;
-
-	buf = print_binder_stats(buf, end, "  ", &proc->stats);
+	c->page_cache_count = proc->page_cache_count;
+	c->page_cache_hits = proc->page_cache_hits;
+	c->page_cache_misses = proc->page_cache_misses;
+	if (do_lock)
+		mutex_unlock(&proc->lock);
 
-	return buf;
+	if (do_lock)
+		spin_lock(&proc->inner_lock);
+	c->requested_threads = proc->requested_threads;
+	c->requested_threads_started = proc->requested_threads_started;
+	c->max_threads = proc->max_threads;
+	c->ready_threads = proc->ready_threads;
+	list_for_each_entry(w, &proc->todo, entry)
+		if (w->type == BINDER_WORK_TRANSACTION)
+			c->pending++;
+	if (do_lock)
+		spin_unlock(&proc->inner_lock);
 }
 
+static void print_binder_proc_stats(struct seq_file *m,
+				    struct binder_proc *proc, int do_lock)
+{
+	struct binder_proc_counts c;
+
+	binder_count_proc(proc, &c, do_lock);
+
+	seq_printf(m, "proc %d\n", proc->pid);
+	seq_printf(m, "  threads: %d\n", c.threads);
+	seq_printf(m, "  requested threads: %d+%d/%d\n"
+			"  ready threads %d\n"
+			"  free async space %zd\n", c.requested_threads,
+			c.requested_threads_started, c.max_threads,
+			c.ready_threads, c.free_async_space);
+	seq_printf(m, "  nodes: %d\n", c.nodes);
+	seq_printf(m, "  refs: %d s %d w %d\n", c.refs, c.strong, c.weak);
+	seq_printf(m, "  buffers: %d\n", c.buffers);
+	seq_printf(m, "  free buffers: %d space %zd "
+			"largest %zd\n", c.free_buffers, c.free_space,
+			c.largest_free);
+	seq_printf(m, "  page cache: %d pages hits %lu "
+			"misses %lu\n", c.page_cache_count,
+			c.page_cache_hits, c.page_cache_misses);
+	seq_printf(m, "  pending transactions: %d\n", c.pending);
+
+	print_binder_stats(m, "  ", &proc->stats);
+}
 
-static int binder_read_proc_state(char *page, char **start, off_t off,
-				  int count, int *eof, void *data)
+static int binder_state_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *proc;
 	struct hlist_node *pos;
 	struct binder_node *node;
-	int len = 0;
-	char *buf = page;
-	char *end = page + PAGE_SIZE;
 	int do_lock = !binder_debug_no_lock;
 
-	if (off)
-		return 0;
+	seq_puts(m, "binder state:\n");
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
-
-	buf += snprintf(buf, end - buf, "binder state:\n");
-
+		binder_mutex_lock(&binder_tree_lock, __func__);
 	if (!hlist_empty(&binder_dead_nodes))
-		buf += snprintf(buf, end - buf, "dead nodes:\n");
-	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node) {
-		if (buf >= end)
-			break;
-		buf = print_binder_node(buf, end, node);
-	}
+		seq_puts(m, "dead nodes:\n");
+	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node)
+		print_binder_node(m, node);
+	if (do_lock)
+		mutex_unlock(&binder_tree_lock);
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
-		if (buf >= end)
-			break;
-		buf = print_binder_proc(buf, end, proc, 1);
+		print_binder_proc(m, proc, 1, do_lock);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
-	if (buf > page + PAGE_SIZE)
-		buf = page + PAGE_SIZE;
-
-	*start = page + off;
-
-	len = buf - page;
-	if (len > off)
-		len -= off;
-	else
-		len = 0;
-
-	return len < count ? len  : count;
+		mutex_unlock(&binder_procs_lock);
+	return 0;
 }
 
-static int binder_read_proc_stats(char *page, char **start, off_t off,
-				  int count, int *eof, void *data)
+static int binder_stats_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *proc;
 	struct hlist_node *pos;
-	int len = 0;
-	char *p = page;
 	int do_lock = !binder_debug_no_lock;
 
-	if (off)
-		return 0;
-
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
-	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
+	seq_puts(m, "binder stats:\n");
 
-	p = print_binder_stats(p, page + PAGE_SIZE, "", &binder_stats);
+	print_binder_stats(m, "", &binder_stats);
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
-		if (p >= page + PAGE_SIZE)
-			break;
-		p = print_binder_proc_stats(p, page + PAGE_SIZE, proc);
+		print_binder_proc_stats(m, proc, do_lock);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
-	if (p > page + PAGE_SIZE)
-		p = page + PAGE_SIZE;
-
-	*start = page + off;
-
-	len = p - page;
-	if (len > off)
-		len -= off;
-	else
-		len = 0;
-
-	return len < count ? len  : count;
+		mutex_unlock(&binder_procs_lock);
+	return 0;
 }
 
-static int binder_read_proc_transactions(char *page, char **start, off_t off,
-					 int count, int *eof, void *data)
+static int binder_transactions_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *proc;
 	struct hlist_node *pos;
-	int len = 0;
-	char *buf = page;
-	char *end = page + PAGE_SIZE;
 	int do_lock = !binder_debug_no_lock;
 
-	if (off)
-		return 0;
-
+	seq_puts(m, "binder transactions:\n");
 	if (do_lock)
-		mutex_lock(&binder_lock);
-
-	buf += snprintf(buf, end - buf, "binder transactions:\n");
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
-		if (buf >= end)
-			break;
-		buf = print_binder_proc(buf, end, proc, 0);
+		print_binder_proc(m, proc, 0, do_lock);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
-	if (buf > page + PAGE_SIZE)
-		buf = page + PAGE_SIZE;
-
-	*start = page + off;
-
-	len = buf - page;
-	if (len > off)
-		len -= off;
-	else
-		len = 0;
-
-	return len < count ? len  : count;
+		mutex_unlock(&binder_procs_lock);
+	return 0;
 }
 
-static int binder_read_proc_proc(char *page, char **start, off_t off,
-				 int count, int *eof, void *data)
+/*
+ * The per proc files are looked up by pid rather than by pointer, so
+ * reading one while the proc goes away is safe.
+ */
+static int binder_proc_show(struct seq_file *m, void *unused)
 {
-	struct binder_proc *proc = data;
-	int len = 0;
-	char *p = page;
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int pid = (unsigned long)m->private;
 	int do_lock = !binder_debug_no_lock;
 
-	if (off)
-		return 0;
-
+	seq_puts(m, "binder proc state:\n");
 	if (do_lock)
-		mutex_lock(&binder_lock);
-	p += snprintf(p, PAGE_SIZE, "binder proc state:\n");
-	p = print_binder_proc(p, page + PAGE_SIZE, proc, 1);
+		mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (proc->pid != pid)
+			continue;
+		print_binder_proc(m, proc, 1, do_lock);
+	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
-
-	if (p > page + PAGE_SIZE)
-		p = page + PAGE_SIZE;
-	*start = page + off;
-
-	len = p - page;
-	if (len > off)
-		len -= off;
-	else
-		len = 0;
-
-	return len < count ? len  : count;
+		mutex_unlock(&binder_procs_lock);
+	return 0;
 }
 
-static char *print_binder_transaction_log_entry(char *buf, char *end,
+static void print_binder_transaction_log_entry(struct seq_file *m,
 					struct binder_transaction_log_entry *e)
 {
-	buf += snprintf(buf, end - buf,
-			"%d: %s from %d:%d to %d:%d node %d handle %d "
-			"size %d:%d\n",
-			e->debug_id, (e->call_type == 2) ? "reply" :
-			((e->call_type == 1) ? "async" : "call "), e->from_proc,
-			e->from_thread, e->to_proc, e->to_thread, e->to_node,
-			e->target_handle, e->data_size, e->offsets_size);
-	return buf;
+	seq_printf(m,
+		   "%d: %s from %d:%d to %d:%d node %d handle %d "
+		   "size %d:%d\n",
+		   e->debug_id, (e->call_type == 2) ? "reply" :
+		   ((e->call_type == 1) ? "async" : "call "), e->from_proc,
+		   e->from_thread, e->to_proc, e->to_thread, e->to_node,
+		   e->target_handle, e->data_size, e->offsets_size);
 }
 
-static int binder_read_proc_transaction_log(
-	char *page, char **start, off_t off, int count, int *eof, void *data)
+static int binder_transaction_log_show(struct seq_file *m, void *unused)
 {
-	struct binder_transaction_log *log = data;
-	int len = 0;
+	struct binder_transaction_log *log = m->private;
+	unsigned int next;
 	int i;
-	char *buf = page;
-	char *end = page + PAGE_SIZE;
-
-	if (off)
-		return 0;
 
+	/* cur starts at -1, so next is 0 for an empty log */
+	next = ((unsigned int)atomic_read(&log->cur) + 1) %
+		ARRAY_SIZE(log->entry);
 	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++) {
-			if (buf >= end)
-				break;
-			buf = print_binder_transaction_log_entry(buf, end,
-								&log->entry[i]);
-		}
+		for (i = next; i < ARRAY_SIZE(log->entry); i++)
+			print_binder_transaction_log_entry(m, &log->entry[i]);
 	}
-	for (i = 0; i < log->next; i++) {
-		if (buf >= end)
-			break;
-		buf = print_binder_transaction_log_entry(buf, end,
-							 &log->entry[i]);
-	}
-
-	*start = page + off;
-
-	len = buf - page;
-	if (len > off)
-		len -= off;
-	else
-		len = 0;
+	for (i = 0; i < next; i++)
+		print_binder_transaction_log_entry(m, &log->entry[i]);
+	return 0;
+}
 
-	return len < count ? len  : count;
+#define BINDER_DEBUG_ENTRY(name) \
+static int binder_##name##_open(struct inode *inode, struct file *file) \
+{ \
+	return single_open(file, binder_##name##_show, inode->i_private); \
+} \
+\
+static const struct file_operations binder_##name##_fops = { \
+	.owner = THIS_MODULE, \
+	.open = binder_##name##_open, \
+	.read = seq_read, \
+	.llseek = seq_lseek, \
+	.release = single_release, \
 }
 
+BINDER_DEBUG_ENTRY(state);
+BINDER_DEBUG_ENTRY(stats);
+BINDER_DEBUG_ENTRY(transactions);
+BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(proc);
+
 static const struct file_operations binder_fops = {
 	.owner = THIS_MODULE,
 	.poll = binder_poll,
@@ -3741,37 +4846,37 @@ static int __init binder_init(void)
 	if (!binder_deferred_workqueue)
 		return -ENOMEM;
 
-	binder_proc_dir_entry_root = proc_mkdir("binder", NULL);
-	if (binder_proc_dir_entry_root)
-		binder_proc_dir_entry_proc = proc_mkdir("proc",
-						binder_proc_dir_entry_root);
+	binder_debugfs_dir_entry_root = debugfs_create_dir("binder", NULL);
+	if (binder_debugfs_dir_entry_root)
+		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
+						binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
-	if (binder_proc_dir_entry_root) {
-		create_proc_read_entry("state",
-				       S_IRUGO,
-				       binder_proc_dir_entry_root,
-				       binder_read_proc_state,
-				       NULL);
-		create_proc_read_entry("stats",
-				       S_IRUGO,
-				       binder_proc_dir_entry_root,
-				       binder_read_proc_stats,
-				       NULL);
-		create_proc_read_entry("transactions",
-				       S_IRUGO,
-				       binder_proc_dir_entry_root,
-				       binder_read_proc_transactions,
-				       NULL);
-		create_proc_read_entry("transaction_log",
-				       S_IRUGO,
-				       binder_proc_dir_entry_root,
-				       binder_read_proc_transaction_log,
-				       &binder_transaction_log);
-		create_proc_read_entry("failed_transaction_log",
-				       S_IRUGO,
-				       binder_proc_dir_entry_root,
-				       binder_read_proc_transaction_log,
-				       &binder_transaction_log_failed);
+	if (binder_debugfs_dir_entry_root) {
+		debugfs_create_file("state",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_state_fops);
+		debugfs_create_file("stats",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_stats_fops);
+		debugfs_create_file("transactions",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_transactions_fops);
+		debugfs_create_file("transaction_log",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    &binder_transaction_log,
+				    &binder_transaction_log_fops);
+		debugfs_create_file("failed_transaction_log",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    &binder_transaction_log_failed,
+				    &binder_transaction_log_fops);
 	}
 	return ret;
 }
@@ -32,6 +32,7 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PAGES	= B_PACK_CHARS('p', 'g', '*', B_TYPE_LARGE),
 };
 
 enum {
@@ -61,6 +62,25 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A page aligned region of the sender's memory that is handed to the
+ * target without copying it into the transaction buffer. Only valid in
+ * transactions sent with BC_TRANSACTION_SG or BC_REPLY_SG. The driver
+ * maps the pages read-only into the target's binder mapping and rewrites
+ * 'buffer' to point at them; they stay mapped until the transaction
+ * buffer is released with BC_FREE_BUFFER.
+ *
+ * Pages backed by a file or shared memory (e.g. ashmem) are shared with
+ * the target, so the sender must not modify them until the target has
+ * freed the buffer. Anonymous pages are copied.
+ */
+struct binder_pages_object {
+	unsigned long		type;	/* BINDER_TYPE_PAGES */
+	unsigned long		flags;	/* must be 0 */
+	void			*buffer;
+	size_t			length;	/* multiple of the page size */
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -112,6 +132,8 @@ enum transaction_flags {
 	TF_ROOT_OBJECT	= 0x04,	/* contents are the component's root object */
 	TF_STATUS_CODE	= 0x08,	/* contents are a 32-bit status code */
 	TF_ACCEPT_FDS	= 0x10,	/* allow replies with file descriptors */
+	TF_BATCH	= 0x20,	/* one-way only: share the completion with the */
+				/* previous batched call, deliver in bulk */
 };
 
 struct binder_transaction_data {
@@ -147,6 +169,11 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	size_t		buffers_size;	/* total length of the page objects */
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +351,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with the total
+	 * size of the BINDER_TYPE_PAGES objects it contains.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
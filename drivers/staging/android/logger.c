@@ -24,6 +24,11 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/lzo.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -37,18 +42,38 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Offsets are free running byte counts and are only reduced modulo the size
+ * when the buffer is indexed. Writers reserve room under 'lock', copy their
+ * payload without any lock held and then commit. Entries become visible to
+ * readers in reservation order once everything before them is committed, so
+ * a writer that faults on its user buffer never stalls the ones behind it
+ * longer than it takes to fill the buffer. Readers never block writers: they
+ * notice being lapped by comparing their offset against 'head'.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	wait_queue_head_t	commit_wq; /* writers waiting for room */
+	struct mutex		mutex;	/* serializes readers */
+	spinlock_t		lock;	/* protects w_off, head and commit */
+	size_t			w_off;	/* current write (reserve) offset */
+	size_t			commit;	/* readers may read up to here */
+	size_t			head;	/* oldest entry; new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_header *mmap_header; /* shared with mmap readers */
+	__s32			last_sec; /* time stamp of the newest entry */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	struct mutex		archive_mutex; /* protects the fields below */
+	struct list_head	segments; /* compressed history, oldest first */
+	struct work_struct	archive_work;
+	size_t			archived; /* next offset to compress */
+	size_t			archive_len; /* bytes held in segments */
+	size_t			archive_clen; /* ... after compression */
+	u64			compress_ns; /* time spent in lzo */
+#endif
 };
 
 /*
@@ -59,10 +84,22 @@ struct logger_log {
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	int			batch;	/* fill read() with whole entries */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	unsigned char		*seg_buf; /* decompressed segment */
+	size_t			seg_start; /* its offset in the log */
+	size_t			seg_len; /* its length, 0 if none */
+#endif
 };
 
+/*
+ * States of an entry's __pad field while it sits between 'commit' and
+ * 'w_off'. Committed entries always carry zero there, as they used to.
+ */
+#define LOGGER_ENTRY_BUSY	1	/* reserved, payload being copied */
+#define LOGGER_ENTRY_DONE	2	/* copied, waiting for older entries */
+
 /* IKMSIFROYO-52 : vktx63 : Enable kernel log */
 #ifdef KERNEL_LOG
 static void logger_kernel_write(struct console *co, const char *s, unsigned count);
@@ -101,26 +138,495 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
+/*
+ * do_read_log - copies 'count' bytes at offset 'off' out of the log into the
+ * kernel buffer 'buf'.
+ */
+static void do_read_log(struct logger_log *log, size_t off, void *buf,
+			size_t count)
+{
+	size_t len;
+
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
+
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
+/*
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at offset 'off'
+ */
+static void do_write_log(struct logger_log *log, size_t off, const void *buf,
+			 size_t count)
+{
+	size_t len;
+
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
+
+	if (count != len)
+		memcpy(log->buffer, buf + len, count - len);
+}
+
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * The result is only meaningful if the reader was not lapped meanwhile, see
+ * logger_lapped(). A torn read is still capped at LOGGER_ENTRY_MAX_LEN.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
 	__u16 val;
 
-	switch (log->size - off) {
-	case 1:
-		memcpy(&val, log->buffer + off, 1);
-		memcpy(((char *) &val) + 1, log->buffer, 1);
+	do_read_log(log, off, &val, sizeof(val));
+
+	return sizeof(struct logger_entry) +
+		min_t(__u16, val, LOGGER_ENTRY_MAX_PAYLOAD);
+}
+
+static void set_entry_state(struct logger_log *log, size_t off, __u16 state)
+{
+	do_write_log(log, off + offsetof(struct logger_entry, __pad), &state,
+		     sizeof(state));
+}
+
+static __u16 get_entry_state(struct logger_log *log, size_t off)
+{
+	__u16 state;
+
+	do_read_log(log, off + offsetof(struct logger_entry, __pad), &state,
+		    sizeof(state));
+	return state;
+}
+
+/*
+ * logger_lapped - has a writer reclaimed the entry at 'off'?
+ *
+ * Called after reading log data to validate it; the head is moved past an
+ * entry before its space is handed to a new writer.
+ */
+static inline int logger_lapped(struct logger_log *log, size_t off)
+{
+	smp_rmb();
+	return (long) (ACCESS_ONCE(log->head) - off) > 0;
+}
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/*
+ * Compressed history
+ *
+ * A work item compresses committed entries in segments of whole entries
+ * before the writers come around and overwrite them. Segments are kept,
+ * oldest first, until they take up as much memory as the ring itself.
+ * Readers that are lapped by the writers continue from the segments instead
+ * of jumping to the head, decompressing one segment at a time into a
+ * private buffer.
+ */
+#define LOGGER_SEGMENT_SIZE	(16*1024)
+#define LOGGER_SEGMENT_MAX	(LOGGER_SEGMENT_SIZE + LOGGER_ENTRY_MAX_LEN)
+
+struct logger_segment {
+	struct list_head	list;	/* entry in logger_log's segments */
+	size_t			start;	/* offset of the first entry */
+	size_t			len;	/* uncompressed length */
+	size_t			clen;	/* compressed length */
+	__s32			sec;	/* time stamp of the first entry */
+	unsigned char		data[0];
+};
+
+/* scratch space for the archive work, shared by all logs */
+static DEFINE_MUTEX(logger_compress_mutex);
+static unsigned char *logger_compress_src;
+static unsigned char *logger_compress_dst;
+static void *logger_compress_wrkmem;
+
+static int logger_alloc_compress_scratch(void)
+{
+	if (logger_compress_wrkmem)
+		return 0;
+
+	logger_compress_src = vmalloc(LOGGER_SEGMENT_MAX);
+	logger_compress_dst = vmalloc(lzo1x_worst_compress(LOGGER_SEGMENT_MAX));
+	logger_compress_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (logger_compress_src && logger_compress_dst &&
+	    logger_compress_wrkmem)
+		return 0;
+
+	vfree(logger_compress_src);
+	vfree(logger_compress_dst);
+	vfree(logger_compress_wrkmem);
+	logger_compress_src = NULL;
+	logger_compress_dst = NULL;
+	logger_compress_wrkmem = NULL;
+	return -ENOMEM;
+}
+
+/*
+ * logger_account_lzo - charge the time since 'start' to the log's lzo total.
+ * The archive work and readers decompressing a segment both get here, and
+ * there is no atomic64_t on ARM, so the sum is only touched under
+ * log->archive_mutex.
+ */
+static void logger_account_lzo(struct logger_log *log, ktime_t start)
+{
+	lockdep_assert_held(&log->archive_mutex);
+	log->compress_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/*
+ * logger_free_segment - drop the oldest segment
+ *
+ * Caller must hold log->archive_mutex.
+ */
+static void logger_free_segment(struct logger_log *log,
+				struct logger_segment *seg)
+{
+	list_del(&seg->list);
+	log->archive_len -= seg->len;
+	log->archive_clen -= seg->clen;
+	kfree(seg);
+}
+
+/*
+ * logger_archive_segment - compress the next run of whole entries.
+ *
+ * Returns 0 if a segment was stored or skipped, nonzero to stop.
+ * Caller must hold log->archive_mutex and logger_compress_mutex.
+ */
+static int logger_archive_segment(struct logger_log *log)
+{
+	size_t commit = ACCESS_ONCE(log->commit);
+	struct logger_segment *seg;
+	size_t off, len, clen;
+	ktime_t start;
+
+	if (commit - log->archived < LOGGER_SEGMENT_SIZE)
+		return 1;
+
+	if (logger_lapped(log, log->archived)) {
+		/* the work fell behind, that history is lost */
+		log->archived = ACCESS_ONCE(log->head);
+		return 0;
+	}
+
+	smp_rmb();
+	off = log->archived;
+	len = 0;
+	while (len < LOGGER_SEGMENT_SIZE && off != commit) {
+		size_t nr = get_entry_len(log, off);
+
+		/* a torn length is caught by the lapped check below */
+		off += nr;
+		len += nr;
+	}
+	do_read_log(log, log->archived, logger_compress_src, len);
+	if (logger_lapped(log, log->archived))
+		return 0;
+
+	start = ktime_get();
+	lzo1x_1_compress(logger_compress_src, len, logger_compress_dst, &clen,
+			 logger_compress_wrkmem);
+	logger_account_lzo(log, start);
+
+	seg = kmalloc(sizeof(*seg) + clen, GFP_KERNEL);
+	if (!seg)
+		return -ENOMEM;
+	seg->start = log->archived;
+	seg->len = len;
+	seg->clen = clen;
+	seg->sec = ((struct logger_entry *) logger_compress_src)->sec;
+	memcpy(seg->data, logger_compress_dst, clen);
+
+	list_add_tail(&seg->list, &log->segments);
+	log->archive_len += len;
+	log->archive_clen += clen;
+	log->archived = off;
+
+	/* the archive gets as much as the ring, see LOGGER_RING_SIZE */
+	while (log->archive_clen > log->size)
+		logger_free_segment(log, list_first_entry(&log->segments,
+					struct logger_segment, list));
+	return 0;
+}
+
+static void logger_archive_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      archive_work);
+
+	mutex_lock(&logger_compress_mutex);
+	if (!logger_alloc_compress_scratch()) {
+		mutex_lock(&log->archive_mutex);
+		while (!logger_archive_segment(log))
+			;
+		mutex_unlock(&log->archive_mutex);
+	}
+	mutex_unlock(&logger_compress_mutex);
+}
+
+/*
+ * logger_archive_kick - start compressing once a segment's worth of entries
+ * has been committed. Safe to call from any context.
+ */
+static void logger_archive_kick(struct logger_log *log, size_t commit)
+{
+	if (commit - ACCESS_ONCE(log->archived) >= LOGGER_SEGMENT_SIZE)
+		schedule_work(&log->archive_work);
+}
+
+/*
+ * logger_archive_start - where a new reader starts: the oldest segment if it
+ * predates the head.
+ */
+static size_t logger_archive_start(struct logger_log *log)
+{
+	size_t head = ACCESS_ONCE(log->head);
+	struct logger_segment *seg;
+
+	mutex_lock(&log->archive_mutex);
+	if (!list_empty(&log->segments)) {
+		seg = list_first_entry(&log->segments, struct logger_segment,
+				       list);
+		if ((long) (head - seg->start) > 0)
+			head = seg->start;
+	}
+	mutex_unlock(&log->archive_mutex);
+
+	return head;
+}
+
+/*
+ * logger_archive_flush - drop the whole history, for LOGGER_FLUSH_LOG
+ */
+static void logger_archive_flush(struct logger_log *log)
+{
+	mutex_lock(&log->archive_mutex);
+	while (!list_empty(&log->segments))
+		logger_free_segment(log, list_first_entry(&log->segments,
+					struct logger_segment, list));
+	log->archived = ACCESS_ONCE(log->commit);
+	mutex_unlock(&log->archive_mutex);
+}
+
+/*
+ * logger_in_segment - does the reader's decompressed segment hold r_off?
+ */
+static inline int logger_in_segment(struct logger_reader *reader)
+{
+	return reader->r_off - reader->seg_start < reader->seg_len;
+}
+
+/*
+ * logger_load_segment - decompress the segment holding the reader's offset,
+ * or the first one after it. Returns nonzero if the reader can continue from
+ * a segment.
+ *
+ * Caller must hold log->mutex.
+ */
+static int logger_load_segment(struct logger_log *log,
+			       struct logger_reader *reader)
+{
+	struct logger_segment *seg;
+	size_t len;
+	ktime_t start;
+	int ret = 0;
+
+	if (logger_in_segment(reader))
+		return 1;
+	reader->seg_len = 0;
+
+	mutex_lock(&log->archive_mutex);
+	list_for_each_entry(seg, &log->segments, list) {
+		if ((long) (seg->start + seg->len - reader->r_off) <= 0)
+			continue;
+		if (!reader->seg_buf)
+			reader->seg_buf = vmalloc(LOGGER_SEGMENT_MAX);
+		if (!reader->seg_buf)
+			break;
+
+		start = ktime_get();
+		len = LOGGER_SEGMENT_MAX;
+		if (lzo1x_decompress_safe(seg->data, seg->clen,
+					  reader->seg_buf, &len) != LZO_E_OK ||
+		    len != seg->len)
+			break;
+		logger_account_lzo(log, start);
+
+		/* skip any gap the archive work left behind */
+		if ((long) (seg->start - reader->r_off) > 0)
+			reader->r_off = seg->start;
+		reader->seg_start = seg->start;
+		reader->seg_len = len;
+		ret = 1;
 		break;
-	default:
-		memcpy(&val, log->buffer + off, 2);
 	}
+	mutex_unlock(&log->archive_mutex);
 
-	return sizeof(struct logger_entry) + val;
+	return ret;
+}
+
+/*
+ * logger_segment_entry_len - length of the entry at r_off in the reader's
+ * decompressed segment, never reaching past the end of the segment.
+ */
+static __u32 logger_segment_entry_len(struct logger_reader *reader)
+{
+	size_t off = reader->r_off - reader->seg_start;
+	__u16 val;
+
+	memcpy(&val, reader->seg_buf + off, sizeof(val));
+	return min_t(size_t, sizeof(struct logger_entry) + val,
+		     reader->seg_len - off);
+}
+
+/*
+ * logger_read_segment - logger_read() for a reader inside a segment
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t logger_read_segment(struct logger_reader *reader,
+				   char __user *buf, size_t count)
+{
+	size_t off = reader->r_off - reader->seg_start;
+	size_t len = logger_segment_entry_len(reader);
+
+	if (count < len)
+		return -EINVAL;
+
+	while (reader->batch &&
+	       off + len + sizeof(struct logger_entry) <= reader->seg_len) {
+		size_t nr;
+		__u16 val;
+
+		memcpy(&val, reader->seg_buf + off + len, sizeof(val));
+		nr = sizeof(struct logger_entry) + val;
+		if (count - len < nr || reader->seg_len - off - len < nr)
+			break;
+		len += nr;
+	}
+
+	if (copy_to_user(buf, reader->seg_buf + off, len))
+		return -EFAULT;
+	reader->r_off += len;
+
+	return len;
+}
+
+static void logger_free_reader(struct logger_reader *reader)
+{
+	vfree(reader->seg_buf);
+}
+
+/*
+ * logger_retained_secs - seconds between the oldest retained entry and the
+ * newest one.
+ */
+static long logger_retained_secs(struct logger_log *log)
+{
+	struct logger_entry header;
+	size_t head;
+	long ret = 0;
+
+	mutex_lock(&log->archive_mutex);
+	if (!list_empty(&log->segments)) {
+		ret = ACCESS_ONCE(log->last_sec) - list_first_entry(
+			&log->segments, struct logger_segment, list)->sec;
+		goto out;
+	}
+	do {
+		head = ACCESS_ONCE(log->head);
+		if (head == ACCESS_ONCE(log->commit))
+			goto out;
+		smp_rmb();
+		do_read_log(log, head, &header, sizeof(header));
+	} while (logger_lapped(log, head));
+	ret = ACCESS_ONCE(log->last_sec) - header.sec;
+out:
+	mutex_unlock(&log->archive_mutex);
+
+	return ret;
+}
+
+#define LOGGER_ARCHIVE_INIT(VAR) \
+	.segments = LIST_HEAD_INIT(VAR .segments), \
+	.archive_mutex = __MUTEX_INITIALIZER(VAR .archive_mutex), \
+	.archive_work = __WORK_INITIALIZER(VAR .archive_work, \
+					   logger_archive_work),
+
+/*
+ * Half of each log's memory goes to the ring and the other half caps the
+ * compressed archive, so both together take no more than the log used to.
+ */
+#define LOGGER_RING_SIZE(SIZE)	((SIZE) / 2)
+#else
+static inline void logger_archive_kick(struct logger_log *log, size_t commit)
+{
+}
+
+static inline size_t logger_archive_start(struct logger_log *log)
+{
+	return ACCESS_ONCE(log->head);
+}
+
+static inline void logger_archive_flush(struct logger_log *log)
+{
+}
+
+static inline int logger_in_segment(struct logger_reader *reader)
+{
+	return 0;
+}
+
+static inline int logger_load_segment(struct logger_log *log,
+				      struct logger_reader *reader)
+{
+	return 0;
+}
+
+static inline __u32 logger_segment_entry_len(struct logger_reader *reader)
+{
+	return 0;
+}
+
+static inline ssize_t logger_read_segment(struct logger_reader *reader,
+					  char __user *buf, size_t count)
+{
+	return -EINVAL;
+}
+
+static inline void logger_free_reader(struct logger_reader *reader)
+{
+}
+
+#define LOGGER_ARCHIVE_INIT(VAR)
+#define LOGGER_RING_SIZE(SIZE)	(SIZE)
+#endif /* CONFIG_ANDROID_LOGGER_COMPRESS */
+
+/*
+ * fix_up_reader - pull a reader that was lapped by the writers forward to the
+ * oldest entry still around, compressed or in the log.
+ *
+ * Caller must hold log->mutex.
+ */
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	if (logger_lapped(log, reader->r_off) &&
+	    !logger_load_segment(log, reader))
+		reader->r_off = ACCESS_ONCE(log->head);
+}
+
+/*
+ * logger_readable - are there committed entries past the reader's offset?
+ */
+static int logger_readable(struct logger_log *log,
+			   struct logger_reader *reader)
+{
+	fix_up_reader(log, reader);
+	return ACCESS_ONCE(log->commit) != reader->r_off;
 }
 
 /*
@@ -134,6 +640,7 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t off = logger_offset(reader->r_off);
 	size_t len;
 
 	/*
@@ -141,8 +648,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -153,11 +660,54 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
+/*
+ * get_batch_len - how many bytes of whole entries, starting with the 'len'
+ * byte entry at 'off', fit into 'count' bytes. Never goes past 'commit'.
+ *
+ * Like get_entry_len(), only valid if the reader was not lapped meanwhile.
+ */
+static size_t get_batch_len(struct logger_log *log, size_t off, size_t len,
+			    size_t count)
+{
+	size_t commit = ACCESS_ONCE(log->commit);
+	size_t start = off;
+	size_t nr;
+
+	smp_rmb();
+	for (off += len; (long) (commit - off) > 0; off += nr) {
+		nr = get_entry_len(log, off);
+		if (count - len < nr || commit - start - len < nr)
+			break;
+		len += nr;
+	}
+
+	return len;
+}
+
+/*
+ * logger_is_entry - does an entry still in the log start at 'off'? 'commit'
+ * counts as one, it is where the next entry will go.
+ *
+ * Walks the log from the head, so keep it off the read and write paths.
+ */
+static int logger_is_entry(struct logger_log *log, size_t off)
+{
+	size_t head, commit, pos;
+
+	do {
+		head = ACCESS_ONCE(log->head);
+		commit = ACCESS_ONCE(log->commit);
+		smp_rmb();
+		for (pos = head; pos != off && (long) (commit - pos) > 0; )
+			pos += get_entry_len(log, pos);
+	} while (logger_lapped(log, head));
+
+	return pos == off;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -165,7 +715,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or as many whole entries as
+ * 	  fit if LOGGER_SET_BATCH_READ is set
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -183,7 +734,7 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		ret = !logger_readable(log, reader);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -207,21 +758,37 @@ start:
 
 	mutex_lock(&log->mutex);
 
+retry:
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+	if (unlikely(!logger_readable(log, reader))) {
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
+	if (logger_in_segment(reader)) {
+		ret = logger_read_segment(reader, buf, count);
+		goto out;
+	}
+	smp_rmb();
 
 	/* get the size of the next entry */
 	ret = get_entry_len(log, reader->r_off);
+	if (logger_lapped(log, reader->r_off))
+		goto retry;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
+	if (reader->batch)
+		ret = get_batch_len(log, reader->r_off, ret, count);
 
-	/* get exactly one entry from the log */
+	/* get exactly one entry, or a run of them, from the log */
 	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (ret > 0) {
+		/* a writer may have overwritten what we just copied */
+		if (logger_lapped(log, reader->r_off))
+			goto retry;
+		reader->r_off += ret;
+	}
 
 out:
 	mutex_unlock(&log->mutex);
@@ -230,105 +797,106 @@ out:
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_reserve - reserve room for an entry with the given header, pushing
+ * the head past whatever it overwrites. The header is stamped, marked busy
+ * and written into the log so the head can always walk over the entry.
  *
- * Caller must hold log->mutex.
+ * Returns the entry's offset, or -EAGAIN when the log is filled with
+ * entries whose writers have not committed yet.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static long logger_reserve(struct logger_log *log, struct logger_entry *header)
 {
-	size_t count = 0;
-
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
-}
+	size_t need = sizeof(struct logger_entry) + header->len;
+	struct timespec now;
+	unsigned long flags;
+	size_t off;
 
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
+	spin_lock_irqsave(&log->lock, flags);
+	if (log->w_off + need - log->commit > log->size) {
+		spin_unlock_irqrestore(&log->lock, flags);
+		return -EAGAIN;
 	}
 
-	return 0;
-}
+	/* the head only ever walks over committed entries here */
+	while (log->w_off + need - log->head > log->size)
+		log->head += get_entry_len(log, log->head);
+	if (log->mmap_header)
+		log->mmap_header->head = log->head;
+	smp_wmb();
 
-/*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
- */
-static void fix_up_readers(struct logger_log *log, size_t len)
-{
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	/* stamp under the lock so entries stay in time order */
+	now = current_kernel_time();
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
+	header->__pad = LOGGER_ENTRY_BUSY;
+	log->last_sec = header->sec;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	off = log->w_off;
+	do_write_log(log, off, header, sizeof(struct logger_entry));
+	log->w_off += need;
+	spin_unlock_irqrestore(&log->lock, flags);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	return off;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * logger_commit - mark the entry at 'off' complete and publish every
+ * completed entry that is no longer preceded by a busy one.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void logger_commit(struct logger_log *log, size_t off)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
-
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
+	unsigned long flags;
+	size_t old, new;
+
+	spin_lock_irqsave(&log->lock, flags);
+	smp_wmb();
+	set_entry_state(log, off, LOGGER_ENTRY_DONE);
+	old = log->commit;
+	while (log->commit != log->w_off &&
+	       get_entry_state(log, log->commit) == LOGGER_ENTRY_DONE) {
+		set_entry_state(log, log->commit, 0);
+		log->commit += get_entry_len(log, log->commit);
+	}
+	new = log->commit;
+	if (log->mmap_header)
+		log->mmap_header->commit = new;
+	smp_wmb();
+	spin_unlock_irqrestore(&log->lock, flags);
+
+	if (new != old) {
+		/* wake up any blocked readers and writers */
+		wake_up_interruptible(&log->wq);
+		wake_up(&log->commit_wq);
+		logger_archive_kick(log, new);
+	}
+}
 
+static int logger_has_room(struct logger_log *log, size_t need)
+{
+	return ACCESS_ONCE(log->w_off) + need - ACCESS_ONCE(log->commit) <=
+		log->size;
 }
 
 /*
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * the log 'log' at offset 'off'
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
@@ -341,34 +909,23 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
-	struct timespec now;
+	size_t off;
+	long res;
 	ssize_t ret = 0;
 
-	now = current_kernel_time();
-
 	header.pid = current->tgid;
 	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	while ((res = logger_reserve(log, &header)) < 0)
+		wait_event(log->commit_wq, logger_has_room(log,
+				sizeof(struct logger_entry) + header.len));
+	off = res + sizeof(struct logger_entry);
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -378,21 +935,25 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off + ret, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			size_t pos;
+
+			/*
+			 * The space is spoken for and later entries may
+			 * follow it already, so blank the payload instead.
+			 */
+			for (pos = ret; pos < header.len; pos++)
+				log->buffer[logger_offset(off + pos)] = 0;
+			ret = nr;
+			break;
 		}
 
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_commit(log, res);
 
 	return ret;
 }
@@ -425,12 +986,12 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		reader->batch = 0;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		reader->seg_buf = NULL;
+		reader->seg_len = 0;
+#endif
+		reader->r_off = logger_archive_start(log);
 
 		file->private_data = reader;
 	} else
@@ -448,7 +1009,7 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
+		logger_free_reader(reader);
 		kfree(reader);
 	}
 
@@ -479,7 +1040,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (logger_readable(log, reader))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -490,6 +1051,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	unsigned long flags;
 	long ret = -ENOTTY;
 
 	mutex_lock(&log->mutex);
@@ -504,10 +1066,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		fix_up_reader(log, reader);
+		ret = ACCESS_ONCE(log->commit) - reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -515,33 +1075,122 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		do {
+			if (logger_readable(log, reader) &&
+			    logger_in_segment(reader)) {
+				ret = logger_segment_entry_len(reader);
+				break;
+			} else if (logger_readable(log, reader)) {
+				smp_rmb();
+				ret = get_entry_len(log, reader->r_off);
+			} else
+				ret = 0;
+		} while (ret && logger_lapped(log, reader->r_off));
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* readers notice the moved head and skip to it */
+		spin_lock_irqsave(&log->lock, flags);
+		log->head = log->commit;
+		if (log->mmap_header)
+			log->mmap_header->head = log->head;
+		spin_unlock_irqrestore(&log->lock, flags);
+		logger_archive_flush(log);
+		ret = 0;
+		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
+		ret = 0;
+		break;
+	case LOGGER_SET_READ_HEAD: {
+		size_t commit = ACCESS_ONCE(log->commit);
+		size_t off;
+
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		/* widen the 32 bit offset the mapping exposes */
+		off = commit - (__u32) (commit - arg);
+		if (commit - off > log->size || !logger_is_entry(log, off)) {
+			ret = -EINVAL;
+			break;
+		}
+		reader->r_off = off;
+		fix_up_reader(log, reader);
 		ret = 0;
 		break;
 	}
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	case LOGGER_GET_COMPRESS_RATIO:
+		mutex_lock(&log->archive_mutex);
+		ret = log->archive_len ?
+			log->archive_clen * 100 / log->archive_len : 0;
+		mutex_unlock(&log->archive_mutex);
+		break;
+	case LOGGER_GET_COMPRESS_USECS:
+		mutex_lock(&log->archive_mutex);
+		ret = div_u64(log->compress_ns, NSEC_PER_USEC);
+		mutex_unlock(&log->archive_mutex);
+		break;
+	case LOGGER_GET_RETAINED_SECS:
+		ret = logger_retained_secs(log);
+		break;
+#endif
+	}
 
 	mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - map the log header page and the ring read-only
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long len = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (!log->mmap_header)
+		return -ENODEV;
+	if (vma->vm_pgoff || len != PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_RESERVED | VM_DONTEXPAND;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      page_to_pfn(virt_to_page(log->mmap_header)),
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			       page_to_pfn(virt_to_page(log->buffer)),
+			       log->size, vma->vm_page_prot);
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -549,12 +1198,13 @@ static const struct file_operations logger_fops = {
 };
 
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * Defines a log structure with name 'NAME' using 'SIZE' bytes of memory. Its
+ * ring of LOGGER_RING_SIZE(SIZE) bytes must be a power of two, greater than
+ * LOGGER_ENTRY_MAX_LEN, and less than LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * The buffer is page aligned so that it can be mapped.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[LOGGER_RING_SIZE(SIZE)] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -564,11 +1214,14 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.commit = 0, \
 	.head = 0, \
-	.size = SIZE, \
+	.size = LOGGER_RING_SIZE(SIZE), \
+	LOGGER_ARCHIVE_INIT(VAR) \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
@@ -583,6 +1236,7 @@ static struct file_operations kernel_logger_fops = {
         .read = logger_read,
 //      	.aio_write = logger_kernel_write,
         .poll = logger_poll,
+        .mmap = logger_mmap,
         .unlocked_ioctl = logger_ioctl,
         .compat_ioctl = logger_ioctl,
         .open = logger_open,
@@ -590,7 +1244,7 @@ static struct file_operations kernel_logger_fops = {
 };
 
 
-static unsigned char _buf_log_kernel[64*1024];
+static unsigned char _buf_log_kernel[LOGGER_RING_SIZE(64*1024)] __aligned(PAGE_SIZE);
 
 static struct logger_log log_kernel = {
         .buffer = _buf_log_kernel,
@@ -601,19 +1255,23 @@ static struct logger_log log_kernel = {
                 .parent = NULL,
         },
         .wq = __WAIT_QUEUE_HEAD_INITIALIZER(log_kernel.wq),
-        .readers = LIST_HEAD_INIT(log_kernel.readers),
+        .commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(log_kernel.commit_wq),
         .mutex = __MUTEX_INITIALIZER(log_kernel.mutex),
+        .lock = __SPIN_LOCK_UNLOCKED(log_kernel.lock),
         .w_off = 0,
+        .commit = 0,
         .head = 0,
-        .size = 64*1024,
+        .size = LOGGER_RING_SIZE(64*1024),
+        LOGGER_ARCHIVE_INIT(log_kernel)
 };
 
 
 static void logger_kernel_write(struct console *co, const char *s, unsigned count)
 {
         struct logger_entry header;
-        struct timespec now;
         struct logger_log *log= &log_kernel;
+        size_t off;
+        long res;
         unsigned int msg_len;
         int prio=3;
         struct iovec vec[3];
@@ -641,19 +1299,15 @@ static void logger_kernel_write(struct console *co, const char *s, unsigned coun
         vec[2].iov_base = (void *)s;
         vec[2].iov_len  = count;
         msg_len= vec[0].iov_len+vec[1].iov_len+vec[2].iov_len;
-        now = current_kernel_time();
-
         header.pid = 0;
         header.tid = 0;
-        header.sec = now.tv_sec;
-        header.nsec= now.tv_nsec;
         header.len = min_t(size_t, msg_len, LOGGER_ENTRY_MAX_PAYLOAD);
 
-        //mutex_lock(&log->mutex);
-
-        do_write_log(log, &header, sizeof(struct logger_entry));
-
-        fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+        /* we cannot sleep here, drop the line if the log is all in flight */
+        res = logger_reserve(log, &header);
+        if (res < 0)
+                return;
+        off = res + sizeof(struct logger_entry);
 
         while (vec_count-- > 0) {
                 size_t len;
@@ -662,15 +1316,13 @@ static void logger_kernel_write(struct console *co, const char *s, unsigned coun
                 len = min_t(size_t, iov->iov_len, header.len - ret);
 
                 /* write out this segment's payload */
-                do_write_log(log, iov->iov_base, len);
+                do_write_log(log, off + ret, iov->iov_base, len);
 
                 iov++;
+                ret += len;
         }
 
-        //mutex_unlock(&log->mutex);
-
-        /* wake up any blocked readers */
-        wake_up_interruptible(&log->wq);
+        logger_commit(log, res);
 
         return ;
 
@@ -703,8 +1355,22 @@ static struct logger_log *get_log_from_minor(int minor)
 
 static int __init init_log(struct logger_log *log)
 {
+	struct logger_mmap_header *header;
+	unsigned long flags;
 	int ret;
 
+	/* without it the log still works, it just cannot be mapped */
+	header = (void *)get_zeroed_page(GFP_KERNEL);
+	if (header) {
+		header->size = log->size;
+		header->data_offset = PAGE_SIZE;
+		spin_lock_irqsave(&log->lock, flags);
+		header->head = log->head;
+		header->commit = log->commit;
+		log->mmap_header = header;
+		spin_unlock_irqrestore(&log->lock, flags);
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
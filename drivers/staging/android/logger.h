@@ -45,5 +45,32 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 5) /* arg != 0: read() */
+							   /* many entries */
+#define LOGGER_SET_READ_HEAD		_IO(__LOGGERIO, 6) /* mmap reader's */
+							   /* position */
+#define LOGGER_GET_COMPRESS_RATIO	_IO(__LOGGERIO, 7) /* history size, */
+							   /* % of original */
+#define LOGGER_GET_COMPRESS_USECS	_IO(__LOGGERIO, 8) /* time in lzo */
+#define LOGGER_GET_RETAINED_SECS	_IO(__LOGGERIO, 9) /* oldest to newest */
+
+/*
+ * A reader may map the log read-only: the first page holds a struct
+ * logger_mmap_header, the ring itself follows at 'data_offset'. Offsets are
+ * free running; index the ring with (off & (size - 1)).
+ *
+ * Entries in [head, commit) are complete. To consume the entry at 'off',
+ * load commit, copy the entry out, then load head again: if head has moved
+ * past 'off' the copy may be torn and reading restarts at head. Tell the
+ * driver how far you got with LOGGER_SET_READ_HEAD so that poll() keeps
+ * working; it fails with EINVAL unless the offset is the start of an entry
+ * in [head, commit].
+ */
+struct logger_mmap_header {
+	__u32		head;		/* oldest entry still in the log */
+	__u32		commit;		/* end of the complete entries */
+	__u32		size;		/* size of the ring */
+	__u32		data_offset;	/* offset of the ring in the mapping */
+};
 
 #endif /* _LINUX_LOGGER_H */
@@ -15,6 +15,25 @@
  * The driver considers memory used for caches to be free, but if a large
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
+ * To catch that case the driver listens to reclaim pressure (see
+ * mm/vmpressure.c): once reclaim hardly frees anything any more, the cache
+ * no longer counts as free and only the free page count is compared against
+ * minfree.
+ *
+ * With swap (typically zram) configured, anonymous memory that still fits
+ * into free swap also counts as free, weighted by swap_weight percent to
+ * account for the memory compressed swap itself takes. Candidates are
+ * ranked by resident plus swapped out size, so swapping a process out does
+ * not make it look small.
+ *
+ * The checks and kills run in the "lowmemorykiller" kernel thread, which is
+ * woken by the pressure notifications, so neither direct reclaim nor kswapd
+ * walk the task list themselves.
+ *
+ * User space can watch /dev/lowmemorykiller (see lowmemorykiller.h) to learn
+ * about the pressure level and the next victim before anything is killed:
+ * while it is open, free memory within warn_margin percent of a minfree
+ * threshold produces a warning naming the process that would go first.
  *
  * Copyright (C) 2007-2008 Google, Inc.
  *
@@ -35,6 +54,17 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/vmpressure.h>
+#include <linux/swap.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include "lowmemorykiller.h"
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,12 +85,66 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+static struct task_struct *lowmem_task;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_wait);
+/* highest pressure level reported since the thread last ran, or -1 */
+static atomic_t lowmem_pending_level = ATOMIC_INIT(-1);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			printk(x);			\
 	} while (0)
 
+/*
+ * Candidate index
+ *
+ * Every user process is kept in the bucket for its oom_adj, so victim
+ * selection only has to look at the highest non-empty bucket at or above
+ * min_adj instead of walking every task. Processes are added when they
+ * are forked, in the bucket of the oom_adj they inherited, and move when
+ * their oom_adj is written through /proc. Entries go away when the task
+ * is freed. If the index yields nothing (e.g. an allocation failed) we
+ * fall back to walking the task list.
+ *
+ * lowmem_index_lock nests inside tasklist_lock and outside task_lock(). It
+ * is taken from the task free notifier, which may run from RCU callbacks,
+ * so it is irq safe.
+ */
+#define LOWMEM_BUCKETS		(OOM_ADJUST_MAX - OOM_ADJUST_MIN + 1)
+#define LOWMEM_HASH_BITS	6
+
+struct lowmem_candidate {
+	struct hlist_node	hash_node;	/* in lowmem_task_hash */
+	struct list_head	bucket_node;	/* in lowmem_buckets */
+	struct task_struct	*task;		/* thread group leader */
+};
+
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+static struct hlist_head lowmem_task_hash[1 << LOWMEM_HASH_BITS];
+static unsigned long lowmem_index_fallbacks;
+
+static struct lowmem_candidate *lowmem_find_candidate(struct task_struct *task)
+{
+	struct lowmem_candidate *c;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(c, pos,
+			     &lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)],
+			     hash_node)
+		if (c->task == task)
+			return c;
+	return NULL;
+}
+
+static void lowmem_remove_candidate(struct lowmem_candidate *c)
+{
+	hlist_del(&c->hash_node);
+	list_del(&c->bucket_node);
+	kfree(c);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -72,139 +156,508 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	struct lowmem_candidate *c;
+	unsigned long flags;
 
 	if (task == lowmem_deathpending)
 		lowmem_deathpending = NULL;
 
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	c = lowmem_find_candidate(task);
+	if (c)
+		lowmem_remove_candidate(c);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	return NOTIFY_OK;
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = ((struct task_struct *)data)->group_leader;
+	int oom_adj = val;
+	struct lowmem_candidate *c, *new = NULL;
+	unsigned long flags;
+
+	if (oom_adj >= OOM_ADJUST_MIN)
+		new = kmalloc(sizeof(*new), GFP_KERNEL);
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	c = lowmem_find_candidate(task);
+	if (c && oom_adj < OOM_ADJUST_MIN) {
+		lowmem_remove_candidate(c);
+	} else if (c) {
+		list_move_tail(&c->bucket_node,
+			       &lowmem_buckets[oom_adj - OOM_ADJUST_MIN]);
+	} else if (new) {
+		new->task = task;
+		hlist_add_head(&new->hash_node,
+			&lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)]);
+		list_add_tail(&new->bucket_node,
+			      &lowmem_buckets[oom_adj - OOM_ADJUST_MIN]);
+		new = NULL;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	kfree(new);
+
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+/*
+ * Add a new process to the index in the bucket of its current oom_adj,
+ * unless an oom_adj write got there first.
+ */
+static void lowmem_index_task(struct task_struct *task, gfp_t gfp)
+{
+	struct lowmem_candidate *new;
+	unsigned long flags;
+	int oom_adj;
+
+	new = kmalloc(sizeof(*new), gfp);
+	if (!new)
+		return;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	oom_adj = task->signal->oom_adj;
+	if (oom_adj >= OOM_ADJUST_MIN && !lowmem_find_candidate(task)) {
+		new->task = task;
+		hlist_add_head(&new->hash_node,
+			&lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)]);
+		list_add_tail(&new->bucket_node,
+			      &lowmem_buckets[oom_adj - OOM_ADJUST_MIN]);
+		new = NULL;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	kfree(new);
+}
+
+static int
+fork_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+
+	if (!(val & CLONE_THREAD) && task->mm)
+		lowmem_index_task(task, GFP_KERNEL);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block fork_nb = {
+	.notifier_call	= fork_notify_func,
+};
+
+/*
+ * lowmem_task_size - rss of a killable process with at least min_adj, or 0
+ */
+static int lowmem_task_size(struct task_struct *p, int min_adj, int *oom_adj)
+{
+	struct mm_struct *mm;
+	struct signal_struct *sig;
+	int tasksize;
+
+	task_lock(p);
+	mm = p->mm;
+	sig = p->signal;
+	if (!mm || !sig || sig->oom_adj < min_adj) {
+		task_unlock(p);
+		return 0;
+	}
+	*oom_adj = sig->oom_adj;
+	tasksize = get_mm_rss(mm) + get_mm_counter(mm, swap_usage);
+	task_unlock(p);
+
+	return tasksize;
+}
+
+/*
+ * lowmem_select_indexed - pick the largest process from the highest
+ * non-empty bucket at or above min_adj.
+ *
+ * Caller must hold tasklist_lock.
+ */
+static struct task_struct *lowmem_select_indexed(int min_adj, int *size,
+						 int *adj)
+{
+	struct task_struct *selected = NULL;
+	struct lowmem_candidate *c;
+	int oom_adj, tasksize;
+	int i;
+
+	spin_lock_irq(&lowmem_index_lock);
+	for (i = LOWMEM_BUCKETS - 1;
+	     !selected && i >= min_adj - OOM_ADJUST_MIN; i--) {
+		list_for_each_entry(c, &lowmem_buckets[i], bucket_node) {
+			tasksize = lowmem_task_size(c->task, min_adj, &oom_adj);
+			if (tasksize <= 0)
+				continue;
+			if (selected) {
+				if (oom_adj < *adj)
+					continue;
+				if (oom_adj == *adj && tasksize <= *size)
+					continue;
+			}
+			selected = c->task;
+			*size = tasksize;
+			*adj = oom_adj;
+		}
+	}
+	spin_unlock_irq(&lowmem_index_lock);
+
+	return selected;
+}
+
+/*
+ * lowmem_select_all - the same, walking every process.
+ *
+ * Caller must hold tasklist_lock.
+ */
+static struct task_struct *lowmem_select_all(int min_adj, int *size, int *adj)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
+	int oom_adj, tasksize;
+
+	for_each_process(p) {
+		tasksize = lowmem_task_size(p, min_adj, &oom_adj);
+		if (tasksize <= 0)
+			continue;
+		if (selected) {
+			if (oom_adj < *adj)
+				continue;
+			if (oom_adj == *adj && tasksize <= *size)
+				continue;
+		}
+		selected = p;
+		*size = tasksize;
+		*adj = oom_adj;
+		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+			     p->pid, p->comm, oom_adj, tasksize);
+	}
+
+	return selected;
+}
+
+/*
+ * Pressure events for user space
+ */
+static DEFINE_SPINLOCK(lowmem_event_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_event_wait);
+static struct lowmem_event lowmem_last_event;
+static atomic_t lowmem_listeners = ATOMIC_INIT(0);
+static int lowmem_warn_margin = 25;
+static int lowmem_swap_weight = 50;
+
+/*
+ * lowmem_publish - make 'event' the current event if it differs from the
+ * last one in anything but its time stamp, and wake up the readers.
+ */
+static void lowmem_publish(struct lowmem_event *event)
+{
+	struct timespec now;
+	int changed;
+
+	if (!atomic_read(&lowmem_listeners))
+		return;
+
+	spin_lock(&lowmem_event_lock);
+	changed = event->flags != lowmem_last_event.flags ||
+		event->level != lowmem_last_event.level ||
+		event->min_adj != lowmem_last_event.min_adj ||
+		event->victim_pid != lowmem_last_event.victim_pid;
+	if (changed) {
+		ktime_get_ts(&now);
+		event->seq = lowmem_last_event.seq + 1;
+		event->sec = now.tv_sec;
+		event->nsec = now.tv_nsec;
+		lowmem_last_event = *event;
+	}
+	spin_unlock(&lowmem_event_lock);
+
+	if (changed)
+		wake_up_interruptible(&lowmem_event_wait);
+}
+
+/*
+ * lowmem_min_adj - the lowest oom_adj at risk when free and file pages are
+ * compared against minfree raised by 'margin' percent.
+ */
+static int lowmem_min_adj(int other_free, int other_file, int margin)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
 	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		size_t minfree = lowmem_minfree[i] * (100 + margin) / 100;
+
+		if (other_free < minfree && other_file < minfree)
+			return lowmem_adj[i];
+	}
+
+	return OOM_ADJUST_MAX + 1;
+}
+
+static void lowmem_scan(int level)
+{
+	struct task_struct *selected;
+	struct lowmem_event event;
+	int min_adj;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
+	int selected_oom_adj = 0;
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
+	long other_swap = min(nr_swap_pages,
+			      (long)(global_page_state(NR_ACTIVE_ANON) +
+				     global_page_state(NR_INACTIVE_ANON)));
+
+	/* reclaim cannot get at the cache, don't count it as free */
+	if (level >= VMPRESSURE_CRITICAL) {
+		other_file = 0;
+		other_swap = 0;
+	}
+	other_swap = max(other_swap, 0L) * lowmem_swap_weight / 100;
+	other_free += other_swap;
+
+	memset(&event, 0, sizeof(event));
+	event.level = level;
+	event.free = other_free;
+	event.file = other_file;
+	event.swap = other_swap;
+
+	min_adj = lowmem_min_adj(other_free, other_file, 0);
+	lowmem_print(3, "lowmem_scan level %d, ofree %d %d, ma %d\n",
+		     level, other_free, other_file, min_adj);
 
 	/*
 	 * If we already have a death outstanding, then
-	 * bail out right away; indicating to vmscan
-	 * that we have nothing further to offer on
-	 * this pass.
-	 *
+	 * bail out right away; the next pressure report
+	 * brings us back once it is gone.
 	 */
 	if (lowmem_deathpending &&
 	    time_before_eq(jiffies, lowmem_deathpending_timeout))
-		return 0;
+		return;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
+	if (min_adj == OOM_ADJUST_MAX + 1) {
+		/* not killing yet, but warn whoever listens */
+		if (atomic_read(&lowmem_listeners))
+			min_adj = lowmem_min_adj(other_free, other_file,
+						 lowmem_warn_margin);
+		event.min_adj = min_adj;
+		if (min_adj == OOM_ADJUST_MAX + 1) {
+			lowmem_publish(&event);
+			return;
 		}
+		event.flags = LOWMEM_EVENT_WARN;
+	} else {
+		event.min_adj = min_adj;
+		event.flags = LOWMEM_EVENT_KILL;
 	}
-	if (nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
-			     nr_to_scan, gfp_mask, other_free, other_file,
-			     min_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (nr_to_scan <= 0 || min_adj == OOM_ADJUST_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %d, %x, return %d\n",
-			     nr_to_scan, gfp_mask, rem);
-		return rem;
-	}
-	selected_oom_adj = min_adj;
 
 	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+	selected = lowmem_select_indexed(min_adj, &selected_tasksize,
+					 &selected_oom_adj);
+	if (!selected) {
+		lowmem_index_fallbacks++;
+		selected = lowmem_select_all(min_adj, &selected_tasksize,
+					     &selected_oom_adj);
 	}
 	if (selected) {
+		event.victim_pid = selected->pid;
+		event.victim_adj = selected_oom_adj;
+		event.victim_size = selected_tasksize;
+	} else
+		event.flags &= ~LOWMEM_EVENT_KILL;
+	if (selected && (event.flags & LOWMEM_EVENT_KILL)) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
 		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
 		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
 	}
-	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
-		     nr_to_scan, gfp_mask, rem);
 	read_unlock(&tasklist_lock);
-	return rem;
+
+	lowmem_publish(&event);
+}
+
+static int lowmem_dev_open(struct inode *inode, struct file *file)
+{
+	int ret;
+
+	ret = nonseekable_open(inode, file);
+	if (ret)
+		return ret;
+
+	/* only events from now on count as new */
+	spin_lock(&lowmem_event_lock);
+	file->f_version = lowmem_last_event.seq;
+	spin_unlock(&lowmem_event_lock);
+	atomic_inc(&lowmem_listeners);
+
+	return 0;
 }
 
-static struct shrinker lowmem_shrinker = {
-	.shrink = lowmem_shrink,
-	.seeks = DEFAULT_SEEKS * 16
+static int lowmem_dev_release(struct inode *inode, struct file *file)
+{
+	atomic_dec(&lowmem_listeners);
+	return 0;
+}
+
+static int lowmem_event_pending(struct file *file)
+{
+	return ACCESS_ONCE(lowmem_last_event.seq) != (u32)file->f_version;
+}
+
+static ssize_t lowmem_dev_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *pos)
+{
+	struct lowmem_event event;
+	int ret;
+
+	if (count < sizeof(event))
+		return -EINVAL;
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (!lowmem_event_pending(file))
+			return -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(lowmem_event_wait,
+					       lowmem_event_pending(file));
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&lowmem_event_lock);
+	event = lowmem_last_event;
+	spin_unlock(&lowmem_event_lock);
+	file->f_version = event.seq;
+
+	if (copy_to_user(buf, &event, sizeof(event)))
+		return -EFAULT;
+
+	return sizeof(event);
+}
+
+static unsigned int lowmem_dev_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_event_wait, wait);
+
+	return lowmem_event_pending(file) ? POLLIN | POLLRDNORM : 0;
+}
+
+static const struct file_operations lowmem_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_dev_open,
+	.release = lowmem_dev_release,
+	.read = lowmem_dev_read,
+	.poll = lowmem_dev_poll,
 };
 
+static struct miscdevice lowmem_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = LOWMEM_DEVICE_NAME,
+	.fops = &lowmem_fops,
+};
+
+static int lowmem_thread(void *unused)
+{
+	int level;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_wait,
+			atomic_read(&lowmem_pending_level) >= 0 ||
+			kthread_should_stop());
+		level = atomic_xchg(&lowmem_pending_level, -1);
+		if (level >= 0)
+			lowmem_scan(level);
+	}
+
+	return 0;
+}
+
+/*
+ * Called from reclaim for every pressure window of every zone, so just
+ * remember the worst level and leave the work to the thread.
+ */
+static int
+lowmem_pressure_notify(struct notifier_block *self, unsigned long level,
+		       void *data)
+{
+	int old, cur = atomic_read(&lowmem_pending_level);
+
+	while (cur < (int)level) {
+		old = atomic_cmpxchg(&lowmem_pending_level, cur, level);
+		if (old == cur)
+			break;
+		cur = old;
+	}
+	wake_up(&lowmem_wait);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_pressure_nb = {
+	.notifier_call	= lowmem_pressure_notify,
+};
+
+/* Index the processes that were forked before the notifiers were set up */
+static void __init lowmem_index_existing(void)
+{
+	struct task_struct *p;
+
+	read_lock(&tasklist_lock);
+	for_each_process(p)
+		if (p->mm)
+			lowmem_index_task(p, GFP_ATOMIC);
+	read_unlock(&tasklist_lock);
+}
+
 static int __init lowmem_init(void)
 {
+	int i;
+
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+	lowmem_task = kthread_run(lowmem_thread, NULL, "lowmemorykiller");
+	if (IS_ERR(lowmem_task))
+		return PTR_ERR(lowmem_task);
 	task_free_register(&task_nb);
-	register_shrinker(&lowmem_shrinker);
+	task_fork_register(&fork_nb);
+	register_oom_adj_notifier(&oom_adj_nb);
+	lowmem_index_existing();
+	vmpressure_register_notifier(&lowmem_pressure_nb);
+	if (misc_register(&lowmem_misc))
+		printk(KERN_ERR "lowmemorykiller: failed to register misc "
+		       "device\n");
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
-	unregister_shrinker(&lowmem_shrinker);
+	misc_deregister(&lowmem_misc);
+	vmpressure_unregister_notifier(&lowmem_pressure_nb);
+	unregister_oom_adj_notifier(&oom_adj_nb);
+	task_fork_unregister(&fork_nb);
 	task_free_unregister(&task_nb);
+	kthread_stop(lowmem_task);
 }
 
-module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
 module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(index_fallbacks, lowmem_index_fallbacks, ulong, S_IRUGO);
+module_param_named(warn_margin, lowmem_warn_margin, int, S_IRUGO | S_IWUSR);
+module_param_named(swap_weight, lowmem_swap_weight, int, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -0,0 +1,53 @@
+/* drivers/staging/android/lowmemorykiller.h
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef _LINUX_LOWMEMORYKILLER_H
+#define _LINUX_LOWMEMORYKILLER_H
+
+#include <linux/types.h>
+
+#define LOWMEM_DEVICE_NAME	"lowmemorykiller"
+
+/*
+ * Reading /dev/lowmemorykiller returns the latest struct lowmem_event; the
+ * device polls readable whenever a newer event than the last one read by
+ * this file is available. Events are state, not a queue: a slow reader
+ * only sees the most recent one, 'seq' tells it how many it missed.
+ */
+enum lowmem_event_flags {
+	LOWMEM_EVENT_WARN	= 0x01,	/* free memory is within warn_margin */
+					/* of a minfree threshold */
+	LOWMEM_EVENT_KILL	= 0x02,	/* the victim has been sent SIGKILL */
+};
+
+struct lowmem_event {
+	__u32		seq;		/* bumped for every new event */
+	__u32		flags;		/* enum lowmem_event_flags */
+	__u32		level;		/* reclaim pressure, enum */
+					/* vmpressure_level */
+	__s32		min_adj;	/* oom_adj at risk, OOM_ADJUST_MAX + 1 */
+					/* if none */
+	__s32		victim_pid;	/* who goes first, 0 if nobody */
+	__s32		victim_adj;	/* its oom_adj */
+	__u32		victim_size;	/* its rss plus swap in pages */
+	__u32		free;		/* free pages, including swap below */
+	__u32		file;		/* file cache pages counted as free */
+	__u32		sec;		/* CLOCK_MONOTONIC time of the event */
+	__u32		nsec;
+	__u32		swap;		/* anon pages counted as free because */
+					/* they can go to swap */
+};
+
+#endif /* _LINUX_LOWMEMORYKILLER_H */
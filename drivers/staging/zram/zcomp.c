@@ -0,0 +1,198 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/err.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+
+#include "zcomp.h"
+
+/* crypto API algorithm names, indexed by enum zcomp_backend */
+static const char * const backends[ZCOMP_NR_BACKENDS] = {
+	[ZCOMP_LZO]	= "lzo",
+	[ZCOMP_DEFLATE]	= "deflate",
+};
+
+const char *zcomp_name(enum zcomp_backend backend)
+{
+	return backends[backend];
+}
+
+/*
+ * Map a sysfs string to a backend. Fails if the crypto API cannot
+ * provide the algorithm (built out, or its module cannot be loaded).
+ */
+int zcomp_lookup(const char *buf)
+{
+	int i;
+
+	for (i = 0; i < ZCOMP_NR_BACKENDS; i++) {
+		if (sysfs_streq(buf, backends[i]))
+			return crypto_has_comp(backends[i], 0, 0) ? i : -ENOENT;
+	}
+
+	return -EINVAL;
+}
+
+/* list the backends, the selected one in brackets */
+ssize_t zcomp_available_show(enum zcomp_backend backend, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; i < ZCOMP_NR_BACKENDS; i++) {
+		if (i == backend)
+			sz += sprintf(buf + sz, "[%s] ", backends[i]);
+		else
+			sz += sprintf(buf + sz, "%s ", backends[i]);
+	}
+	sz += sprintf(buf + sz, "\n");
+
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp_strm *strm)
+{
+	if (strm->tfm && !IS_ERR(strm->tfm))
+		crypto_free_comp(strm->tfm);
+	free_pages((unsigned long)strm->buffer, 1);
+	kfree(strm);
+}
+
+/*
+ * The output buffer is two pages: compressed data of an incompressible
+ * page can be larger than PAGE_SIZE.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(enum zcomp_backend backend)
+{
+	struct zcomp_strm *strm;
+
+	strm = kzalloc(sizeof(*strm), GFP_KERNEL);
+	if (!strm)
+		return NULL;
+
+	strm->tfm = crypto_alloc_comp(backends[backend], 0, 0);
+	strm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (IS_ERR(strm->tfm) || !strm->buffer) {
+		zcomp_strm_free(strm);
+		return NULL;
+	}
+
+	return strm;
+}
+
+/* Get an idle stream, sleeping until another request releases one */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *strm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			strm = list_first_entry(&comp->idle_strm,
+						struct zcomp_strm, list);
+			list_del(&strm->list);
+			spin_unlock(&comp->strm_lock);
+			return strm;
+		}
+		spin_unlock(&comp->strm_lock);
+
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *strm)
+{
+	spin_lock(&comp->strm_lock);
+	list_add(&strm->list, &comp->idle_strm);
+	spin_unlock(&comp->strm_lock);
+
+	wake_up(&comp->strm_wait);
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *strm,
+		   const unsigned char *src, size_t *dst_len)
+{
+	unsigned int len = 2 * PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_compress(strm->tfm, src, PAGE_SIZE,
+				   strm->buffer, &len);
+	*dst_len = len;
+
+	return ret;
+}
+
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *strm,
+		     const unsigned char *src, size_t src_len,
+		     unsigned char *dst)
+{
+	unsigned int len = PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_decompress(strm->tfm, src, src_len, dst, &len);
+	if (!ret && len != PAGE_SIZE)
+		ret = -EINVAL;
+
+	return ret;
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *strm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		strm = list_first_entry(&comp->idle_strm,
+					struct zcomp_strm, list);
+		list_del(&strm->list);
+		zcomp_strm_free(strm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Create a pool of 'max_strm' streams for 'backend'. All of them are
+ * allocated here rather than on the I/O path, as transform allocation
+ * may enter reclaim and the I/O path may be swapping out.
+ */
+struct zcomp *zcomp_create(enum zcomp_backend backend, int max_strm)
+{
+	struct zcomp *comp;
+	struct zcomp_strm *strm;
+	int i;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	comp->backend = backend;
+
+	for (i = 0; i < max(max_strm, 1); i++) {
+		strm = zcomp_strm_alloc(backend);
+		if (!strm) {
+			/* one stream is enough to make progress */
+			if (i)
+				break;
+			kfree(comp);
+			return NULL;
+		}
+		list_add(&strm->list, &comp->idle_strm);
+	}
+
+	return comp;
+}
@@ -0,0 +1,67 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/* Compressors selectable through the comp_algorithm sysfs attribute */
+enum zcomp_backend {
+	ZCOMP_LZO,
+	ZCOMP_DEFLATE,
+	
+	ZCOMP_NR_BACKENDS,
+};
+
+/*
+ * One compression workspace. A writer (or reader, as some backends keep
+ * decompression state too) owns a stream from zcomp_strm_find() until
+ * zcomp_strm_release() and may sleep while holding it.
+ */
+struct zcomp_strm {
+	struct crypto_comp *tfm;	/* backend transform */
+	void *buffer;		/* compressed output, two pages */
+	struct list_head list;	/* entry in zcomp->idle_strm */
+};
+
+/*
+ * Pool of compression streams, one per online CPU at creation time, so
+ * that as many requests can (de)compress in parallel.
+ */
+struct zcomp {
+	spinlock_t strm_lock;		/* protects idle_strm */
+	struct list_head idle_strm;	/* streams not owned by a request */
+	wait_queue_head_t strm_wait;	/* requests waiting for a stream */
+	enum zcomp_backend backend;
+};
+
+const char *zcomp_name(enum zcomp_backend backend);
+int zcomp_lookup(const char *buf);
+ssize_t zcomp_available_show(enum zcomp_backend backend, char *buf);
+
+struct zcomp *zcomp_create(enum zcomp_backend backend, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *strm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *strm,
+		   const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *strm,
+		     const unsigned char *src, size_t src_len,
+		     unsigned char *dst);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Backing device for writeback. Pages moved out of memory are kept one
+ * per page-sized block of a block device (a partition, or a file through
+ * the loop driver); a bitmap tracks which blocks are in use.
+ */
+
+#include <linux/bio.h>
+#include <linux/bitops.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "zram_drv.h"
+#include "zram_bdev.h"
+
+#define ZRAM_BDEV_MODE	(FMODE_READ | FMODE_WRITE)
+
+/*
+ * Mark every block free. The backing device stays configured across a
+ * device reset, only the pages written to it are dropped.
+ */
+void zram_bdev_clear(struct zram *zram)
+{
+	if (!zram->bdev_bitmap)
+		return;
+
+	memset(zram->bdev_bitmap, 0,
+	       BITS_TO_LONGS(zram->bdev_blocks) * sizeof(long));
+	/* Block 0 stays reserved so a zero handle still means "empty" */
+	set_bit(0, zram->bdev_bitmap);
+}
+
+int zram_bdev_set(struct zram *zram, const char *path)
+{
+	struct block_device *bdev;
+	unsigned long blocks;
+	size_t size;
+	int ret;
+
+	zram->bdev_path = kstrdup(path, GFP_KERNEL);
+	if (!zram->bdev_path)
+		return -ENOMEM;
+
+	bdev = open_bdev_exclusive(zram->bdev_path, ZRAM_BDEV_MODE, zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out_path;
+	}
+
+	ret = set_blocksize(bdev, PAGE_SIZE);
+	if (ret)
+		goto out_bdev;
+
+	blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (blocks < 2) {
+		ret = -EINVAL;
+		goto out_bdev;
+	}
+
+	size = BITS_TO_LONGS(blocks) * sizeof(long);
+	zram->bdev_bitmap = vmalloc(size);
+	if (!zram->bdev_bitmap) {
+		ret = -ENOMEM;
+		goto out_bdev;
+	}
+	zram->bdev_blocks = blocks;
+	zram_bdev_clear(zram);
+
+	zram->bdev_wq = create_singlethread_workqueue("zram_bdev");
+	if (!zram->bdev_wq) {
+		ret = -ENOMEM;
+		goto out_bitmap;
+	}
+
+	zram->bdev = bdev;
+	pr_info("Using %s for writeback, %lu pages\n",
+		zram->bdev_path, blocks);
+
+	return 0;
+
+out_bitmap:
+	vfree(zram->bdev_bitmap);
+	zram->bdev_bitmap = NULL;
+	zram->bdev_blocks = 0;
+out_bdev:
+	close_bdev_exclusive(bdev, ZRAM_BDEV_MODE);
+out_path:
+	kfree(zram->bdev_path);
+	zram->bdev_path = NULL;
+	return ret;
+}
+
+void zram_bdev_reset(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	destroy_workqueue(zram->bdev_wq);
+	close_bdev_exclusive(zram->bdev, ZRAM_BDEV_MODE);
+	vfree(zram->bdev_bitmap);
+	kfree(zram->bdev_path);
+
+	zram->bdev = NULL;
+	zram->bdev_wq = NULL;
+	zram->bdev_bitmap = NULL;
+	zram->bdev_path = NULL;
+	zram->bdev_blocks = 0;
+}
+
+/* Returns a free block, or 0 if the backing device is full */
+unsigned long zram_bdev_alloc_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->bdev_lock);
+	blk = find_next_zero_bit(zram->bdev_bitmap, zram->bdev_blocks, 1);
+	if (blk < zram->bdev_blocks)
+		set_bit(blk, zram->bdev_bitmap);
+	else
+		blk = 0;
+	spin_unlock(&zram->bdev_lock);
+
+	return blk;
+}
+
+void zram_bdev_free_block(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->bdev_lock);
+	WARN_ON(!test_bit(blk, zram->bdev_bitmap));
+	clear_bit(blk, zram->bdev_bitmap);
+	spin_unlock(&zram->bdev_lock);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_bdev_submit(struct block_device *bdev, struct page *page,
+			    unsigned long blk, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = bdev;
+	bio->bi_sector = (sector_t)blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw == WRITE ? WRITE_SYNC : READ_SYNC, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct block_device *bdev;
+	struct page *page;
+	unsigned long blk;
+	int rw;
+	int ret;
+};
+
+static void zram_bdev_work_fn(struct work_struct *work)
+{
+	struct zram_bdev_work *w =
+		container_of(work, struct zram_bdev_work, work);
+
+	w->ret = zram_bdev_submit(w->bdev, w->page, w->blk, w->rw);
+}
+
+/*
+ * Synchronously read or write one page at block 'blk'.
+ *
+ * Inside our own make_request, a bio we submit is only queued until we
+ * return (current->bio_tail is set), so waiting for it would deadlock.
+ * Such I/O is handed to the device's own worker, which submits it from a
+ * clean context. keventd will not do: we may be swapping out on behalf of
+ * one of its work items, and flushing that queue from here would wait on
+ * ourselves.
+ */
+int zram_bdev_rw(struct zram *zram, struct page *page,
+		 unsigned long blk, int rw)
+{
+	struct zram_bdev_work w;
+
+	if (!current->bio_tail)
+		return zram_bdev_submit(zram->bdev, page, blk, rw);
+
+	w.bdev = zram->bdev;
+	w.page = page;
+	w.blk = blk;
+	w.rw = rw;
+	INIT_WORK(&w.work, zram_bdev_work_fn);
+	queue_work(zram->bdev_wq, &w.work);
+	flush_work(&w.work);
+
+	return w.ret;
+}
@@ -0,0 +1,28 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZRAM_BDEV_H_
+#define _ZRAM_BDEV_H_
+
+struct zram;
+struct page;
+
+int zram_bdev_set(struct zram *zram, const char *path);
+void zram_bdev_reset(struct zram *zram);
+void zram_bdev_clear(struct zram *zram);
+
+unsigned long zram_bdev_alloc_block(struct zram *zram);
+void zram_bdev_free_block(struct zram *zram, unsigned long blk);
+int zram_bdev_rw(struct zram *zram, struct page *page,
+		 unsigned long blk, int rw);
+
+#endif
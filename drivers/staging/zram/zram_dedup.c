@@ -0,0 +1,176 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Same-page deduplication. Compressed objects are wrapped in refcounted
+ * zram_entry structures; with use_dedup set, they are also hashed by a
+ * checksum of their uncompressed page, so that a write of identical
+ * content takes another reference instead of compressing and storing a
+ * copy. A checksum match is verified by decompressing the candidate and
+ * comparing it with the new page before it is shared.
+ */
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+#include "zram_dedup.h"
+
+/* Average chain length with every disk page stored uniquely */
+#define ZRAM_DEDUP_CHAIN	8
+
+static struct zram_hash *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum & (zram->hash_size - 1)];
+}
+
+u32 zram_dedup_checksum(const unsigned char *mem)
+{
+	return jhash2((const u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+struct zram_entry *zram_entry_alloc(struct zram *zram, unsigned long handle,
+				    size_t len, u32 checksum)
+{
+	struct zram_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	INIT_HLIST_NODE(&entry->node);
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+
+	return entry;
+}
+
+/*
+ * Drop a reference, freeing the object with the last one. Returns the
+ * number of references left.
+ */
+unsigned int zram_entry_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash;
+	unsigned int refcount;
+
+	if (!zram->use_dedup) {
+		refcount = --entry->refcount;
+		goto out;
+	}
+
+	hash = zram_dedup_bucket(zram, entry->checksum);
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount && !hlist_unhashed(&entry->node))
+		hlist_del(&entry->node);
+	spin_unlock(&hash->lock);
+
+out:
+	if (!refcount) {
+		zs_free(zram->mem_pool, entry->handle);
+		kfree(entry);
+	}
+
+	return refcount;
+}
+
+/* Make a fully written entry available for sharing */
+void zram_dedup_insert(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash;
+
+	if (!zram->use_dedup)
+		return;
+
+	hash = zram_dedup_bucket(zram, entry->checksum);
+	spin_lock(&hash->lock);
+	hlist_add_head(&entry->node, &hash->head);
+	spin_unlock(&hash->lock);
+}
+
+/*
+ * Find a stored object whose content equals the page at 'mem', and take a
+ * reference on it. Only the first entry with a matching checksum is
+ * verified; a rare collision just means the page is stored again.
+ *
+ * The candidate is decompressed into the stream's buffer, which the caller
+ * may reuse for compression afterwards.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, struct zcomp_strm *strm,
+				   const unsigned char *mem, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, checksum);
+	struct zram_entry *entry, *found = NULL;
+	struct hlist_node *pos;
+	unsigned char *cmem;
+	int ret;
+
+	spin_lock(&hash->lock);
+	hlist_for_each_entry(entry, pos, &hash->head, node) {
+		if (entry->checksum == checksum) {
+			entry->refcount++;
+			found = entry;
+			break;
+		}
+	}
+	spin_unlock(&hash->lock);
+
+	if (!found)
+		return NULL;
+
+	cmem = zs_map_object(zram->mem_pool, found->handle, ZS_MM_RO);
+	ret = zcomp_decompress(zram->comp, strm, cmem, found->len,
+			       strm->buffer);
+	zs_unmap_object(zram->mem_pool, found->handle);
+
+	if (ret || memcmp(strm->buffer, mem, PAGE_SIZE)) {
+		zram_entry_put(zram, found);
+		return NULL;
+	}
+
+	return found;
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t i;
+
+	if (!zram->use_dedup)
+		return 0;
+
+	zram->hash_size = roundup_pow_of_two(
+			max_t(size_t, num_pages / ZRAM_DEDUP_CHAIN, 64));
+	zram->hash = vmalloc(zram->hash_size * sizeof(*zram->hash));
+	if (!zram->hash)
+		return -ENOMEM;
+
+	for (i = 0; i < zram->hash_size; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		INIT_HLIST_HEAD(&zram->hash[i].head);
+	}
+
+	return 0;
+}
+
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+struct zram;
+struct zram_entry;
+struct zcomp_strm;
+
+int zram_dedup_init(struct zram *zram, size_t num_pages);
+void zram_dedup_fini(struct zram *zram);
+
+u32 zram_dedup_checksum(const unsigned char *mem);
+struct zram_entry *zram_dedup_find(struct zram *zram, struct zcomp_strm *strm,
+				   const unsigned char *mem, u32 checksum);
+void zram_dedup_insert(struct zram *zram, struct zram_entry *entry);
+
+struct zram_entry *zram_entry_alloc(struct zram *zram, unsigned long handle,
+				    size_t len, u32 checksum);
+unsigned int zram_entry_put(struct zram *zram, struct zram_entry *entry);
+
+#endif
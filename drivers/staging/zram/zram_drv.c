@@ -19,17 +19,20 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
+#include <linux/ktime.h>
 #include <linux/vmalloc.h>
 
 #include "zram_drv.h"
+#include "zram_dedup.h"
+#include "zram_bdev.h"
 
 /* Globals */
 static int zram_major;
@@ -38,14 +41,14 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -67,6 +70,28 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+static void zram_comp_stat_compress(struct zram *zram, size_t clen, s64 ns)
+{
+	struct zram_comp_stats *cs = &zram->comp_stats[zram->comp->backend];
+
+	spin_lock(&zram->stat64_lock);
+	cs->pages_compressed++;
+	cs->orig_size += PAGE_SIZE;
+	cs->compr_size += clen;
+	cs->compress_ns += ns;
+	spin_unlock(&zram->stat64_lock);
+}
+
+static void zram_comp_stat_decompress(struct zram *zram, s64 ns)
+{
+	struct zram_comp_stats *cs = &zram->comp_stats[zram->comp->backend];
+
+	spin_lock(&zram->stat64_lock);
+	cs->pages_decompressed++;
+	cs->decompress_ns += ns;
+	spin_unlock(&zram->stat64_lock);
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 													enum zram_pageflags flag)
 {
@@ -85,6 +110,42 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
+/*
+ * Per-slot lock. Reads, writes and frees of different pages proceed in
+ * parallel; only accesses to the same table entry serialize.
+ */
+static void zram_lock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+static void zram_unlock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+/* Seconds of uptime, as kept in table ac_time */
+static u32 zram_now(void)
+{
+	struct timespec ts;
+
+	ktime_get_ts(&ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Note a read or write of the slot. ac_time drives age based writeback and
+ * the age histogram; clearing ZRAM_IDLE takes the page out of the next
+ * "idle" writeback.
+ *
+ * Caller must hold the slot lock.
+ */
+static void zram_accessed(struct zram *zram, u32 index)
+{
+	zram->table[index].ac_time = zram_now();
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+}
+
 static int page_zero_filled(void *ptr)
 {
 	unsigned int pos;
@@ -129,15 +190,29 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/*
+ * Release the memory held by a table entry.
+ *
+ * Caller must hold the slot lock.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
-	
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
-	
-	if (unlikely(!page)) {
+	unsigned long handle = zram->table[index].handle;
+	struct zram_entry *entry;
+
+	/* Tell a writeback in progress that the page went away */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_bdev_free_block(zram, handle);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_dec(&zram->stats.pages_wb);
+		goto out;
+	}
+
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -148,45 +223,51 @@ static void zram_free_page(struct zram *zram, size_t index)
 		}
 		return;
 	}
-	
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
+		zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 		goto out;
 	}
-	
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-	
-	xv_free(zram->mem_pool, page, offset);
+
+	entry = (struct zram_entry *)handle;
+	clen = zram->table[index].size;
+	if (zram_entry_put(zram, entry)) {
+		/* Other pages still share the object */
+		zram_stat_dec(&zram->stats.pages_dup);
+		zram_stat64_sub(zram, &zram->stats.dup_size, clen);
+	} else
+		zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
-	
-	out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+
+out:
 	zram_stat_dec(&zram->stats.pages_stored);
-	
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static void zram_discard(struct zram *zram, struct bio *bio)
 {
 	u32 i, npages, index;
-	
+
 	if (unlikely(!zram->init_done))
 		goto out;
-	
+
 	npages = bio->bi_size / PAGE_SIZE;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-	
-	for (i = 0; i < npages; i++)
-		zram_free_page(zram, index++);
-	
-	out:
+
+	for (i = 0; i < npages; i++, index++) {
+		zram_lock_slot(zram, index);
+		zram_free_page(zram, index);
+		zram_unlock_slot(zram, index);
+	}
+
+out:
 	zram_stat64_inc(zram, &zram->stats.discard);
 	bio_endio(bio, 0);
 }
@@ -194,109 +275,473 @@ static void zram_discard(struct zram *zram, struct bio *bio)
 static void handle_zero_page(struct page *page)
 {
 	void *user_mem;
-	
+
 	user_mem = kmap_atomic(page, KM_USER0);
 	memset(user_mem, 0, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
-	
+
 	flush_dcache_page(page);
 }
 
 static void handle_uncompressed_page(struct zram *zram,
-																		 struct page *page, u32 index)
+				     struct page *page, u32 index)
 {
 	unsigned char *user_mem, *cmem;
-	
+
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-	zram->table[index].offset;
-	
+	cmem = kmap_atomic((struct page *)zram->table[index].handle, KM_USER1);
+
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
-	
+
 	flush_dcache_page(page);
 }
 
+/*
+ * Read a page back from the backing device. The slot lock is not held
+ * across the I/O: as with swap itself, a page is never read while it is
+ * being rewritten.
+ */
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+			       unsigned long blk, u16 size, int raw)
+{
+	int ret;
+	struct page *bounce;
+	struct zcomp_strm *strm;
+	unsigned char *user_mem, *cmem;
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	if (raw) {
+		ret = zram_bdev_rw(zram, page, blk, READ);
+		goto out;
+	}
+
+	bounce = alloc_page(GFP_NOIO);
+	if (unlikely(!bounce)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = zram_bdev_rw(zram, bounce, blk, READ);
+	if (!ret) {
+		strm = zcomp_strm_find(zram->comp);
+		user_mem = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(bounce, KM_USER1);
+		ret = zcomp_decompress(zram->comp, strm, cmem, size, user_mem);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+		zcomp_strm_release(zram->comp, strm);
+	}
+	__free_page(bounce);
+
+out:
+	if (unlikely(ret)) {
+		pr_err("Backing device read failed! err=%d, block=%lu\n",
+			ret, blk);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return -EIO;
+	}
+
+	flush_dcache_page(page);
+	return 0;
+}
+
+/*
+ * Read one page. The slot lock is held across decompression so that a
+ * concurrent write or free of the same page cannot release the object
+ * under us. A stream is taken first, as some backends keep decompression
+ * state in their transform.
+ */
+static int zram_bvec_read(struct zram *zram, struct page *page, u32 index)
+{
+	int ret;
+	ktime_t start;
+	struct zcomp_strm *strm;
+	struct zram_entry *entry;
+	unsigned char *user_mem, *cmem;
+
+	strm = zcomp_strm_find(zram->comp);
+	zram_lock_slot(zram, index);
+	zram_accessed(zram, index);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long blk = zram->table[index].handle;
+		u16 size = zram->table[index].size;
+		int raw = zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+		zram_unlock_slot(zram, index);
+		zcomp_strm_release(zram->comp, strm);
+		return zram_read_from_bdev(zram, page, blk, size, raw);
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
+	    unlikely(!zram->table[index].handle)) {
+		/* Requested page is not present in compressed area */
+		if (!zram_test_flag(zram, index, ZRAM_ZERO))
+			pr_debug("Read before write: page=%u\n", index);
+		zram_unlock_slot(zram, index);
+		zcomp_strm_release(zram->comp, strm);
+		handle_zero_page(page);
+		return 0;
+	}
+
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		zram_unlock_slot(zram, index);
+		zcomp_strm_release(zram->comp, strm);
+		return 0;
+	}
+
+	entry = (struct zram_entry *)zram->table[index].handle;
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+
+	start = ktime_get();
+	ret = zcomp_decompress(zram->comp, strm, cmem, entry->len, user_mem);
+
+	zs_unmap_object(zram->mem_pool, entry->handle);
+	kunmap_atomic(user_mem, KM_USER0);
+	zram_unlock_slot(zram, index);
+	zcomp_strm_release(zram->comp, strm);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return -EIO;
+	}
+
+	zram_comp_stat_decompress(zram,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	flush_dcache_page(page);
+	return 0;
+}
+
 static int zram_read(struct zram *zram, struct bio *bio)
 {
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
-	
+
 	if (unlikely(!zram->init_done)) {
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
-	
+
 	zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-	
+
 	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
-		
-		page = bvec->bv_page;
-		
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
+		if (zram_bvec_read(zram, bvec->bv_page, index))
+			goto out;
+		index++;
+	}
+
+	set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, 0);
+	return 0;
+
+out:
+	bio_io_error(bio);
+	return 0;
+}
+
+/*
+ * Write one page. Compression runs on a stream of our own and the object
+ * is allocated and filled without any slot lock held; the slot lock is
+ * only taken to swap the new object into the table.
+ */
+static int zram_bvec_write(struct zram *zram, struct page *page, u32 index)
+{
+	int ret;
+	size_t clen;
+	ktime_t start;
+	struct zcomp_strm *strm;
+	struct page *page_store = NULL;
+	struct zram_entry *entry = NULL;
+	unsigned long handle;
+	unsigned char *user_mem, *cmem;
+	int uncompressed = 0;
+	u32 checksum = 0;
+
+	strm = zcomp_strm_find(zram->comp);
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	if (page_zero_filled(user_mem)) {
+		kunmap_atomic(user_mem, KM_USER0);
+		zcomp_strm_release(zram->comp, strm);
+
+		zram_lock_slot(zram, index);
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_ZERO);
+		zram_accessed(zram, index);
+		zram_unlock_slot(zram, index);
+		zram_stat_inc(&zram->stats.pages_zero);
+		return 0;
+	}
+
+	if (zram->use_dedup) {
+		checksum = zram_dedup_checksum(user_mem);
+		zram_stat64_inc(zram, &zram->stats.dedup_lookups);
+		entry = zram_dedup_find(zram, strm, user_mem, checksum);
+		if (entry) {
+			kunmap_atomic(user_mem, KM_USER0);
+			zcomp_strm_release(zram->comp, strm);
+
+			clen = entry->len;
+			handle = (unsigned long)entry;
+			zram_stat64_inc(zram, &zram->stats.dedup_hits);
+			zram_stat64_add(zram, &zram->stats.dup_size, clen);
+			zram_stat_inc(&zram->stats.pages_dup);
+			goto install;
 		}
-		
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-							 (ulong)(bio->bi_sector), bio->bi_size);
-			/* Do nothing */
-			index++;
-			continue;
+	}
+
+	start = ktime_get();
+	ret = zcomp_compress(zram->comp, strm, user_mem, &clen);
+
+	kunmap_atomic(user_mem, KM_USER0);
+
+	if (unlikely(ret)) {
+		zcomp_strm_release(zram->comp, strm);
+		pr_err("Compression failed! err=%d\n", ret);
+		goto fail;
+	}
+
+	zram_comp_stat_compress(zram, clen,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	/*
+	 * Page is incompressible. Store it as-is (uncompressed)
+	 * since we do not want to return too many disk write
+	 * errors which has side effect of hanging the system.
+	 */
+	if (unlikely(clen > max_zpage_size)) {
+		clen = PAGE_SIZE;
+		uncompressed = 1;
+		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!page_store)) {
+			zcomp_strm_release(zram->comp, strm);
+			pr_info("Error allocating memory for "
+				"incompressible page: %u\n", index);
+			goto spill;
 		}
-		
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
+		handle = (unsigned long)page_store;
+	} else {
+		handle = zs_malloc(zram->mem_pool, clen);
+		if (unlikely(!handle)) {
+			zcomp_strm_release(zram->comp, strm);
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%zu\n", index, clen);
+			goto spill;
 		}
-		
+		entry = zram_entry_alloc(zram, handle, clen, checksum);
+		if (unlikely(!entry)) {
+			zs_free(zram->mem_pool, handle);
+			zcomp_strm_release(zram->comp, strm);
+			goto spill;
+		}
+	}
+
+	if (uncompressed) {
+		cmem = kmap_atomic(page_store, KM_USER1);
 		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
-		
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
-		
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-																xv_get_object_size(cmem) - sizeof(*zheader),
-																user_mem, &clen);
-		
+		memcpy(cmem, user_mem, PAGE_SIZE);
 		kunmap_atomic(user_mem, KM_USER0);
 		kunmap_atomic(cmem, KM_USER1);
-		
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-						 ret, index);
-			zram_stat64_inc(zram, &zram->stats.failed_reads);
-			goto out;
-		}
-		
-		flush_dcache_page(page);
-		index++;
+	} else {
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		memcpy(cmem, strm->buffer, clen);
+		zs_unmap_object(zram->mem_pool, handle);
+		zram_dedup_insert(zram, entry);
+		handle = (unsigned long)entry;
 	}
-	
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
+	zcomp_strm_release(zram->comp, strm);
+
+	/* Compressed objects are only accounted once, however shared */
+	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+
+install:
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_lock_slot(zram, index);
+	zram_free_page(zram, index);
+	zram->table[index].handle = handle;
+	zram->table[index].size = clen;
+	zram_accessed(zram, index);
+	if (uncompressed)
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	zram_unlock_slot(zram, index);
+
+	/* Update stats */
+	if (uncompressed)
+		zram_stat_inc(&zram->stats.pages_expand);
+	zram_stat_inc(&zram->stats.pages_stored);
+	if (clen <= PAGE_SIZE / 2)
+		zram_stat_inc(&zram->stats.good_compress);
+
 	return 0;
-	
-	out:
-	bio_io_error(bio);
+
+spill:
+	/* Out of memory: put the page, as is, straight on the backing device */
+	if (!zram->bdev)
+		goto fail;
+	handle = zram_bdev_alloc_block(zram);
+	if (!handle)
+		goto fail;
+	if (zram_bdev_rw(zram, page, handle, WRITE)) {
+		zram_bdev_free_block(zram, handle);
+		goto fail;
+	}
+	zram_stat64_inc(zram, &zram->stats.bd_writes);
+
+	zram_lock_slot(zram, index);
+	zram_free_page(zram, index);
+	zram->table[index].handle = handle;
+	zram->table[index].size = PAGE_SIZE;
+	zram_accessed(zram, index);
+	zram_set_flag(zram, index, ZRAM_WB);
+	zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	zram_unlock_slot(zram, index);
+
+	zram_stat_inc(&zram->stats.pages_stored);
+	zram_stat_inc(&zram->stats.pages_wb);
 	return 0;
+
+fail:
+	zram_stat64_inc(zram, &zram->stats.failed_writes);
+	return -ENOMEM;
+}
+
+static int zram_wb_candidate(struct zram *zram, size_t index,
+			     enum zram_wb_mode mode, u32 now, u32 age)
+{
+	struct zram_entry *entry;
+
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return 0;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	/* Dropping one reference to a shared object frees nothing */
+	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		entry = (struct zram_entry *)zram->table[index].handle;
+		if (entry->refcount > 1)
+			return 0;
+	}
+
+	if (mode == ZRAM_WB_IDLE)
+		return zram_test_flag(zram, index, ZRAM_IDLE);
+
+	return now - zram->table[index].ac_time >= age;
+}
+
+/*
+ * Move pages out to the backing device, as selected by 'mode'; 'age' is
+ * in seconds, for ZRAM_WB_AGE. Compressed pages are written as stored,
+ * one per block, and only decompressed when read back. Returns the
+ * number of pages written.
+ *
+ * Caller must hold init_lock.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode, u32 age)
+{
+	size_t index, num_pages;
+	struct page *bounce;
+	struct zram_entry *entry;
+	unsigned char *src, *dst;
+	unsigned long blk = 0;
+	u32 now = zram_now();
+	int written = 0, ret = 0;
+	u16 size;
+	int raw;
+
+	if (!zram->init_done || !zram->bdev)
+		return -EINVAL;
+
+	bounce = alloc_page(GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+
+	num_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < num_pages; index++) {
+		if (!blk) {
+			blk = zram_bdev_alloc_block(zram);
+			if (!blk) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+
+		zram_lock_slot(zram, index);
+		if (!zram_wb_candidate(zram, index, mode, now, age)) {
+			zram_unlock_slot(zram, index);
+			continue;
+		}
+
+		raw = zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+		size = zram->table[index].size;
+		dst = kmap_atomic(bounce, KM_USER0);
+		if (raw) {
+			src = kmap_atomic((struct page *)zram->table[index].handle,
+					  KM_USER1);
+			memcpy(dst, src, PAGE_SIZE);
+			kunmap_atomic(src, KM_USER1);
+		} else {
+			entry = (struct zram_entry *)zram->table[index].handle;
+			src = zs_map_object(zram->mem_pool, entry->handle,
+					    ZS_MM_RO);
+			memcpy(dst, src, size);
+			zs_unmap_object(zram->mem_pool, entry->handle);
+		}
+		kunmap_atomic(dst, KM_USER0);
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_unlock_slot(zram, index);
+
+		ret = zram_bdev_rw(zram, bounce, blk, WRITE);
+		if (ret) {
+			zram_lock_slot(zram, index);
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_unlock_slot(zram, index);
+			break;
+		}
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+
+		zram_lock_slot(zram, index);
+		if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			/* Rewritten or freed meanwhile; reuse the block */
+			zram_unlock_slot(zram, index);
+			continue;
+		}
+		zram_free_page(zram, index);
+		zram->table[index].handle = blk;
+		zram->table[index].size = size;
+		zram_set_flag(zram, index, ZRAM_WB);
+		if (raw)
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_unlock_slot(zram, index);
+
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat_inc(&zram->stats.pages_wb);
+		blk = 0;
+		written++;
+	}
+
+	if (blk)
+		zram_bdev_free_block(zram, blk);
+	__free_page(bounce);
+
+	return written ? written : ret;
 }
 
 static int zram_write(struct zram *zram, struct bio *bio)
@@ -304,129 +749,27 @@ static int zram_write(struct zram *zram, struct bio *bio)
 	int i, ret;
 	u32 index;
 	struct bio_vec *bvec;
-	
+
 	if (unlikely(!zram->init_done)) {
 		ret = zram_init_device(zram);
 		if (ret)
 			goto out;
 	}
-	
+
 	zram_stat64_inc(zram, &zram->stats.num_writes);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-	
+
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
-		unsigned char *user_mem, *cmem, *src;
-		
-		page = bvec->bv_page;
-		src = zram->compress_buffer;
-		
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-			zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-		
-		mutex_lock(&zram->lock);
-		
-		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
-			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
-			index++;
-			continue;
-		}
-		
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-													 zram->compress_workmem);
-		
-		kunmap_atomic(user_mem, KM_USER0);
-		
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
-			pr_err("Compression failed! err=%d\n", ret);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
+		if (zram_bvec_write(zram, bvec->bv_page, index))
 			goto out;
-		}
-		
-		/*
-		 * Page is incompressible. Store it as-is (uncompressed)
-		 * since we do not want to return too many disk write
-		 * errors which has side effect of hanging the system.
-		 */
-		if (unlikely(clen > max_zpage_size)) {
-			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
-				pr_info("Error allocating memory for "
-				"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-												&zram->stats.failed_writes);
-				goto out;
-			}
-			
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
-		}
-		
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-			&zram->table[index].page, &offset,
-			GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-		pr_info("Error allocating memory for compressed "
-		"page: %u, size=%zu\n", index, clen);
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
-		goto out;
-			}
-			
-			memstore:
-			zram->table[index].offset = offset;
-			
-			cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
-			
-			#if 0
-			/* Back-reference needed for memory defragmentation */
-			if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-				zheader = (struct zobj_header *)cmem;
-				zheader->table_idx = index;
-				cmem += sizeof(*zheader);
-			}
-			#endif
-			
-			memcpy(cmem, src, clen);
-			
-			kunmap_atomic(cmem, KM_USER1);
-			if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-				kunmap_atomic(src, KM_USER0);
-			
-			/* Update stats */
-			zram_stat64_add(zram, &zram->stats.compr_size, clen);
-			zram_stat_inc(&zram->stats.pages_stored);
-			if (clen <= PAGE_SIZE / 2)
-				zram_stat_inc(&zram->stats.good_compress);
-			
-			mutex_unlock(&zram->lock);
-			index++;
+		index++;
 	}
-	
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
-	
-	out:
+
+out:
 	bio_io_error(bio);
 	return 0;
 }
@@ -480,6 +823,87 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+/*
+ * Mark every stored page idle. Pages still idle at the next marking or
+ * writeback have not been touched in between.
+ *
+ * Caller must hold init_lock.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index, num_pages;
+
+	if (!zram->init_done)
+		return;
+
+	num_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < num_pages; index++) {
+		zram_lock_slot(zram, index);
+		if (zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_ZERO))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_unlock_slot(zram, index);
+	}
+}
+
+static const u32 zram_age_limits[ZRAM_AGE_BUCKETS - 1] = {
+	60, 10 * 60, 60 * 60, 24 * 60 * 60,
+};
+
+static int zram_size_bucket(struct zram *zram, size_t index)
+{
+	u16 size = zram->table[index].size;
+
+	if (zram_test_flag(zram, index, ZRAM_ZERO))
+		return 0;
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		return ZRAM_SIZE_BUCKETS - 1;
+	if (size <= PAGE_SIZE / 4)
+		return 1;
+	if (size <= PAGE_SIZE / 2)
+		return 2;
+	if (size <= PAGE_SIZE / 4 * 3)
+		return 3;
+	return 4;
+}
+
+/*
+ * Count stored pages by time since last access and by compressed size.
+ *
+ * Caller must hold init_lock.
+ */
+void zram_age_hist(struct zram *zram, struct zram_age_hist *hist)
+{
+	size_t index, num_pages;
+	u32 now = zram_now();
+	int age, size;
+
+	memset(hist, 0, sizeof(*hist));
+	if (!zram->init_done)
+		return;
+
+	num_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < num_pages; index++) {
+		zram_lock_slot(zram, index);
+		if (!zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_ZERO)) {
+			zram_unlock_slot(zram, index);
+			continue;
+		}
+
+		for (age = 0; age < ZRAM_AGE_BUCKETS - 1; age++)
+			if (now - zram->table[index].ac_time <
+			    zram_age_limits[age])
+				break;
+		size = zram_size_bucket(zram, index);
+
+		hist->pages[age][size]++;
+		if (zram_test_flag(zram, index, ZRAM_IDLE))
+			hist->idle[age]++;
+		zram_unlock_slot(zram, index);
+	}
+}
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
@@ -488,33 +912,31 @@ void zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 	
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-	
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 	
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-		
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		unsigned long handle = zram->table[index].handle;
 		
-		if (!page)
+		if (!handle || zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 		
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page((struct page *)handle);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zram_entry_put(zram, (struct zram_entry *)handle);
 	}
 	
 	vfree(zram->table);
 	zram->table = NULL;
 	
-	xv_destroy_pool(zram->mem_pool);
+	zram_dedup_fini(zram);
+	zram_bdev_clear(zram);
+	
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 	
 	/* Reset stats */
@@ -538,16 +960,9 @@ int zram_init_device(struct zram *zram)
 	
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 	
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-	
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->backend, num_online_cpus());
+	if (!zram->comp) {
+		pr_err("Error allocating compression streams!\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
@@ -563,12 +978,18 @@ int zram_init_device(struct zram *zram)
 	}
 	memset(zram->table, 0, num_pages * sizeof(*zram->table));
 	
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret) {
+		pr_err("Error allocating deduplication table\n");
+		goto fail;
+	}
+	
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 	
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 	
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -594,7 +1015,9 @@ static void zram_slot_free_notify(struct block_device *bdev, unsigned long index
 	struct zram *zram;
 	
 	zram = bdev->bd_disk->private_data;
+	zram_lock_slot(zram, index);
 	zram_free_page(zram, index);
+	zram_unlock_slot(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -607,9 +1030,10 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 	
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
+	zram->backend = ZCOMP_LZO;
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->bdev_lock);
 	
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -747,6 +1171,7 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_bdev_reset(zram);
 	}
 	
 	unregister_blkdev(zram_major, "zram");
@@ -18,7 +18,8 @@
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zcomp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +27,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-	#if 0
-	u32 table_idx;
-	#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -49,12 +38,6 @@ static const unsigned default_disksize_perc_ram = 25;
  */
 static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
-/*
- * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
- */
-
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -70,17 +53,49 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 	
+	/* Slot lock: held while the entry is read or replaced */
+	ZRAM_ACCESS,
+	
+	/* Page lives on the backing device; handle is its block number */
+	ZRAM_WB,
+	
+	/* Page is being copied to the backing device */
+	ZRAM_UNDER_WB,
+	
+	/* Not accessed since the last "idle" marking */
+	ZRAM_IDLE,
+	
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * A compressed object, shared by every table entry holding the same page
+ * content when deduplication is on.
+ */
+struct zram_entry {
+	struct hlist_node node;	/* entry in its zram_hash bucket */
+	unsigned long handle;	/* zsmalloc handle */
+	u32 checksum;		/* of the uncompressed page */
+	u16 len;		/* compressed size, in bytes */
+	unsigned int refcount;	/* table entries using it; bucket lock */
+};
+
+/* Bucket of the deduplication table, keyed by page checksum */
+struct zram_hash {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
+	unsigned long handle;	/* struct zram_entry *, or the struct page *
+				 * of a ZRAM_UNCOMPRESSED page */
+	u16 size;	/* object size, in bytes */
+	u8 count;	/* unused; sharing is counted in zram_entry */
+	u32 ac_time;	/* last read or write, in seconds of uptime */
+	unsigned long flags;	/* zram_pageflags, ZRAM_ACCESS is a bit lock */
 } __attribute__((aligned(4)));
 
 struct zram_stats {
@@ -92,20 +107,60 @@ struct zram_stats {
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
 	u64 discard;		/* no. of block discard callbacks */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 dedup_lookups;	/* writes checked for a duplicate */
+	u64 dedup_hits;		/* ...that found one */
+	u64 dup_size;		/* compressed bytes not stored thanks to it */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	atomic_t pages_wb;	/* no. of pages now on the backing device */
+	atomic_t pages_dup;	/* no. of pages sharing another's object */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+};
+
+/* Per-compressor totals; these survive a device reset for comparison */
+struct zram_comp_stats {
+	u64 pages_compressed;	/* compressions that succeeded */
+	u64 orig_size;		/* bytes fed to the compressor */
+	u64 compr_size;		/* bytes it produced */
+	u64 compress_ns;	/* time spent compressing */
+	u64 pages_decompressed;
+	u64 decompress_ns;	/* time spent decompressing */
+};
+
+/* Pages to move out, see writeback in zram_sysfs.c */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,		/* incompressible pages */
+	ZRAM_WB_IDLE,		/* pages marked idle */
+	ZRAM_WB_AGE,		/* pages not accessed for some time */
+};
+
+/* Stored pages by age and size, see age_histogram in zram_sysfs.c */
+#define ZRAM_AGE_BUCKETS	5
+#define ZRAM_SIZE_BUCKETS	6
+
+struct zram_age_hist {
+	unsigned long pages[ZRAM_AGE_BUCKETS][ZRAM_SIZE_BUCKETS];
+	unsigned long idle[ZRAM_AGE_BUCKETS];	/* of those, marked idle */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
-	struct table *table;
+	struct zs_pool *mem_pool;
+	struct zcomp *comp;	/* compression streams, one per CPU */
+	enum zcomp_backend backend;	/* selected through comp_algorithm */
+	struct table *table;	/* entries are locked by ZRAM_ACCESS */
+	struct zram_hash *hash;	/* dedup buckets, if use_dedup */
+	size_t hash_size;	/* number of buckets, a power of two */
+	int use_dedup;		/* set through sysfs before init */
+	struct block_device *bdev;	/* writeback target, if any */
+	char *bdev_path;	/* as given to backing_dev */
+	unsigned long *bdev_bitmap;	/* blocks in use; block 0 is never used */
+	unsigned long bdev_blocks;	/* size of the backing device, in pages */
+	spinlock_t bdev_lock;	/* protects bdev_bitmap */
+	struct workqueue_struct *bdev_wq;	/* I/O from inside make_request */
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-	* concurrent writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -118,6 +173,7 @@ struct zram {
 	u64 disksize;	/* bytes */
 	
 	struct zram_stats stats;
+	struct zram_comp_stats comp_stats[ZCOMP_NR_BACKENDS];
 };
 
 extern struct zram *devices;
@@ -128,5 +184,8 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode, u32 age);
+extern void zram_mark_idle(struct zram *zram);
+extern void zram_age_hist(struct zram *zram, struct zram_age_hist *hist);
 
 #endif
\ No newline at end of file
@@ -14,8 +14,12 @@
 
 #include <linux/device.h>
 #include <linux/genhd.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 
 #include "zram_drv.h"
+#include "zram_bdev.h"
 
 #ifdef CONFIG_SYSFS
 
@@ -163,7 +167,7 @@ static ssize_t zero_pages_show(struct device *dev,
 {
 	struct zram *zram = dev_to_zram(dev);
 	
-	return sprintf(buf, "%u\n", zram->stats.pages_zero);
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_zero));
 }
 
 static ssize_t orig_data_size_show(struct device *dev,
@@ -172,7 +176,7 @@ static ssize_t orig_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 	
 	return sprintf(buf, "%llu\n",
-								 (u64)(zram->stats.pages_stored) << PAGE_SHIFT);
+								 (u64)atomic_read(&zram->stats.pages_stored) << PAGE_SHIFT);
 }
 
 static ssize_t compr_data_size_show(struct device *dev,
@@ -191,13 +195,311 @@ static ssize_t mem_used_total_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 	
 	if (zram->init_done) {
-		val = xv_get_total_size_bytes(zram->mem_pool) +
-		((u64)(zram->stats.pages_expand) << PAGE_SHIFT);
+		val = zs_get_total_size_bytes(zram->mem_pool) +
+		((u64)atomic_read(&zram->stats.pages_expand) << PAGE_SHIFT);
 	}
 	
 	return sprintf(buf, "%llu\n", val);
 }
 
+static ssize_t zs_stats_show_attr(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t ret = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		ret = zs_stats_show(zram->mem_pool, buf);
+	mutex_unlock(&zram->init_lock);
+
+	return ret;
+}
+
+/* Writing anything moves objects around to free whole pages */
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	unsigned long freed;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	freed = zs_compact(zram->mem_pool);
+	mutex_unlock(&zram->init_lock);
+
+	pr_debug("Compaction freed %lu pages\n", freed);
+
+	return len;
+}
+
+static ssize_t comp_algorithm_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return zcomp_available_show(zram->backend, buf);
+}
+
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int backend;
+	struct zram *zram = dev_to_zram(dev);
+
+	backend = zcomp_lookup(buf);
+	if (backend < 0)
+		return backend;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Cannot change compressor for initialized device\n");
+		return -EBUSY;
+	}
+	zram->backend = backend;
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+/*
+ * One line per compressor used on this device: pages compressed, the
+ * ratio of original to compressed size (in percent), and the average
+ * nanoseconds per page to compress and to decompress.
+ */
+static ssize_t comp_stats_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_comp_stats cs;
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; i < ZCOMP_NR_BACKENDS; i++) {
+		spin_lock(&zram->stat64_lock);
+		cs = zram->comp_stats[i];
+		spin_unlock(&zram->stat64_lock);
+
+		sz += sprintf(buf + sz, "%s: pages %llu ratio %llu%% "
+			      "compress_ns %llu decompress_ns %llu\n",
+			      zcomp_name(i), cs.pages_compressed,
+			      cs.compr_size ?
+				div64_u64(cs.orig_size * 100, cs.compr_size) : 0,
+			      cs.pages_compressed ?
+				div64_u64(cs.compress_ns, cs.pages_compressed) : 0,
+			      cs.pages_decompressed ?
+				div64_u64(cs.decompress_ns,
+					  cs.pages_decompressed) : 0);
+	}
+
+	return sz;
+}
+
+static ssize_t use_dedup_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->use_dedup);
+}
+
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Cannot change dedup for initialized device\n");
+		return -EBUSY;
+	}
+	zram->use_dedup = !!val;
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+/*
+ * Writes checked for a duplicate and those that found one (with the hit
+ * rate in percent), pages currently sharing another page's object, the
+ * compressed bytes this saves, and zero pages, which are never stored.
+ */
+static ssize_t dedup_stats_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	u64 lookups, hits, saved;
+
+	spin_lock(&zram->stat64_lock);
+	lookups = zram->stats.dedup_lookups;
+	hits = zram->stats.dedup_hits;
+	saved = zram->stats.dup_size;
+	spin_unlock(&zram->stat64_lock);
+
+	return sprintf(buf, "lookups %llu hits %llu hit_rate %llu%% "
+		       "dup_pages %u saved_bytes %llu zero_pages %u\n",
+		       lookups, hits,
+		       lookups ? div64_u64(hits * 100, lookups) : 0,
+		       atomic_read(&zram->stats.pages_dup), saved,
+		       atomic_read(&zram->stats.pages_zero));
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t ret;
+
+	mutex_lock(&zram->init_lock);
+	ret = sprintf(buf, "%s\n", zram->bdev ? zram->bdev_path : "none");
+	mutex_unlock(&zram->init_lock);
+
+	return ret;
+}
+
+/*
+ * Takes the path of a block device; a file can be used through loop. The
+ * device stays configured across a reset, until replaced here.
+ */
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	char *path;
+	struct zram *zram = dev_to_zram(dev);
+
+	path = kstrndup(buf, len, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change backing device for initialized "
+			"device\n");
+		ret = -EBUSY;
+		goto out;
+	}
+	zram_bdev_reset(zram);
+	ret = zram_bdev_set(zram, strstrip(path));
+out:
+	mutex_unlock(&zram->init_lock);
+	kfree(path);
+
+	return ret ? ret : len;
+}
+
+/*
+ * Writing "huge" moves incompressible pages to the backing device,
+ * "idle" moves pages marked idle and untouched since, and a number of
+ * seconds moves pages not accessed for that long.
+ */
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long age = 0;
+	enum zram_wb_mode mode;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (sysfs_streq(buf, "huge"))
+		mode = ZRAM_WB_HUGE;
+	else if (sysfs_streq(buf, "idle"))
+		mode = ZRAM_WB_IDLE;
+	else {
+		ret = strict_strtoul(buf, 10, &age);
+		if (ret)
+			return ret;
+		mode = ZRAM_WB_AGE;
+	}
+
+	mutex_lock(&zram->init_lock);
+	ret = zram_writeback(zram, mode, age);
+	mutex_unlock(&zram->init_lock);
+
+	if (ret < 0)
+		return ret;
+
+	pr_debug("Wrote back %d pages\n", ret);
+
+	return len;
+}
+
+/* Writing "all" marks every stored page idle */
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	zram_mark_idle(zram);
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+/*
+ * One row per age range: stored pages by size (zero filled, compressed
+ * to 25%, 50%, 75% or less, to less than a page, and incompressible),
+ * followed by how many of them are marked idle.
+ */
+static ssize_t age_histogram_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	static const char * const ages[ZRAM_AGE_BUCKETS] = {
+		"1m", "10m", "1h", "1d", "older",
+	};
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_age_hist hist;
+	ssize_t sz;
+	int i, j;
+
+	mutex_lock(&zram->init_lock);
+	zram_age_hist(zram, &hist);
+	mutex_unlock(&zram->init_lock);
+
+	sz = sprintf(buf, "%-6s %8s %8s %8s %8s %8s %8s %8s\n", "age",
+		     "zero", "<=25%", "<=50%", "<=75%", "<100%", "huge",
+		     "idle");
+	for (i = 0; i < ZRAM_AGE_BUCKETS; i++) {
+		sz += sprintf(buf + sz, "%-6s", ages[i]);
+		for (j = 0; j < ZRAM_SIZE_BUCKETS; j++)
+			sz += sprintf(buf + sz, " %8lu", hist.pages[i][j]);
+		sz += sprintf(buf + sz, " %8lu\n", hist.idle[i]);
+	}
+
+	return sz;
+}
+
+/* Pages now on the backing device, and pages read from and written to it */
+static ssize_t bd_stat_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u %llu %llu\n",
+		       atomic_read(&zram->stats.pages_wb),
+		       zram_stat64_read(zram, &zram->stats.bd_reads),
+		       zram_stat64_read(zram, &zram->stats.bd_writes));
+}
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 									 disksize_show, disksize_store);
 static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
@@ -211,6 +513,20 @@ static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		   comp_algorithm_show, comp_algorithm_store);
+static DEVICE_ATTR(comp_stats, S_IRUGO, comp_stats_show, NULL);
+static DEVICE_ATTR(zs_stats, S_IRUGO, zs_stats_show_attr, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(use_dedup, S_IRUGO | S_IWUSR,
+		   use_dedup_show, use_dedup_store);
+static DEVICE_ATTR(dedup_stats, S_IRUGO, dedup_stats_show, NULL);
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		   backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+static DEVICE_ATTR(bd_stat, S_IRUGO, bd_stat_show, NULL);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+static DEVICE_ATTR(age_histogram, S_IRUGO, age_histogram_show, NULL);
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -225,6 +541,17 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_comp_algorithm.attr,
+	&dev_attr_comp_stats.attr,
+	&dev_attr_zs_stats.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_use_dedup.attr,
+	&dev_attr_dedup_stats.attr,
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_stat.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_age_histogram.attr,
 	NULL,
 };
 
@@ -0,0 +1,669 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped by size into classes. Each class carves its objects
+ * out of "zspages": runs of 1 to ZS_MAX_PAGES_PER_ZSPAGE pages, sized per
+ * class to waste the least space at the end, with objects free to cross
+ * the boundary between two of those pages.
+ *
+ * Users get an opaque handle pointing at a struct zs_handle that records
+ * the object's current location. Each object starts with a copy of its
+ * handle, so zs_compact() can move objects between zspages of a class and
+ * update their handles, freeing whole zspages.
+ *
+ * Locking: class->lock protects a class and its zspages. Bit 0 of
+ * zs_handle->lock pins an object in place while it is mapped or freed;
+ * it is taken before class->lock, and only trylocked by compaction, which
+ * skips pinned objects.
+ */
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/bit_spinlock.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zsmalloc.h"
+
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+
+/* Slot sizes, including the handle, of the first and last class */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+				 ZS_SIZE_CLASS_DELTA + 1)
+
+#define ZS_MAX_OBJS_PER_ZSPAGE	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / \
+				 ZS_MIN_ALLOC_SIZE)
+
+/* A zspage above this percentage in use is no compaction source */
+#define ZS_ALMOST_FULL_PERCENT	75
+
+#define ZS_HANDLE_PIN		0
+
+enum fullness_group {
+	ZS_ALMOST_EMPTY,
+	ZS_ALMOST_FULL,
+	ZS_FULL,
+	
+	_ZS_NR_FULLNESS_GROUPS,
+};
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* entry in class->fullness_list */
+	struct size_class *class;
+	enum fullness_group fullness;
+	unsigned int inuse;		/* objects allocated */
+	unsigned long used[BITS_TO_LONGS(ZS_MAX_OBJS_PER_ZSPAGE)];
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+struct zs_handle {
+	unsigned long lock;		/* ZS_HANDLE_PIN bit lock */
+	struct zspage *zspage;		/* current location... */
+	unsigned int idx;		/* ...and slot within it */
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+	int size;			/* slot size, including the handle */
+	int pages_per_zspage;
+	int objs_per_zspage;
+	unsigned long zspages;		/* zspages allocated */
+	unsigned long objs_inuse;	/* objects allocated */
+};
+
+/* Bounce buffer for mapping an object that crosses a page boundary */
+struct zs_map_area {
+	char *buf;
+	void *vaddr;			/* kmap address, if not bounced */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct size_class classes[ZS_SIZE_CLASSES];
+	gfp_t flags;			/* for the pages of zspages */
+	atomic_long_t pages_allocated;
+	atomic_long_t handle_bytes;	/* slab memory of the zs_handles */
+
+	struct zs_map_area *map_area;	/* per-cpu */
+
+	struct mutex compact_lock;	/* serializes zs_compact() */
+	char *compact_buf;		/* object copy, under compact_lock */
+	unsigned long pages_compacted;	/* total freed by compaction */
+};
+
+static int get_size_class_index(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/* Pick the zspage length that leaves the least unused space at its end */
+static int get_pages_per_zspage(int size)
+{
+	int i, best = 1, max_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size = i * PAGE_SIZE;
+		int waste = zspage_size % size;
+		int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+					      struct zspage *zspage)
+{
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (zspage->inuse * 100 <=
+	    class->objs_per_zspage * ZS_ALMOST_FULL_PERCENT)
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+/* Caller must hold class->lock */
+static void fix_fullness_group(struct size_class *class, struct zspage *zspage)
+{
+	enum fullness_group fg = get_fullness_group(class, zspage);
+
+	if (fg == zspage->fullness)
+		return;
+
+	list_move(&zspage->list, &class->fullness_list[fg]);
+	zspage->fullness = fg;
+}
+
+static inline void zs_pin(struct zs_handle *handle)
+{
+	bit_spin_lock(ZS_HANDLE_PIN, &handle->lock);
+}
+
+static inline int zs_trypin(struct zs_handle *handle)
+{
+	return bit_spin_trylock(ZS_HANDLE_PIN, &handle->lock);
+}
+
+static inline void zs_unpin(struct zs_handle *handle)
+{
+	bit_spin_unlock(ZS_HANDLE_PIN, &handle->lock);
+}
+
+/*
+ * Copy the bytes [start, class->size) of slot 'idx' to (write == 0) or
+ * from (write == 1) the same offsets of 'buf', page by page.
+ */
+static void zs_obj_copy(struct size_class *class, struct zspage *zspage,
+			unsigned int idx, char *buf, size_t start, int write)
+{
+	unsigned long off = (unsigned long)idx * class->size + start;
+	size_t len = class->size - start;
+	char *addr;
+
+	buf += start;
+	while (len) {
+		unsigned long poff = off & ~PAGE_MASK;
+		size_t n = min_t(size_t, len, PAGE_SIZE - poff);
+
+		addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+		if (write)
+			memcpy(addr + poff, buf, n);
+		else
+			memcpy(buf, addr + poff, n);
+		kunmap_atomic(addr, KM_USER1);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/*
+ * Slots are multiples of 16 bytes, so the handle at the start of one
+ * never crosses a page boundary.
+ */
+static unsigned long *zs_obj_header(struct size_class *class,
+				    struct zspage *zspage, unsigned int idx)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+	char *addr;
+
+	addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+	return (unsigned long *)(addr + (off & ~PAGE_MASK));
+}
+
+static void zs_obj_set_handle(struct size_class *class, struct zspage *zspage,
+			      unsigned int idx, unsigned long handle)
+{
+	unsigned long *header = zs_obj_header(class, zspage, idx);
+
+	*header = handle;
+	kunmap_atomic(header, KM_USER1);
+}
+
+static unsigned long zs_obj_get_handle(struct size_class *class,
+				       struct zspage *zspage, unsigned int idx)
+{
+	unsigned long *header = zs_obj_header(class, zspage, idx);
+	unsigned long handle = *header;
+
+	kunmap_atomic(header, KM_USER1);
+	return handle;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	struct size_class *class = zspage->class;
+	int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				   struct size_class *class)
+{
+	struct zspage *zspage;
+	int i;
+
+	zspage = kzalloc(sizeof(*zspage), pool->flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	zspage->class = class;
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(pool->flags);
+		if (!zspage->pages[i]) {
+			while (i--)
+				__free_page(zspage->pages[i]);
+			kfree(zspage);
+			return NULL;
+		}
+	}
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+
+	return zspage;
+}
+
+/**
+ * zs_malloc - allocate an object of the given size from the pool
+ * @pool: pool to allocate from
+ * @size: object size, at most PAGE_SIZE - sizeof(unsigned long)
+ *
+ * Returns a handle for the object, or 0 on failure. The object's memory
+ * is reached through zs_map_object().
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned int idx;
+
+	size += ZS_HANDLE_SIZE;
+	if (unlikely(size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmalloc(sizeof(*handle), pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	class = &pool->classes[get_size_class_index(size)];
+
+	spin_lock(&class->lock);
+	if (!list_empty(&class->fullness_list[ZS_ALMOST_FULL])) {
+		zspage = list_first_entry(&class->fullness_list[ZS_ALMOST_FULL],
+					  struct zspage, list);
+	} else if (!list_empty(&class->fullness_list[ZS_ALMOST_EMPTY])) {
+		zspage = list_first_entry(&class->fullness_list[ZS_ALMOST_EMPTY],
+					  struct zspage, list);
+	} else {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class);
+		if (!zspage) {
+			kfree(handle);
+			return 0;
+		}
+		spin_lock(&class->lock);
+		zspage->fullness = ZS_ALMOST_EMPTY;
+		list_add(&zspage->list, &class->fullness_list[ZS_ALMOST_EMPTY]);
+		class->zspages++;
+	}
+
+	idx = find_first_zero_bit(zspage->used, class->objs_per_zspage);
+	__set_bit(idx, zspage->used);
+	zspage->inuse++;
+	class->objs_inuse++;
+	fix_fullness_group(class, zspage);
+
+	handle->lock = 0;
+	handle->zspage = zspage;
+	handle->idx = idx;
+	zs_obj_set_handle(class, zspage, idx, (unsigned long)handle);
+	spin_unlock(&class->lock);
+
+	atomic_long_add(ksize(handle), &pool->handle_bytes);
+	return (unsigned long)handle;
+}
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zspage *zspage, *empty = NULL;
+	struct size_class *class;
+
+	if (unlikely(!obj))
+		return;
+
+	/* wait out a compaction that may be moving this object */
+	zs_pin(handle);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	__clear_bit(handle->idx, zspage->used);
+	zspage->inuse--;
+	class->objs_inuse--;
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		class->zspages--;
+		empty = zspage;
+	} else
+		fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+
+	zs_unpin(handle);
+	atomic_long_sub(ksize(handle), &pool->handle_bytes);
+	kfree(handle);
+
+	if (empty)
+		free_zspage(pool, empty);
+}
+
+/**
+ * zs_map_object - get a pointer to an object's memory
+ * @pool: pool the object belongs to
+ * @handle: handle from zs_malloc()
+ * @mm: intended access; ZS_MM_WO skips reading in a bounced object
+ *
+ * The object stays in place until zs_unmap_object(). Mappings are
+ * atomic (preemption is disabled) and use KM_USER1; only one object
+ * may be mapped at a time per CPU.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj,
+		    enum zs_mapmode mm)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zs_map_area *area;
+	unsigned long off;
+
+	zs_pin(handle);
+	class = handle->zspage->class;
+	off = (unsigned long)handle->idx * class->size;
+
+	area = per_cpu_ptr(pool->map_area, smp_processor_id());
+	area->mm = mm;
+
+	if ((off & ~PAGE_MASK) + class->size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(handle->zspage->pages[off >> PAGE_SHIFT],
+					  KM_USER1);
+		return area->vaddr + (off & ~PAGE_MASK) + ZS_HANDLE_SIZE;
+	}
+
+	/* the object crosses a page boundary: bounce it */
+	area->vaddr = NULL;
+	if (mm != ZS_MM_WO)
+		zs_obj_copy(class, handle->zspage, handle->idx, area->buf,
+			    ZS_HANDLE_SIZE, 0);
+	return area->buf + ZS_HANDLE_SIZE;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_map_area *area;
+
+	area = per_cpu_ptr(pool->map_area, smp_processor_id());
+	if (area->vaddr)
+		kunmap_atomic(area->vaddr, KM_USER1);
+	else if (area->mm != ZS_MM_RO)
+		zs_obj_copy(handle->zspage->class, handle->zspage, handle->idx,
+			    area->buf, ZS_HANDLE_SIZE, 1);
+
+	zs_unpin(handle);
+}
+
+/*
+ * Move objects from 'src' to 'dst' until one is empty or the other full.
+ * Pinned objects are skipped; returns -EAGAIN if any was.
+ *
+ * Caller must hold class->lock and pool->compact_lock.
+ */
+static int zs_migrate(struct zs_pool *pool, struct size_class *class,
+		      struct zspage *src, struct zspage *dst)
+{
+	struct zs_handle *handle;
+	unsigned int idx = 0, didx;
+	int ret = 0;
+
+	while (src->inuse && dst->inuse < class->objs_per_zspage) {
+		idx = find_next_bit(src->used, class->objs_per_zspage, idx);
+		if (idx >= class->objs_per_zspage)
+			break;
+
+		handle = (struct zs_handle *)zs_obj_get_handle(class, src, idx);
+		if (!zs_trypin(handle)) {
+			ret = -EAGAIN;
+			idx++;
+			continue;
+		}
+
+		didx = find_first_zero_bit(dst->used, class->objs_per_zspage);
+		zs_obj_copy(class, src, idx, pool->compact_buf, 0, 0);
+		zs_obj_copy(class, dst, didx, pool->compact_buf, 0, 1);
+
+		__set_bit(didx, dst->used);
+		dst->inuse++;
+		__clear_bit(idx, src->used);
+		src->inuse--;
+
+		handle->zspage = dst;
+		handle->idx = didx;
+		zs_unpin(handle);
+		idx++;
+	}
+
+	return ret;
+}
+
+/* Can moving objects around free at least one zspage of this class? */
+static inline int zs_can_compact(struct size_class *class)
+{
+	return class->zspages * class->objs_per_zspage - class->objs_inuse >=
+		class->objs_per_zspage;
+}
+
+static unsigned long zs_compact_class(struct zs_pool *pool,
+				      struct size_class *class)
+{
+	struct list_head *empty_list = &class->fullness_list[ZS_ALMOST_EMPTY];
+	struct list_head *full_list = &class->fullness_list[ZS_ALMOST_FULL];
+	struct zspage *src, *dst;
+	unsigned long freed = 0;
+	int ret;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class) && !list_empty(empty_list)) {
+		/* drain the least used zspages into the most used ones */
+		src = list_first_entry(empty_list, struct zspage, list);
+		if (!list_empty(full_list))
+			dst = list_first_entry(full_list, struct zspage, list);
+		else if (!list_is_last(&src->list, empty_list))
+			dst = list_entry(empty_list->prev, struct zspage, list);
+		else
+			break;
+
+		ret = zs_migrate(pool, class, src, dst);
+		fix_fullness_group(class, dst);
+
+		if (!src->inuse) {
+			list_del(&src->list);
+			class->zspages--;
+			free_zspage(pool, src);
+			freed += class->pages_per_zspage;
+		} else {
+			fix_fullness_group(class, src);
+			if (ret)
+				break;
+		}
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - move objects to free whole zspages
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	int i;
+
+	mutex_lock(&pool->compact_lock);
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		freed += zs_compact_class(pool, &pool->classes[i]);
+		cond_resched();
+	}
+	pool->pages_compacted += freed;
+	mutex_unlock(&pool->compact_lock);
+
+	return freed;
+}
+
+/* Pages of zspages plus the separately allocated handles */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return ((u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT) +
+		atomic_long_read(&pool->handle_bytes);
+}
+
+/*
+ * A summary of the pool followed by one line per class in use. The
+ * fragmentation is the share of allocated pages not used by objects;
+ * handles is the memory of the zs_handles on top of those pages.
+ */
+ssize_t zs_stats_show(struct zs_pool *pool, char *buf)
+{
+	u64 total = (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+	u64 used = 0;
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock(&class->lock);
+		used += (u64)class->objs_inuse * class->size;
+		spin_unlock(&class->lock);
+	}
+
+	sz += sprintf(buf + sz, "pages %llu used %llu fragmentation %llu%% "
+		      "compacted %lu handles %lu\n", total >> PAGE_SHIFT, used,
+		      total ? div64_u64((total - used) * 100, total) : 0,
+		      pool->pages_compacted,
+		      atomic_long_read(&pool->handle_bytes));
+	sz += sprintf(buf + sz, "%5s %5s %7s %8s %10s\n", "size",
+		      "pages", "zspages", "inuse", "allocated");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+		unsigned long zspages, inuse;
+
+		spin_lock(&class->lock);
+		zspages = class->zspages;
+		inuse = class->objs_inuse;
+		spin_unlock(&class->lock);
+
+		if (!zspages)
+			continue;
+		/* each line is at most 42 bytes */
+		if (sz > PAGE_SIZE - 64)
+			break;
+		sz += sprintf(buf + sz, "%5d %5d %7lu %8lu %10lu\n",
+			      class->size, class->pages_per_zspage, zspages,
+			      inuse, zspages * class->objs_per_zspage);
+	}
+
+	return sz;
+}
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	struct zspage *zspage, *next;
+	int i, fg, cpu;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		WARN_ON(class->objs_inuse);
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++)
+			list_for_each_entry_safe(zspage, next,
+					&class->fullness_list[fg], list)
+				free_zspage(pool, zspage);
+	}
+
+	if (pool->map_area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+		free_percpu(pool->map_area);
+	}
+	kfree(pool->compact_buf);
+	vfree(pool);
+}
+
+struct zs_pool *zs_create_pool(gfp_t flags)
+{
+	struct zs_pool *pool;
+	int i, fg, cpu;
+
+	pool = vmalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+	memset(pool, 0, sizeof(*pool));
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock_init(&class->lock);
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					 PAGE_SIZE / class->size;
+	}
+
+	pool->flags = flags;
+	atomic_long_set(&pool->pages_allocated, 0);
+	atomic_long_set(&pool->handle_bytes, 0);
+	mutex_init(&pool->compact_lock);
+
+	pool->compact_buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->compact_buf || !pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
@@ -50,6 +50,9 @@ struct android_pmem_platform_data
 	unsigned cached;
 	/* The MSM7k has bits to enable a write buffer in the bus controller*/
 	unsigned buffered;
+	/* set to lend the unused parts of the region to the page allocator,
+	 * see CONFIG_ANDROID_PMEM_LEND */
+	unsigned lend;
 };
 
 struct pmem_region {
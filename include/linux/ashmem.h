@@ -14,6 +14,7 @@
 
 #include <linux/limits.h>
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define ASHMEM_NAME_LEN		256
 
@@ -32,6 +33,17 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/*
+ * Vectored ASHMEM_PIN/ASHMEM_UNPIN. For ASHMEM_PIN_BATCH, 'status' (if
+ * non-zero) receives one ASHMEM_NOT_PURGED/ASHMEM_WAS_PURGED per range.
+ */
+struct ashmem_pin_batch {
+	__u64 pins;	/* user pointer to 'count' struct ashmem_pin */
+	__u64 status;	/* user pointer to 'count' __u32, or zero */
+	__u32 count;	/* number of ranges */
+	__u32 reserved;	/* must be zero */
+};
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -44,5 +56,7 @@ struct ashmem_pin {
 #define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
 #define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+#define ASHMEM_PIN_BATCH	_IOW(__ASHMEMIOC, 11, struct ashmem_pin_batch)
+#define ASHMEM_UNPIN_BATCH	_IOW(__ASHMEMIOC, 12, struct ashmem_pin_batch)
 
 #endif	/* _LINUX_ASHMEM_H */
@@ -40,8 +40,21 @@
 #define MIGRATE_MOVABLE       2
 #define MIGRATE_PCPTYPES      3 /* the number of types on the pcp lists */
 #define MIGRATE_RESERVE       3
+#ifdef CONFIG_ANDROID_PMEM_LEND
+/*
+ * Device memory lent to the page allocator: only movable allocations may
+ * use it, and the device can take it back at any time by migrating them.
+ * Pageblocks of this type are never stolen by other migrate types.
+ */
+#define MIGRATE_LENT          4
+#define MIGRATE_ISOLATE       5 /* can't allocate from here */
+#define MIGRATE_TYPES         6
+#define is_migrate_lent(type) unlikely((type) == MIGRATE_LENT)
+#else
 #define MIGRATE_ISOLATE       4 /* can't allocate from here */
 #define MIGRATE_TYPES         5
+#define is_migrate_lent(type) 0
+#endif
 
 #define for_each_migratetype_order(order, type) \
 	for (order = 0; order < MAX_ORDER; order++) \
@@ -349,6 +362,12 @@ struct zone {
 	unsigned long		pages_scanned;	   /* since last reclaim */
 	unsigned long		flags;		   /* zone flags, see below */
 
+#ifdef CONFIG_VMPRESSURE
+	/* reclaim pressure, see mm/vmpressure.c */
+	unsigned long		vmpressure_scanned;
+	unsigned long		vmpressure_reclaimed;
+#endif
+
 	/* Zone statistics */
 	atomic_long_t		vm_stat[NR_VM_ZONE_STAT_ITEMS];
 
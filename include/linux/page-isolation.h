@@ -3,22 +3,25 @@
 
 /*
  * Changes migrate type in [start_pfn, end_pfn) to be MIGRATE_ISOLATE.
- * If specified range includes migrate types other than MOVABLE,
- * this will fail with -EBUSY.
+ * If specified range includes migrate types other than MOVABLE (or LENT),
+ * this will fail with -EBUSY, and restore 'migratetype' on the pageblocks
+ * isolated so far.
  *
  * For isolating all pages in the range finally, the caller have to
  * free all pages in the range. test_page_isolated() can be used for
  * test it.
  */
 extern int
-start_isolate_page_range(unsigned long start_pfn, unsigned long end_pfn);
+start_isolate_page_range(unsigned long start_pfn, unsigned long end_pfn,
+			 unsigned migratetype);
 
 /*
- * Changes MIGRATE_ISOLATE to MIGRATE_MOVABLE.
+ * Changes MIGRATE_ISOLATE to 'migratetype'.
  * target range is [start_pfn, end_pfn)
  */
 extern int
-undo_isolate_page_range(unsigned long start_pfn, unsigned long end_pfn);
+undo_isolate_page_range(unsigned long start_pfn, unsigned long end_pfn,
+			unsigned migratetype);
 
 /*
  * test all pages in [start_pfn, end_pfn)are isolated or not.
@@ -31,7 +34,19 @@ test_pages_isolated(unsigned long start_pfn, unsigned long end_pfn);
  * Please use make_pagetype_isolated()/make_pagetype_movable().
  */
 extern int set_migratetype_isolate(struct page *page);
-extern void unset_migratetype_isolate(struct page *page);
+extern void unset_migratetype_isolate(struct page *page, unsigned migratetype);
+
+#ifdef CONFIG_ANDROID_PMEM_LEND
+/*
+ * Hand a pageblock of reserved device memory to the page allocator as
+ * MIGRATE_LENT, and take a lent range back, migrating whatever was
+ * allocated there; see drivers/misc/pmem.c.
+ */
+extern int lend_pageblock(struct page *page);
+extern int reclaim_lent_range(unsigned long start_pfn, unsigned long end_pfn,
+			      unsigned long timeout);
+extern int offline_lent_range(unsigned long start_pfn, unsigned long end_pfn);
+#endif
 
 
 #endif
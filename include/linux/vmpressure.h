@@ -0,0 +1,33 @@
+#ifndef _LINUX_VMPRESSURE_H
+#define _LINUX_VMPRESSURE_H
+
+#include <linux/gfp.h>
+#include <linux/types.h>
+
+struct zone;
+struct notifier_block;
+
+/*
+ * How hard reclaim has to work in a zone, judged by the share of scanned
+ * pages that could not be reclaimed over the last window.
+ */
+enum vmpressure_level {
+	VMPRESSURE_NONE,	/* no reclaim in this zone yet */
+	VMPRESSURE_LOW,		/* reclaim keeps up */
+	VMPRESSURE_MEDIUM,	/* reclaim struggles, caches are shrinking */
+	VMPRESSURE_CRITICAL,	/* reclaim barely frees anything */
+};
+
+#ifdef CONFIG_VMPRESSURE
+extern void vmpressure(gfp_t gfp, struct zone *zone, unsigned long scanned,
+		       unsigned long reclaimed);
+extern int vmpressure_register_notifier(struct notifier_block *nb);
+extern int vmpressure_unregister_notifier(struct notifier_block *nb);
+#else
+static inline void vmpressure(gfp_t gfp, struct zone *zone,
+			      unsigned long scanned, unsigned long reclaimed)
+{
+}
+#endif /* CONFIG_VMPRESSURE */
+
+#endif /* _LINUX_VMPRESSURE_H */
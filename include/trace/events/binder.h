@@ -0,0 +1,199 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_TRACE_BINDER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BINDER_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Emitted when a binder thread takes over the scheduling policy of a
+ * synchronous caller and when it goes back to its own policy on
+ * BC_REPLY. Both carry the transaction id, so the time between them is
+ * the window during which the caller's priority is inherited.
+ */
+TRACE_EVENT(binder_priority_inherit,
+	TP_PROTO(int debug_id, struct task_struct *task,
+		 unsigned int old_policy, int old_prio),
+	TP_ARGS(debug_id, task, old_policy, old_prio),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id	)
+		__field(pid_t,		pid		)
+		__field(unsigned int,	old_policy	)
+		__field(int,		old_prio	)
+		__field(unsigned int,	new_policy	)
+		__field(int,		new_prio	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->pid = task->pid;
+		__entry->old_policy = old_policy;
+		__entry->old_prio = old_prio;
+		__entry->new_policy = task->policy;
+		__entry->new_prio = task->prio;
+	),
+
+	TP_printk("transaction=%d pid=%d policy=%u->%u prio=%d->%d",
+		  __entry->debug_id, __entry->pid,
+		  __entry->old_policy, __entry->new_policy,
+		  __entry->old_prio, __entry->new_prio)
+);
+
+TRACE_EVENT(binder_priority_restore,
+	TP_PROTO(int debug_id, struct task_struct *task,
+		 unsigned int old_policy, int old_prio),
+	TP_ARGS(debug_id, task, old_policy, old_prio),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id	)
+		__field(pid_t,		pid		)
+		__field(unsigned int,	old_policy	)
+		__field(int,		old_prio	)
+		__field(unsigned int,	new_policy	)
+		__field(int,		new_prio	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->pid = task->pid;
+		__entry->old_policy = old_policy;
+		__entry->old_prio = old_prio;
+		__entry->new_policy = task->policy;
+		__entry->new_prio = task->prio;
+	),
+
+	TP_printk("transaction=%d pid=%d policy=%u->%u prio=%d->%d",
+		  __entry->debug_id, __entry->pid,
+		  __entry->old_policy, __entry->new_policy,
+		  __entry->old_prio, __entry->new_prio)
+);
+
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(int debug_id, int reply, int to_node, int to_proc,
+		 int to_thread, unsigned int code, unsigned int flags),
+	TP_ARGS(debug_id, reply, to_node, to_proc, to_thread, code, flags),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id	)
+		__field(int,		reply		)
+		__field(int,		to_node		)
+		__field(int,		to_proc		)
+		__field(int,		to_thread	)
+		__field(unsigned int,	code		)
+		__field(unsigned int,	flags		)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->reply = reply;
+		__entry->to_node = to_node;
+		__entry->to_proc = to_proc;
+		__entry->to_thread = to_thread;
+		__entry->code = code;
+		__entry->flags = flags;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->to_node, __entry->to_proc,
+		  __entry->to_thread, __entry->reply, __entry->flags,
+		  __entry->code)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(int debug_id),
+	TP_ARGS(debug_id),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+	),
+
+	TP_printk("transaction=%d", __entry->debug_id)
+);
+
+TRACE_EVENT(binder_transaction_alloc_buf,
+	TP_PROTO(int debug_id, size_t data_size, size_t offsets_size),
+	TP_ARGS(debug_id, data_size, offsets_size),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id	)
+		__field(size_t,		data_size	)
+		__field(size_t,		offsets_size	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->data_size = data_size;
+		__entry->offsets_size = offsets_size;
+	),
+
+	TP_printk("transaction=%d data_size=%zd offsets_size=%zd",
+		  __entry->debug_id, __entry->data_size,
+		  __entry->offsets_size)
+);
+
+TRACE_EVENT(binder_transaction_free_buf,
+	TP_PROTO(int debug_id, size_t data_size, size_t offsets_size),
+	TP_ARGS(debug_id, data_size, offsets_size),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id	)
+		__field(size_t,		data_size	)
+		__field(size_t,		offsets_size	)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->data_size = data_size;
+		__entry->offsets_size = offsets_size;
+	),
+
+	TP_printk("transaction=%d data_size=%zd offsets_size=%zd",
+		  __entry->debug_id, __entry->data_size,
+		  __entry->offsets_size)
+);
+
+/*
+ * Emitted around a binder mutex acquisition that had to wait; tag is
+ * the function that took the lock.
+ */
+TRACE_EVENT(binder_lock_contended,
+	TP_PROTO(const char *tag),
+	TP_ARGS(tag),
+
+	TP_STRUCT__entry(
+		__string(tag, tag)
+	),
+
+	TP_fast_assign(
+		__assign_str(tag, tag);
+	),
+
+	TP_printk("tag=%s", __get_str(tag))
+);
+
+TRACE_EVENT(binder_lock_acquired,
+	TP_PROTO(const char *tag),
+	TP_ARGS(tag),
+
+	TP_STRUCT__entry(
+		__string(tag, tag)
+	),
+
+	TP_fast_assign(
+		__assign_str(tag, tag);
+	),
+
+	TP_printk("tag=%s", __get_str(tag))
+);
+
+#endif /* _TRACE_BINDER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -0,0 +1,89 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pmem
+
+#if !defined(_TRACE_PMEM_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_PMEM_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Emitted for every allocation from a pmem region. split_order is the
+ * order of the free block that was carved up to satisfy it; it differs
+ * from order when no block of the right size was free, which is how
+ * fragmentation shows up in a trace.
+ */
+TRACE_EVENT(pmem_alloc,
+	TP_PROTO(int id, unsigned long len, int index, unsigned int order,
+		 unsigned int split_order),
+	TP_ARGS(id, len, index, order, split_order),
+
+	TP_STRUCT__entry(
+		__field(int,		id		)
+		__field(unsigned long,	len		)
+		__field(int,		index		)
+		__field(unsigned int,	order		)
+		__field(unsigned int,	split_order	)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->len = len;
+		__entry->index = index;
+		__entry->order = order;
+		__entry->split_order = split_order;
+	),
+
+	TP_printk("id=%d len=%lu index=%d order=%u split_order=%u",
+		  __entry->id, __entry->len, __entry->index,
+		  __entry->order, __entry->split_order)
+);
+
+TRACE_EVENT(pmem_alloc_fail,
+	TP_PROTO(int id, unsigned long len, unsigned int order),
+	TP_ARGS(id, len, order),
+
+	TP_STRUCT__entry(
+		__field(int,		id		)
+		__field(unsigned long,	len		)
+		__field(unsigned int,	order		)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->len = len;
+		__entry->order = order;
+	),
+
+	TP_printk("id=%d len=%lu order=%u",
+		  __entry->id, __entry->len, __entry->order)
+);
+
+/* merged_order is the order of the free block left after merging buddies */
+TRACE_EVENT(pmem_free,
+	TP_PROTO(int id, int index, unsigned int order,
+		 unsigned int merged_order),
+	TP_ARGS(id, index, order, merged_order),
+
+	TP_STRUCT__entry(
+		__field(int,		id		)
+		__field(int,		index		)
+		__field(unsigned int,	order		)
+		__field(unsigned int,	merged_order	)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->index = index;
+		__entry->order = order;
+		__entry->merged_order = merged_order;
+	),
+
+	TP_printk("id=%d index=%d order=%u merged_order=%u",
+		  __entry->id, __entry->index, __entry->order,
+		  __entry->merged_order)
+);
+
+#endif /* _TRACE_PMEM_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -27,22 +27,39 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
 #include <linux/shmem_fs.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/vmalloc.h>
+#include <linux/lzo.h>
 #include <linux/ashmem.h>
 
 #define ASHMEM_NAME_PREFIX "dev/ashmem/"
 #define ASHMEM_NAME_PREFIX_LEN (sizeof(ASHMEM_NAME_PREFIX) - 1)
 #define ASHMEM_FULL_NAME_LEN (ASHMEM_NAME_LEN + ASHMEM_NAME_PREFIX_LEN)
 
+/* internal range state: pages are held in the area's compressed store */
+#define ASHMEM_COMPRESSED	2
+
 /*
  * ashmem_area - anonymous shared memory area
- * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Lifecycle: From our parent file's open() until its release() and the
+ *	last reference taken by the shrinker is dropped
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
-	struct list_head unpinned_list;	/* list of all ashmem areas */
+	struct rb_root unpinned;	/* unpinned ranges, keyed by pgstart */
+	struct mutex mutex;		/* protects this area and its ranges */
+	atomic_t refs;			/* file plus in-flight purges */
+#ifdef CONFIG_ASHMEM_COMPRESS
+	struct radix_tree_root zpages;	/* compressed pages, by page index */
+	unsigned long nr_zpages;	/* number of entries in zpages */
+#endif
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
@@ -51,29 +68,40 @@ struct ashmem_area {
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex'; LRU linkage additionally by
+ *	`ashmem_lru_lock'
+ *
+ * The ranges of one area never overlap, so a tree ordered by pgstart is
+ * also ordered by pgend and serves as the interval tree for lookups.
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
-	struct list_head unpinned;	/* entry in its area's unpinned list */
+	struct rb_node node;		/* entry in its area's unpinned tree */
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
-	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
+	unsigned int purged;		/* ASHMEM_NOT, _WAS_PURGED or _COMPRESSED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* LRU list of compressed ranges, protected by ashmem_lru_lock */
+static LIST_HEAD(ashmem_zlru_list);
+
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU lists and lru_count
+ *
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *		  asma->mutex -> i_mutex -> i_alloc_sem
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * The shrinker only ever trylocks asma->mutex while holding this lock, so
+ * it never waits on an area, and it drops this lock before truncating.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -82,7 +110,7 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
   ((range)->pgend - (range)->pgstart + 1)
 
 #define range_on_lru(range) \
-  ((range)->purged == ASHMEM_NOT_PURGED)
+  ((range)->purged != ASHMEM_WAS_PURGED)
 
 #define page_range_subsumes_range(range, start, end) \
   (((range)->pgstart >= (start)) && ((range)->pgend <= (end)))
@@ -102,31 +130,346 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 #define PROT_MASK		(PROT_EXEC | PROT_READ | PROT_WRITE)
 
+/*
+ * Compressed ranges sit on their own list and are counted through the size
+ * of the compressed store rather than in lru_count.
+ *
+ * Caller must hold ashmem_lru_lock
+ */
 static inline void lru_add(struct ashmem_range *range)
 {
+	if (range->purged == ASHMEM_COMPRESSED) {
+		list_add_tail(&range->lru, &ashmem_zlru_list);
+		return;
+	}
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
 }
 
+/* Caller must hold ashmem_lru_lock */
 static inline void lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
-	lru_count -= range_size(range);
+	if (range->purged == ASHMEM_NOT_PURGED)
+		lru_count -= range_size(range);
+}
+
+#ifdef CONFIG_ASHMEM_COMPRESS
+
+/*
+ * ashmem_zpage - one compressed page of an unpinned range
+ * Lifecycle: From the shrinker compressing it until pin, purge or release
+ * Locking: Protected by its area's `mutex'
+ */
+struct ashmem_zpage {
+	pgoff_t index;			/* page index within the area */
+	size_t len;			/* compressed length, in bytes */
+	unsigned char data[0];
+};
+
+/* compress unpinned ranges before purging them; off means purge directly */
+static int compress_reclaim = 1;
+module_param(compress_reclaim, bool, S_IRUGO | S_IWUSR);
+
+/* bytes held in all compressed stores */
+static atomic_long_t ashmem_zbytes = ATOMIC_LONG_INIT(0);
+
+/* ashmem_zmutex - protects the compression scratch buffers */
+static DEFINE_MUTEX(ashmem_zmutex);
+static void *ashmem_zwrkmem;
+static unsigned char *ashmem_zbuf;
+
+#define ASHMEM_ZBATCH	16
+
+static inline void ashmem_zinit(struct ashmem_area *asma)
+{
+	INIT_RADIX_TREE(&asma->zpages, GFP_NOWAIT | __GFP_NOWARN);
+}
+
+static inline unsigned long ashmem_zstore_pages(void)
+{
+	return atomic_long_read(&ashmem_zbytes) >> PAGE_SHIFT;
+}
+
+/*
+ * ashmem_zdrop - free the compressed pages of [start, end]
+ *
+ * Returns the number of compressed bytes released.
+ *
+ * Caller must hold asma->mutex.
+ */
+static size_t ashmem_zdrop(struct ashmem_area *asma, size_t start, size_t end)
+{
+	struct ashmem_zpage *zp[ASHMEM_ZBATCH];
+	size_t freed = 0;
+	unsigned int i, n;
+
+	while (asma->nr_zpages && (n = radix_tree_gang_lookup(&asma->zpages,
+					(void **) zp, start, ASHMEM_ZBATCH))) {
+		for (i = 0; i < n; i++) {
+			if (zp[i]->index > end)
+				goto out;
+			radix_tree_delete(&asma->zpages, zp[i]->index);
+			asma->nr_zpages--;
+			freed += zp[i]->len;
+			kfree(zp[i]);
+		}
+		start = zp[n - 1]->index + 1;
+	}
+out:
+	atomic_long_sub(freed, &ashmem_zbytes);
+	return freed;
+}
+
+/*
+ * ashmem_zstore - compress the resident pages of 'range' into the store
+ *
+ * Pages already in the store are skipped. Any page that is not in the page
+ * cache (a hole, or swapped out) or a range that compresses poorly fails
+ * the whole range, which the caller then purges. Allocations never enter
+ * reclaim, as we are called from it.
+ *
+ * Caller must hold asma->mutex.
+ */
+static int ashmem_zstore(struct ashmem_area *asma, struct ashmem_range *range)
+{
+	struct address_space *mapping = asma->file->f_mapping;
+	size_t budget = range_size(range) * PAGE_SIZE / 4 * 3;
+	size_t total = 0, clen;
+	struct ashmem_zpage *zp;
+	struct page *page;
+	void *src;
+	size_t idx;
+	int ret = 0;
+
+	if (!compress_reclaim || !ashmem_zwrkmem)
+		return -EINVAL;
+
+	mutex_lock(&ashmem_zmutex);
+	for (idx = range->pgstart; idx <= range->pgend; idx++) {
+		if (radix_tree_lookup(&asma->zpages, idx))
+			continue;
+
+		page = find_get_page(mapping, idx);
+		if (!page) {
+			ret = -ENOENT;
+			break;
+		}
+		if (unlikely(!PageUptodate(page))) {
+			page_cache_release(page);
+			ret = -EIO;
+			break;
+		}
+
+		src = kmap_atomic(page, KM_USER0);
+		ret = lzo1x_1_compress(src, PAGE_SIZE, ashmem_zbuf, &clen,
+				       ashmem_zwrkmem);
+		kunmap_atomic(src, KM_USER0);
+		page_cache_release(page);
+		if (unlikely(ret != LZO_E_OK)) {
+			ret = -EIO;
+			break;
+		}
+
+		total += clen;
+		if (total > budget) {
+			ret = -E2BIG;
+			break;
+		}
+
+		zp = kmalloc(sizeof(*zp) + clen, GFP_NOWAIT | __GFP_NOWARN);
+		if (!zp) {
+			ret = -ENOMEM;
+			break;
+		}
+		zp->index = idx;
+		zp->len = clen;
+		memcpy(zp->data, ashmem_zbuf, clen);
+
+		ret = radix_tree_insert(&asma->zpages, idx, zp);
+		if (unlikely(ret)) {
+			kfree(zp);
+			break;
+		}
+		asma->nr_zpages++;
+		atomic_long_add(clen, &ashmem_zbytes);
+	}
+	mutex_unlock(&ashmem_zmutex);
+
+	return ret;
+}
+
+/* decompress one stored page back into the backing file */
+static int ashmem_zload(struct ashmem_area *asma, struct ashmem_zpage *zp)
+{
+	struct address_space *mapping = asma->file->f_mapping;
+	loff_t pos = (loff_t) zp->index << PAGE_SHIFT;
+	size_t len = PAGE_SIZE;
+	struct page *page;
+	void *fsdata, *dst;
+	int ret;
+
+	ret = pagecache_write_begin(asma->file, mapping, pos, PAGE_SIZE,
+				    AOP_FLAG_UNINTERRUPTIBLE, &page, &fsdata);
+	if (unlikely(ret))
+		return ASHMEM_WAS_PURGED;
+
+	dst = kmap(page);
+	ret = lzo1x_decompress_safe(zp->data, zp->len, dst, &len);
+	if (unlikely(ret != LZO_E_OK || len != PAGE_SIZE))
+		memset(dst, 0, PAGE_SIZE);
+	kunmap(page);
+	flush_dcache_page(page);
+
+	pagecache_write_end(asma->file, mapping, pos, PAGE_SIZE, PAGE_SIZE,
+			    page, fsdata);
+
+	return (ret == LZO_E_OK && len == PAGE_SIZE) ?
+		ASHMEM_NOT_PURGED : ASHMEM_WAS_PURGED;
+}
+
+/*
+ * ashmem_zrestore - move the compressed pages of [start, end] back into the
+ * page cache, returning ASHMEM_WAS_PURGED if any of them could not be.
+ *
+ * Caller must hold asma->mutex.
+ */
+static int ashmem_zrestore(struct ashmem_area *asma, size_t start, size_t end)
+{
+	struct inode *inode = asma->file->f_dentry->d_inode;
+	struct ashmem_zpage *zp[ASHMEM_ZBATCH];
+	int ret = ASHMEM_NOT_PURGED;
+	unsigned int i, n;
+
+	if (!asma->nr_zpages)
+		return ret;
+
+	mutex_lock(&inode->i_mutex);
+	while (asma->nr_zpages && (n = radix_tree_gang_lookup(&asma->zpages,
+					(void **) zp, start, ASHMEM_ZBATCH))) {
+		for (i = 0; i < n; i++) {
+			if (zp[i]->index > end)
+				goto out;
+			ret |= ashmem_zload(asma, zp[i]);
+			radix_tree_delete(&asma->zpages, zp[i]->index);
+			asma->nr_zpages--;
+			atomic_long_sub(zp[i]->len, &ashmem_zbytes);
+			kfree(zp[i]);
+		}
+		start = zp[n - 1]->index + 1;
+	}
+out:
+	mutex_unlock(&inode->i_mutex);
+
+	return ret;
+}
+
+static int __init ashmem_zsetup(void)
+{
+	ashmem_zwrkmem = vmalloc(LZO1X_MEM_COMPRESS);
+	ashmem_zbuf = vmalloc(lzo1x_worst_compress(PAGE_SIZE));
+	if (unlikely(!ashmem_zwrkmem || !ashmem_zbuf)) {
+		vfree(ashmem_zwrkmem);
+		vfree(ashmem_zbuf);
+		ashmem_zwrkmem = NULL;
+		ashmem_zbuf = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void ashmem_zteardown(void)
+{
+	vfree(ashmem_zwrkmem);
+	vfree(ashmem_zbuf);
+}
+
+#else
+
+static inline void ashmem_zinit(struct ashmem_area *asma) { }
+static inline unsigned long ashmem_zstore_pages(void) { return 0; }
+static inline size_t ashmem_zdrop(struct ashmem_area *asma, size_t start,
+				  size_t end) { return 0; }
+static inline int ashmem_zstore(struct ashmem_area *asma,
+				struct ashmem_range *range) { return -EINVAL; }
+static inline int ashmem_zrestore(struct ashmem_area *asma, size_t start,
+				  size_t end) { return ASHMEM_NOT_PURGED; }
+static inline int ashmem_zsetup(void) { return 0; }
+static inline void ashmem_zteardown(void) { }
+
+#endif /* CONFIG_ASHMEM_COMPRESS */
+
+static void ashmem_area_put(struct ashmem_area *asma)
+{
+	if (!atomic_dec_and_test(&asma->refs))
+		return;
+
+	if (asma->file)
+		fput(asma->file);
+	kmem_cache_free(ashmem_area_cachep, asma);
+}
+
+/*
+ * range_first - find the lowest unpinned range that ends at or after 'page'
+ *
+ * Caller must hold asma->mutex.
+ */
+static struct ashmem_range *range_first(struct ashmem_area *asma, size_t page)
+{
+	struct rb_node *n = asma->unpinned.rb_node;
+	struct ashmem_range *range, *found = NULL;
+
+	while (n) {
+		range = rb_entry(n, struct ashmem_range, node);
+		if (range_before_page(range, page)) {
+			n = n->rb_right;
+		} else {
+			found = range;
+			n = n->rb_left;
+		}
+	}
+
+	return found;
+}
+
+static inline struct ashmem_range *range_next(struct ashmem_range *range)
+{
+	struct rb_node *n = rb_next(&range->node);
+
+	return n ? rb_entry(n, struct ashmem_range, node) : NULL;
+}
+
+static void range_insert(struct ashmem_area *asma, struct ashmem_range *new)
+{
+	struct rb_node **p = &asma->unpinned.rb_node;
+	struct rb_node *parent = NULL;
+	struct ashmem_range *range;
+
+	while (*p) {
+		parent = *p;
+		range = rb_entry(parent, struct ashmem_range, node);
+		if (new->pgstart < range->pgstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &asma->unpinned);
 }
 
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
  * 'asma' - associated ashmem_area
- * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
 		       size_t start, size_t end)
 {
 	struct ashmem_range *range;
@@ -140,37 +483,49 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgend = end;
 	range->purged = purged;
 
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
+	range_insert(asma, range);
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_add(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 
 	return 0;
 }
 
+/* Caller must hold asma->mutex. */
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
-	if (range_on_lru(range))
+	rb_erase(&range->node, &range->asma->unpinned);
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_del(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 	kmem_cache_free(ashmem_range_cachep, range);
 }
 
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Shrinking in place keeps the range's position in the tree valid, as it
+ * cannot move past its neighbours.
+ *
+ * Caller must hold asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
 {
 	size_t pre = range_size(range);
 
+	spin_lock(&ashmem_lru_lock);
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range->purged == ASHMEM_NOT_PURGED)
 		lru_count -= pre - range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -186,7 +541,10 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	asma->unpinned = RB_ROOT;
+	mutex_init(&asma->mutex);
+	atomic_set(&asma->refs, 1);
+	ashmem_zinit(asma);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -197,16 +555,15 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *n;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+	ashmem_zdrop(asma, 0, ULONG_MAX);
+	while ((n = rb_first(&asma->unpinned)))
+		range_del(rb_entry(n, struct ashmem_range, node));
+	mutex_unlock(&asma->mutex);
 
-	if (asma->file)
-		fput(asma->file);
-	kmem_cache_free(ashmem_area_cachep, asma);
+	ashmem_area_put(asma);
 
 	return 0;
 }
@@ -216,7 +573,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -257,7 +614,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -275,34 +632,105 @@ out:
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
  * pages freed.
+ *
+ * With CONFIG_ASHMEM_COMPRESS, a range's pages are first compressed into its
+ * area's store and the range moves to ashmem_zlru_list; a later pin restores
+ * them. Compressed ranges are only discarded once no plain unpinned range is
+ * left to reclaim, and they count towards our total by compressed size.
+ *
+ * Each range is claimed under ashmem_lru_lock by trylocking its area, so a
+ * busy area (possibly the one whose allocation got us here) is just skipped.
+ * The compression and truncation run holding only that area's mutex.
+ *
+ * __ashmem_shrink() with 'compress' clear skips the store and discards the
+ * plain ranges straight away, for ASHMEM_PURGE_ALL_CACHES.
  */
-static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+static int __ashmem_shrink(int nr_to_scan, gfp_t gfp_mask, int compress)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
 		return -1;
 	if (!nr_to_scan)
-		return lru_count;
+		return lru_count + ashmem_zstore_pages();
+
+	spin_lock(&ashmem_lru_lock);
+restart:
+	list_for_each_entry(range, &ashmem_lru_list, lru) {
+		struct ashmem_area *asma = range->asma;
+		struct inode *inode;
+		loff_t start, end;
+
+		if (!mutex_trylock(&asma->mutex))
+			continue;
+
+		atomic_inc(&asma->refs);
+		inode = asma->file->f_dentry->d_inode;
+		start = range->pgstart * PAGE_SIZE;
+		end = (range->pgend + 1) * PAGE_SIZE - 1;
+		lru_del(range);
+		nr_to_scan -= range_size(range);
+		spin_unlock(&ashmem_lru_lock);
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+		if (!compress || ashmem_zstore(asma, range)) {
+			ashmem_zdrop(asma, range->pgstart, range->pgend);
+			range->purged = ASHMEM_WAS_PURGED;
+		} else
+			range->purged = ASHMEM_COMPRESSED;
 
 		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
+
+		if (range->purged == ASHMEM_COMPRESSED) {
+			spin_lock(&ashmem_lru_lock);
+			lru_add(range);
+			spin_unlock(&ashmem_lru_lock);
+		}
+
+		mutex_unlock(&asma->mutex);
+		ashmem_area_put(asma);
+
+		if (nr_to_scan <= 0)
+			goto out;
+
+		spin_lock(&ashmem_lru_lock);
+		goto restart;
+	}
+
+restart_compressed:
+	list_for_each_entry(range, &ashmem_zlru_list, lru) {
+		struct ashmem_area *asma = range->asma;
+		size_t freed;
+
+		if (!mutex_trylock(&asma->mutex))
+			continue;
+
+		atomic_inc(&asma->refs);
 		lru_del(range);
+		range->purged = ASHMEM_WAS_PURGED;
+		spin_unlock(&ashmem_lru_lock);
+
+		freed = ashmem_zdrop(asma, range->pgstart, range->pgend);
+		nr_to_scan -= max_t(size_t, freed >> PAGE_SHIFT, 1);
+
+		mutex_unlock(&asma->mutex);
+		ashmem_area_put(asma);
 
-		nr_to_scan -= range_size(range);
 		if (nr_to_scan <= 0)
-			break;
+			goto out;
+
+		spin_lock(&ashmem_lru_lock);
+		goto restart_compressed;
 	}
-	mutex_unlock(&ashmem_mutex);
+	spin_unlock(&ashmem_lru_lock);
+
+out:
+	return lru_count + ashmem_zstore_pages();
+}
 
-	return lru_count;
+static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	return __ashmem_shrink(nr_to_scan, gfp_mask, 1);
 }
 
 static struct shrinker ashmem_shrinker = {
@@ -314,7 +742,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -329,15 +757,25 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/*
+ * The user copies in set_name() and get_name() are done outside asma->mutex:
+ * faulting on a mapping of this very area would otherwise take mmap_sem
+ * inside asma->mutex, the reverse of the order in ashmem_mmap().
+ */
 static int set_name(struct ashmem_area *asma, void __user *name)
 {
+	char local_name[ASHMEM_NAME_LEN];
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	if (unlikely(copy_from_user(local_name, name, ASHMEM_NAME_LEN)))
+		return -EFAULT;
+	local_name[ASHMEM_NAME_LEN-1] = '\0';
+
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -345,58 +783,55 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 		goto out;
 	}
 
-	if (unlikely(copy_from_user(asma->name + ASHMEM_NAME_PREFIX_LEN,
-				    name, ASHMEM_NAME_LEN)))
-		ret = -EFAULT;
-	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
+	strcpy(asma->name + ASHMEM_NAME_PREFIX_LEN, local_name);
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
 
 static int get_name(struct ashmem_area *asma, void __user *name)
 {
-	int ret = 0;
+	char local_name[ASHMEM_NAME_LEN];
+	size_t len;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
-		size_t len;
-
 		/*
 		 * Copying only `len', instead of ASHMEM_NAME_LEN, bytes
 		 * prevents us from revealing one user's stack to another.
 		 */
 		len = strlen(asma->name + ASHMEM_NAME_PREFIX_LEN) + 1;
-		if (unlikely(copy_to_user(name,
-				asma->name + ASHMEM_NAME_PREFIX_LEN, len)))
-			ret = -EFAULT;
+		memcpy(local_name, asma->name + ASHMEM_NAME_PREFIX_LEN, len);
 	} else {
-		if (unlikely(copy_to_user(name, ASHMEM_NAME_DEF,
-					  sizeof(ASHMEM_NAME_DEF))))
-			ret = -EFAULT;
+		len = sizeof(ASHMEM_NAME_DEF);
+		memcpy(local_name, ASHMEM_NAME_DEF, len);
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
-	return ret;
+	if (unlikely(copy_to_user(name, local_name, len)))
+		return -EFAULT;
+
+	return 0;
 }
 
 /*
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
-	int ret = ASHMEM_NOT_PURGED;
+	int ret;
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* moved past last applicable page; we can short circuit */
-		if (range_before_page(range, pgstart))
-			break;
+	ret = ashmem_zrestore(asma, pgstart, pgend);
+
+	for (range = range_first(asma, pgstart);
+	     range && range->pgstart <= pgend; range = next) {
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to pin pages that span multiple ranges,
@@ -414,7 +849,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 		 *    create a new range for the other side.
 		 */
 		if (page_range_in_range(range, pgstart, pgend)) {
-			ret |= range->purged;
+			ret |= range->purged & ASHMEM_WAS_PURGED;
 
 			/* Case #1: Easy. Just nuke the whole thing. */
 			if (page_range_subsumes_range(range, pgstart, pgend)) {
@@ -439,7 +874,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * more complicated, we allocate a new range for the
 			 * second half and adjust the first chunk's endpoint.
 			 */
-			range_alloc(asma, range, range->purged,
+			range_alloc(asma, range->purged,
 				    pgend + 1, range->pgend);
 			range_shrink(range, range->pgstart, pgstart - 1);
 			break;
@@ -452,18 +887,20 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	unsigned int purged = ASHMEM_NOT_PURGED;
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* short circuit: this is our insertion point */
-		if (range_before_page(range, pgstart))
-			break;
+	/*
+	 * Only the first overlapping range can lower pgstart and only the
+	 * last can raise pgend, so a single ordered pass merges them all.
+	 */
+	for (range = range_first(asma, pgstart);
+	     range && range->pgstart <= pgend; range = next) {
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to unpin pages that are already entirely
@@ -471,72 +908,88 @@ restart:
 		 */
 		if (page_range_subsumed_by_range(range, pgstart, pgend))
 			return 0;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			pgstart = min_t(size_t, range->pgstart, pgstart),
-			pgend = max_t(size_t, range->pgend, pgend);
-			purged |= range->purged;
-			range_del(range);
-			goto restart;
-		}
+		pgstart = min_t(size_t, range->pgstart, pgstart),
+		pgend = max_t(size_t, range->pgend, pgend);
+		purged |= range->purged;
+		range_del(range);
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	/*
+	 * A merge with a compressed range leaves some of its pages in the
+	 * store and the rest resident; the shrinker skips the stored ones.
+	 * A merge with a purged range makes the stored pages worthless.
+	 */
+	if (purged & ASHMEM_WAS_PURGED) {
+		ashmem_zdrop(asma, pgstart, pgend);
+		purged = ASHMEM_WAS_PURGED;
+	} else
+		purged = ASHMEM_NOT_PURGED;
+
+	return range_alloc(asma, purged, pgstart, pgend);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
 {
-	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
+	struct ashmem_range *range = range_first(asma, pgstart);
 
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
-		}
-	}
+	if (range && range->pgstart <= pgend)
+		return ASHMEM_IS_UNPINNED;
 
-	return ret;
+	return ASHMEM_IS_PINNED;
 }
 
-static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
-			    void __user *p)
+/*
+ * ashmem_pin_pages - validate a user-supplied range and convert it to pages
+ *
+ * Caller must hold asma->mutex.
+ */
+static int ashmem_pin_pages(struct ashmem_area *asma, struct ashmem_pin *pin,
+			    size_t *pgstart, size_t *pgend)
 {
-	struct ashmem_pin pin;
-	size_t pgstart, pgend;
-	int ret = -EINVAL;
-
 	if (unlikely(!asma->file))
 		return -EINVAL;
 
-	if (unlikely(copy_from_user(&pin, p, sizeof(pin))))
-		return -EFAULT;
-
 	/* per custom, you can pass zero for len to mean "everything onward" */
-	if (!pin.len)
-		pin.len = PAGE_ALIGN(asma->size) - pin.offset;
+	if (!pin->len)
+		pin->len = PAGE_ALIGN(asma->size) - pin->offset;
 
-	if (unlikely((pin.offset | pin.len) & ~PAGE_MASK))
+	if (unlikely((pin->offset | pin->len) & ~PAGE_MASK))
 		return -EINVAL;
 
-	if (unlikely(((__u32) -1) - pin.offset < pin.len))
+	if (unlikely(((__u32) -1) - pin->offset < pin->len))
 		return -EINVAL;
 
-	if (unlikely(PAGE_ALIGN(asma->size) < pin.offset + pin.len))
+	if (unlikely(PAGE_ALIGN(asma->size) < pin->offset + pin->len))
 		return -EINVAL;
 
-	pgstart = pin.offset / PAGE_SIZE;
-	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
+	*pgstart = pin->offset / PAGE_SIZE;
+	*pgend = *pgstart + (pin->len / PAGE_SIZE) - 1;
+
+	return 0;
+}
+
+static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
+			    void __user *p)
+{
+	struct ashmem_pin pin;
+	size_t pgstart, pgend;
+	int ret;
+
+	if (unlikely(copy_from_user(&pin, p, sizeof(pin))))
+		return -EFAULT;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+
+	ret = ashmem_pin_pages(asma, &pin, &pgstart, &pgend);
+	if (unlikely(ret))
+		goto out;
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -550,8 +1003,100 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+out:
+	mutex_unlock(&asma->mutex);
+
+	return ret;
+}
+
+/* ranges copied in per trip through asma->mutex by ashmem_pin_batch() */
+#define ASHMEM_BATCH_CHUNK	16
+
+/*
+ * ashmem_pin_batch - apply ASHMEM_PIN or ASHMEM_UNPIN to an array of ranges
+ *
+ * The array is consumed in chunks: each chunk is copied in, validated as a
+ * whole and applied under a single hold of asma->mutex, then its purge
+ * status is copied out. User memory is never touched with the mutex held.
+ * On error, chunks before the failing one have already been applied.
+ *
+ * Unpins that abut or overlap the previous entry are coalesced into one
+ * tree update. Pins are applied per range so each gets its own status.
+ */
+static int ashmem_pin_batch(struct ashmem_area *asma, unsigned long cmd,
+			    void __user *p)
+{
+	struct ashmem_pin pins[ASHMEM_BATCH_CHUNK];
+	size_t pgstart[ASHMEM_BATCH_CHUNK], pgend[ASHMEM_BATCH_CHUNK];
+	__u32 status[ASHMEM_BATCH_CHUNK];
+	struct ashmem_pin_batch batch;
+	struct ashmem_pin __user *upins;
+	__u32 __user *ustatus;
+	__u32 done, n, i;
+	int ret = 0;
+
+	if (unlikely(copy_from_user(&batch, p, sizeof(batch))))
+		return -EFAULT;
+
+	if (unlikely(batch.reserved))
+		return -EINVAL;
+
+	upins = (struct ashmem_pin __user *) (unsigned long) batch.pins;
+	ustatus = (__u32 __user *) (unsigned long) batch.status;
+
+	for (done = 0; done < batch.count; done += n) {
+		n = min_t(__u32, batch.count - done, ASHMEM_BATCH_CHUNK);
+
+		if (unlikely(copy_from_user(pins, upins + done,
+					    n * sizeof(pins[0]))))
+			return -EFAULT;
+
+		mutex_lock(&asma->mutex);
+
+		for (i = 0; i < n; i++) {
+			ret = ashmem_pin_pages(asma, &pins[i],
+					       &pgstart[i], &pgend[i]);
+			if (unlikely(ret))
+				goto out_unlock;
+		}
+
+		if (cmd == ASHMEM_PIN_BATCH) {
+			for (i = 0; i < n; i++)
+				status[i] = ashmem_pin(asma, pgstart[i],
+						       pgend[i]);
+		} else {
+			size_t start = pgstart[0], end = pgend[0];
+
+			for (i = 1; i < n; i++) {
+				if (pgstart[i] <= end + 1 &&
+				    pgend[i] + 1 >= start) {
+					start = min(start, pgstart[i]);
+					end = max(end, pgend[i]);
+					continue;
+				}
+				ret = ashmem_unpin(asma, start, end);
+				if (unlikely(ret))
+					goto out_unlock;
+				start = pgstart[i];
+				end = pgend[i];
+			}
+			ret = ashmem_unpin(asma, start, end);
+			if (unlikely(ret))
+				goto out_unlock;
+		}
+
+		mutex_unlock(&asma->mutex);
+
+		if (cmd == ASHMEM_PIN_BATCH && ustatus &&
+		    unlikely(copy_to_user(ustatus + done, status,
+					  n * sizeof(status[0]))))
+			return -EFAULT;
+	}
+
+	return 0;
 
+out_unlock:
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -569,10 +1114,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case ASHMEM_SET_SIZE:
 		ret = -EINVAL;
+		mutex_lock(&asma->mutex);
 		if (!asma->file) {
 			ret = 0;
 			asma->size = (size_t) arg;
 		}
+		mutex_unlock(&asma->mutex);
 		break;
 	case ASHMEM_GET_SIZE:
 		ret = asma->size;
@@ -588,11 +1135,15 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
+	case ASHMEM_PIN_BATCH:
+	case ASHMEM_UNPIN_BATCH:
+		ret = ashmem_pin_batch(asma, cmd, (void __user *) arg);
+		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
 			ret = ashmem_shrink(0, GFP_KERNEL);
-			ashmem_shrink(ret, GFP_KERNEL);
+			__ashmem_shrink(ret, GFP_KERNEL, 0);
 		}
 		break;
 	}
@@ -641,6 +1192,9 @@ static int __init ashmem_init(void)
 		return ret;
 	}
 
+	if (unlikely(ashmem_zsetup()))
+		printk(KERN_WARNING "ashmem: no memory for compressed reclaim\n");
+
 	register_shrinker(&ashmem_shrinker);
 
 	printk(KERN_INFO "ashmem: initialized\n");
@@ -653,6 +1207,7 @@ static void __exit ashmem_exit(void)
 	int ret;
 
 	unregister_shrinker(&ashmem_shrinker);
+	ashmem_zteardown();
 
 	ret = misc_deregister(&ashmem_misc);
 	if (unlikely(ret))
@@ -557,12 +557,21 @@ static void free_pcppages_bulk(struct zone *zone, int count,
 		} while (list_empty(list));
 
 		do {
+			int mt;
+
 			page = list_entry(list->prev, struct page, lru);
 			/* must delete as __free_one_page list manipulates */
 			list_del(&page->lru);
-			/* MIGRATE_MOVABLE list may include MIGRATE_RESERVEs */
-			__free_one_page(page, zone, 0, page_private(page));
-			trace_mm_page_pcpu_drain(page, 0, page_private(page));
+			mt = get_pageblock_migratetype(page);
+			/*
+			 * MIGRATE_MOVABLE list may include MIGRATE_RESERVEs
+			 * and MIGRATE_LENTs; a page whose block was isolated
+			 * since it was freed must not go back to those.
+			 */
+			if (likely(mt != MIGRATE_ISOLATE))
+				mt = page_private(page);
+			__free_one_page(page, zone, 0, mt);
+			trace_mm_page_pcpu_drain(page, 0, mt);
 		} while (--to_free && --batch_free && !list_empty(list));
 	}
 	__mod_zone_page_state(zone, NR_FREE_PAGES, count);
@@ -745,13 +754,19 @@ struct page *__rmqueue_smallest(struct zone *zone, unsigned int order,
 
 /*
  * This array describes the order lists are fallen back to when
- * the free lists for the desirable migrate type are depleted
+ * the free lists for the desirable migrate type are depleted.
+ * Each row ends with MIGRATE_RESERVE.
  */
-static int fallbacks[MIGRATE_TYPES][MIGRATE_TYPES-1] = {
+static int fallbacks[MIGRATE_TYPES][4] = {
 	[MIGRATE_UNMOVABLE]   = { MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE,   MIGRATE_RESERVE },
 	[MIGRATE_RECLAIMABLE] = { MIGRATE_UNMOVABLE,   MIGRATE_MOVABLE,   MIGRATE_RESERVE },
+#ifdef CONFIG_ANDROID_PMEM_LEND
+	[MIGRATE_MOVABLE]     = { MIGRATE_LENT, MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE, MIGRATE_RESERVE },
+	[MIGRATE_LENT]        = { MIGRATE_RESERVE }, /* Never used */
+#else
 	[MIGRATE_MOVABLE]     = { MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE, MIGRATE_RESERVE },
-	[MIGRATE_RESERVE]     = { MIGRATE_RESERVE,     MIGRATE_RESERVE,   MIGRATE_RESERVE }, /* Never used */
+#endif
+	[MIGRATE_RESERVE]     = { MIGRATE_RESERVE }, /* Never used */
 };
 
 /*
@@ -847,12 +862,12 @@ __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
 	/* Find the largest possible block of pages in the other list */
 	for (current_order = MAX_ORDER-1; current_order >= order;
 						--current_order) {
-		for (i = 0; i < MIGRATE_TYPES - 1; i++) {
+		for (i = 0;; i++) {
 			migratetype = fallbacks[start_migratetype][i];
 
 			/* MIGRATE_RESERVE handled later if necessary */
 			if (migratetype == MIGRATE_RESERVE)
-				continue;
+				break;
 
 			area = &(zone->free_area[current_order]);
 			if (list_empty(&area->free_list[migratetype]))
@@ -866,11 +881,13 @@ __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
 			 * If breaking a large block of pages, move all free
 			 * pages to the preferred allocation list. If falling
 			 * back for a reclaimable kernel allocation, be more
-			 * agressive about taking ownership of free pages
+			 * agressive about taking ownership of free pages.
+			 * Lent pageblocks always stay lent.
 			 */
-			if (unlikely(current_order >= (pageblock_order >> 1)) ||
+			if (!is_migrate_lent(migratetype) &&
+			    (unlikely(current_order >= (pageblock_order >> 1)) ||
 					start_migratetype == MIGRATE_RECLAIMABLE ||
-					page_group_by_mobility_disabled) {
+					page_group_by_mobility_disabled)) {
 				unsigned long pages;
 				pages = move_freepages_block(zone, page,
 								start_migratetype);
@@ -889,7 +906,8 @@ __rmqueue_fallback(struct zone *zone, int order, int start_migratetype)
 			rmv_page_order(page);
 
 			/* Take ownership for orders >= pageblock_order */
-			if (current_order >= pageblock_order)
+			if (current_order >= pageblock_order &&
+			    !is_migrate_lent(migratetype))
 				change_pageblock_range(page, current_order,
 							start_migratetype);
 
@@ -966,6 +984,11 @@ static int rmqueue_bulk(struct zone *zone, unsigned int order,
 		else
 			list_add_tail(&page->lru, list);
 		set_page_private(page, migratetype);
+#ifdef CONFIG_ANDROID_PMEM_LEND
+		/* a drained pcp list must give lent pages back as lent */
+		if (is_migrate_lent(get_pageblock_migratetype(page)))
+			set_page_private(page, MIGRATE_LENT);
+#endif
 		list = &page->lru;
 	}
 	__mod_zone_page_state(zone, NR_FREE_PAGES, -(i << order));
@@ -5042,6 +5065,7 @@ int set_migratetype_isolate(struct page *page)
 	 * In future, more migrate types will be able to be isolation target.
 	 */
 	if (get_pageblock_migratetype(page) != MIGRATE_MOVABLE &&
+	    !is_migrate_lent(get_pageblock_migratetype(page)) &&
 	    zone_idx != ZONE_MOVABLE)
 		goto out;
 	set_pageblock_migratetype(page, MIGRATE_ISOLATE);
@@ -5054,7 +5078,7 @@ out:
 	return ret;
 }
 
-void unset_migratetype_isolate(struct page *page)
+void unset_migratetype_isolate(struct page *page, unsigned migratetype)
 {
 	struct zone *zone;
 	unsigned long flags;
@@ -5062,32 +5086,25 @@ void unset_migratetype_isolate(struct page *page)
 	spin_lock_irqsave(&zone->lock, flags);
 	if (get_pageblock_migratetype(page) != MIGRATE_ISOLATE)
 		goto out;
-	set_pageblock_migratetype(page, MIGRATE_MOVABLE);
-	move_freepages_block(zone, page, MIGRATE_MOVABLE);
+	set_pageblock_migratetype(page, migratetype);
+	move_freepages_block(zone, page, migratetype);
 out:
 	spin_unlock_irqrestore(&zone->lock, flags);
 }
 
-#ifdef CONFIG_MEMORY_HOTREMOVE
+#if defined(CONFIG_MEMORY_HOTREMOVE) || defined(CONFIG_ANDROID_PMEM_LEND)
 /*
- * All pages in the range must be isolated before calling this.
+ * Take the free pages of [start_pfn, end_pfn) off the free lists and mark
+ * them reserved. Caller must hold zone->lock.
  */
-void
-__offline_isolated_pages(unsigned long start_pfn, unsigned long end_pfn)
+static void
+__remove_isolated_free_pages(struct zone *zone, unsigned long start_pfn,
+			     unsigned long end_pfn)
 {
 	struct page *page;
-	struct zone *zone;
 	int order, i;
 	unsigned long pfn;
-	unsigned long flags;
-	/* find the first valid pfn */
-	for (pfn = start_pfn; pfn < end_pfn; pfn++)
-		if (pfn_valid(pfn))
-			break;
-	if (pfn == end_pfn)
-		return;
-	zone = page_zone(pfn_to_page(pfn));
-	spin_lock_irqsave(&zone->lock, flags);
+
 	pfn = start_pfn;
 	while (pfn < end_pfn) {
 		if (!pfn_valid(pfn)) {
@@ -5111,6 +5128,99 @@ __offline_isolated_pages(unsigned long start_pfn, unsigned long end_pfn)
 			SetPageReserved((page+i));
 		pfn += (1 << order);
 	}
+}
+#endif
+
+#ifdef CONFIG_MEMORY_HOTREMOVE
+/*
+ * All pages in the range must be isolated before calling this.
+ */
+void
+__offline_isolated_pages(unsigned long start_pfn, unsigned long end_pfn)
+{
+	struct zone *zone;
+	unsigned long pfn;
+	unsigned long flags;
+	/* find the first valid pfn */
+	for (pfn = start_pfn; pfn < end_pfn; pfn++)
+		if (pfn_valid(pfn))
+			break;
+	if (pfn == end_pfn)
+		return;
+	zone = page_zone(pfn_to_page(pfn));
+	spin_lock_irqsave(&zone->lock, flags);
+	__remove_isolated_free_pages(zone, start_pfn, end_pfn);
 	spin_unlock_irqrestore(&zone->lock, flags);
 }
 #endif
+
+#ifdef CONFIG_ANDROID_PMEM_LEND
+/*
+ * Free a pageblock of reserved memory to the allocator as MIGRATE_LENT.
+ * It comes back through reclaim_lent_range().
+ */
+int lend_pageblock(struct page *page)
+{
+	struct page *p = page;
+	unsigned long i;
+
+	/* lent pageblocks would just become unmovable ones */
+	if (page_group_by_mobility_disabled)
+		return -EINVAL;
+
+	for (i = 0; i < pageblock_nr_pages; i++, p++) {
+		__ClearPageReserved(p);
+		set_page_count(p, 0);
+	}
+	set_page_refcounted(page);
+	set_pageblock_migratetype(page, MIGRATE_LENT);
+	__free_pages(page, pageblock_order);
+	totalram_pages += pageblock_nr_pages;
+
+	return 0;
+}
+
+/*
+ * Take an isolated lent range off the free lists for good. A page freed
+ * into the range between test_pages_isolated() and here may still sit on
+ * a per-cpu list or have been handed out, so unlike for memory hotplug the
+ * check is repeated under zone->lock. Returns -EBUSY if any page of the
+ * range is not free on an isolated block.
+ */
+int offline_lent_range(unsigned long start_pfn, unsigned long end_pfn)
+{
+	struct page *page;
+	struct zone *zone;
+	unsigned long pfn;
+	unsigned long flags;
+	int ret = 0;
+
+	for (pfn = start_pfn; pfn < end_pfn; pfn++)
+		if (pfn_valid(pfn))
+			break;
+	if (pfn == end_pfn)
+		return 0;
+	zone = page_zone(pfn_to_page(pfn));
+	spin_lock_irqsave(&zone->lock, flags);
+	pfn = start_pfn;
+	while (pfn < end_pfn) {
+		if (!pfn_valid(pfn)) {
+			pfn++;
+			continue;
+		}
+		page = pfn_to_page(pfn);
+		if (!PageBuddy(page) ||
+		    get_pageblock_migratetype(page) != MIGRATE_ISOLATE ||
+		    pfn + (1 << page_order(page)) > end_pfn) {
+			ret = -EBUSY;
+			break;
+		}
+		pfn += 1 << page_order(page);
+	}
+	if (!ret)
+		__remove_isolated_free_pages(zone, start_pfn, end_pfn);
+	spin_unlock_irqrestore(&zone->lock, flags);
+
+	return ret;
+}
+#endif
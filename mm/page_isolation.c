@@ -5,6 +5,9 @@
 #include <linux/mm.h>
 #include <linux/page-isolation.h>
 #include <linux/pageblock-flags.h>
+#include <linux/migrate.h>
+#include <linux/swap.h>
+#include <linux/sched.h>
 #include "internal.h"
 
 static inline struct page *
@@ -24,6 +27,7 @@ __first_valid_page(unsigned long pfn, unsigned long nr_pages)
  * to be MIGRATE_ISOLATE.
  * @start_pfn: The lower PFN of the range to be isolated.
  * @end_pfn: The upper PFN of the range to be isolated.
+ * @migratetype: The type to restore if isolation fails.
  *
  * Making page-allocation-type to be MIGRATE_ISOLATE means free pages in
  * the range will never be allocated. Any free pages and pages freed in the
@@ -33,7 +37,8 @@ __first_valid_page(unsigned long pfn, unsigned long nr_pages)
  * Returns 0 on success and -EBUSY if any part of range cannot be isolated.
  */
 int
-start_isolate_page_range(unsigned long start_pfn, unsigned long end_pfn)
+start_isolate_page_range(unsigned long start_pfn, unsigned long end_pfn,
+			 unsigned migratetype)
 {
 	unsigned long pfn;
 	unsigned long undo_pfn;
@@ -56,16 +61,17 @@ undo:
 	for (pfn = start_pfn;
 	     pfn < undo_pfn;
 	     pfn += pageblock_nr_pages)
-		unset_migratetype_isolate(pfn_to_page(pfn));
+		unset_migratetype_isolate(pfn_to_page(pfn), migratetype);
 
 	return -EBUSY;
 }
 
 /*
- * Make isolated pages available again.
+ * Make isolated pages available again, as 'migratetype'.
  */
 int
-undo_isolate_page_range(unsigned long start_pfn, unsigned long end_pfn)
+undo_isolate_page_range(unsigned long start_pfn, unsigned long end_pfn,
+			unsigned migratetype)
 {
 	unsigned long pfn;
 	struct page *page;
@@ -77,7 +83,7 @@ undo_isolate_page_range(unsigned long start_pfn, unsigned long end_pfn)
 		page = __first_valid_page(pfn, pageblock_nr_pages);
 		if (!page || get_pageblock_migratetype(page) != MIGRATE_ISOLATE)
 			continue;
-		unset_migratetype_isolate(page);
+		unset_migratetype_isolate(page, migratetype);
 	}
 	return 0;
 }
@@ -140,3 +146,79 @@ int test_pages_isolated(unsigned long start_pfn, unsigned long end_pfn)
 	spin_unlock_irqrestore(&zone->lock, flags);
 	return ret ? 0 : -EBUSY;
 }
+
+#ifdef CONFIG_ANDROID_PMEM_LEND
+static struct page *
+lent_migrate_alloc(struct page *page, unsigned long private, int **x)
+{
+	return alloc_page(GFP_HIGHUSER_MOVABLE);
+}
+
+/*
+ * Move the in-use pages of [start_pfn, end_pfn) elsewhere. Pages that are
+ * not on the LRU right now, or fail to migrate, are left for a retry.
+ */
+static void migrate_lent_range(unsigned long start_pfn, unsigned long end_pfn)
+{
+	unsigned long pfn;
+	struct page *page;
+	LIST_HEAD(source);
+
+	for (pfn = start_pfn; pfn < end_pfn; pfn++) {
+		if (!pfn_valid_within(pfn))
+			continue;
+		page = pfn_to_page(pfn);
+		/* We can skip free pages */
+		if (!page_count(page))
+			continue;
+		if (!isolate_lru_page(page))
+			list_add_tail(&page->lru, &source);
+	}
+
+	if (!list_empty(&source))
+		migrate_pages(&source, lent_migrate_alloc, 0);
+}
+
+/*
+ * reclaim_lent_range() -- take back a range given out by lend_pageblock().
+ * @start_pfn: The lower PFN of the range, aligned to pageblock_order.
+ * @end_pfn: The upper PFN of the range, aligned to pageblock_order.
+ * @timeout: How long to keep retrying, in jiffies.
+ *
+ * The range is isolated so that nothing new is allocated from it, and the
+ * pages in use there are migrated away until all of it is free; it is then
+ * taken off the free lists, its pages marked reserved again. Pages pinned
+ * for longer than @timeout (by I/O, say) make this fail with -EBUSY, and
+ * the range is left lent.
+ */
+int reclaim_lent_range(unsigned long start_pfn, unsigned long end_pfn,
+		       unsigned long timeout)
+{
+	unsigned long deadline = jiffies + timeout;
+	int ret;
+
+	ret = start_isolate_page_range(start_pfn, end_pfn, MIGRATE_LENT);
+	if (ret)
+		return ret;
+
+	lru_add_drain_all();
+	for (;;) {
+		migrate_lent_range(start_pfn, end_pfn);
+		drain_all_pages();
+		if (!test_pages_isolated(start_pfn, end_pfn) &&
+		    !offline_lent_range(start_pfn, end_pfn))
+			break;
+		if (time_after(jiffies, deadline)) {
+			undo_isolate_page_range(start_pfn, end_pfn,
+						MIGRATE_LENT);
+			return -EBUSY;
+		}
+		cond_resched();
+		lru_add_drain_all();
+	}
+
+	totalram_pages -= end_pfn - start_pfn;
+
+	return 0;
+}
+#endif
@@ -0,0 +1,109 @@
+/*
+ * linux/mm/vmpressure.c
+ *
+ * Reclaim pressure notifications
+ *
+ * Every shrink_zone() pass reports how many pages it scanned and how many
+ * it managed to reclaim. Once a zone has seen a window's worth of scanning,
+ * the ratio of the two is turned into a pressure level and passed to the
+ * registered notifiers. Listeners such as the Android low memory killer
+ * get told about trouble while reclaim is still running, instead of having
+ * to poll from a shrinker.
+ *
+ * Notifiers are called from reclaim context with no locks held; they must
+ * not sleep or allocate, and should defer any real work.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mmzone.h>
+#include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/vmpressure.h>
+
+/* scanned pages per zone between two level updates */
+static unsigned long vmpressure_window = SWAP_CLUSTER_MAX * 16;
+
+/* share of scanned pages left unreclaimed, in percent */
+static unsigned int vmpressure_level_medium = 60;
+static unsigned int vmpressure_level_critical = 95;
+
+static DEFINE_SPINLOCK(vmpressure_lock);
+static ATOMIC_NOTIFIER_HEAD(vmpressure_chain);
+
+static enum vmpressure_level vmpressure_calc_level(unsigned long scanned,
+						   unsigned long reclaimed)
+{
+	unsigned long pressure;
+
+	/* reclaim may free more than it scanned, e.g. via the swap cache */
+	if (reclaimed >= scanned)
+		return VMPRESSURE_LOW;
+
+	pressure = (scanned - reclaimed) * 100 / scanned;
+	if (pressure >= vmpressure_level_critical)
+		return VMPRESSURE_CRITICAL;
+	if (pressure >= vmpressure_level_medium)
+		return VMPRESSURE_MEDIUM;
+	return VMPRESSURE_LOW;
+}
+
+/**
+ * vmpressure() - account a reclaim pass
+ * @gfp:	reclaimer's gfp mask
+ * @zone:	zone that was scanned
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * Called from shrink_zone(). Whenever the zone has accumulated a window of
+ * scanned pages the notifiers are called with that window's pressure level
+ * and the zone. No level is kept between windows.
+ */
+void vmpressure(gfp_t gfp, struct zone *zone, unsigned long scanned,
+		unsigned long reclaimed)
+{
+	enum vmpressure_level level;
+
+	/*
+	 * Allocations that can neither do IO nor use highmem or movable
+	 * memory say little about the memory state as a whole.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_lock);
+	zone->vmpressure_scanned += scanned;
+	zone->vmpressure_reclaimed += reclaimed;
+	if (zone->vmpressure_scanned < vmpressure_window) {
+		spin_unlock(&vmpressure_lock);
+		return;
+	}
+	level = vmpressure_calc_level(zone->vmpressure_scanned,
+				      zone->vmpressure_reclaimed);
+	zone->vmpressure_scanned = 0;
+	zone->vmpressure_reclaimed = 0;
+	spin_unlock(&vmpressure_lock);
+
+	atomic_notifier_call_chain(&vmpressure_chain, level, zone);
+}
+
+int vmpressure_register_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&vmpressure_chain, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_register_notifier);
+
+int vmpressure_unregister_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&vmpressure_chain, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_unregister_notifier);
+
+module_param_named(window, vmpressure_window, ulong, S_IRUGO | S_IWUSR);
+module_param_named(level_medium, vmpressure_level_medium, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(level_critical, vmpressure_level_critical, uint,
+		   S_IRUGO | S_IWUSR);
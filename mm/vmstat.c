@@ -398,6 +398,9 @@ static char * const migratetype_names[MIGRATE_TYPES] = {
 	"Reclaimable",
 	"Movable",
 	"Reserve",
+#ifdef CONFIG_ANDROID_PMEM_LEND
+	"Lent",
+#endif
 	"Isolate",
 };
 